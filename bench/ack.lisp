@@ -0,0 +1,11 @@
+(defun ack (m n)
+	(if (= m 0)
+		(+ n 1)
+		(if (= n 0)
+			(ack (- m 1) 1)
+			(ack (- m 1) (ack m (- n 1))))))
+(defun ackrep (n)
+	(if (= n 1)
+		(ack 3 5)
+		(+ (ackrep (/ n 2)) (ackrep (- n (/ n 2))))))
+(ackrep 300)
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+//------------------------------------------------------
+// benchmark driver: runs each script with several worker counts and
+// reports the median and percentiles of the wall time, the speedup
+// over the first worker count and the parallel efficiency
+// usage: lispbench [-lisp path] [-dir dir] [-workers 1,2,4] [-runs n]
+//                  [-json file] [name...]
+
+struct Bench {
+	const char *name;
+	const char *file;   /* in the bench dir, NULL if generated */
+	const char *opt;    /* extra lisp option */
+	const char *expect; /* last line of the output */
+	int nfunc;          /* generated compile script */
+	int nbranch;
+};
+
+static Bench benchs[] = {
+	// spawn in every call
+	{ "fib",           "fib.lisp",           NULL,     "5702887",  0, 0 },
+	// calls in arguments, no spawn
+	{ "tak",           "tak.lisp",           NULL,     "18",       0, 0 },
+	// deep recursion under a balanced spawn tree
+	{ "ack",           "ack.lisp",           NULL,     "75900",    0, 0 },
+	// 12 queens on bit masks, a task per candidate column
+	{ "nqueens",       "nqueens.lisp",       NULL,     "14200",    0, 0 },
+	// 2^23 empty leaves, task creation and join
+	{ "spawn-deep",    "spawn-deep.lisp",    NULL,     "8388608",  0, 0 },
+	// 8 coarse leaves, load balance
+	{ "spawn-shallow", "spawn-shallow.lisp", NULL,     "16777216", 0, 0 },
+	// puthash and remhash on one table of 10^6 keys, gethash in parallel
+	{ "hash",          "hash.lisp",          NULL,     "374999750000", 0, 0 },
+	// lists built and dropped in parallel leaves, collections under load
+	{ "list",          "list.lisp",          NULL,     "1317273600", 0, 0 },
+	// a line printed by each of 10^6 leaves, per-thread buffers
+	{ "print",         "print.lisp",         NULL,     "500000500000", 0, 0 },
+	// the same in the order of the leaves
+	{ "print-ordered", "print.lisp",  "-ordered-output", "500000500000", 0, 0 },
+	// codegen and opt of large functions
+	{ "compile-large", NULL,                 NULL,     NULL,       20, 300 },
+	// many small defuns compiled in parallel
+	{ "compile-many",  NULL,                 "-batch", NULL,       2000, 5 },
+};
+
+#define BENCH_COUNT ((int)(sizeof(benchs) / sizeof(benchs[0])))
+#define WORKER_MAX 19 /* lisp -worker limit */
+#define OUTPUT_MAX 4096
+
+struct Result {
+	int workers;
+	bool ok;
+	double median;
+	double p10;
+	double p90;
+	double min;
+	double max;
+	double speedup;
+	double efficiency;
+};
+
+//------------------------------------------------------
+// same script as bench/compile.sh, f<n-1> returns nbranch + 3
+static bool genCompileScript(const char *fname, int nfunc, int nbranch) {
+	FILE *fp = fopen(fname, "w");
+	if(fp == NULL) return false;
+	fprintf(fp, "(defun dec (x) (- x 1))\n");
+	for(int f=0; f<nfunc; f++) {
+		fprintf(fp, "(defun f%d (a b c)\n", f);
+		for(int i=0; i<nbranch; i++) {
+			if(f > 0 && i % 50 == 0) {
+				fprintf(fp, " (if (< a %d) (f%d (- a 1) (+ b %d) c)\n", i, f - 1, i);
+			} else {
+				fprintf(fp, " (if (< a %d) (+ (* b %d) (- c %d) (dec a))\n", i, i % 7 + 1, i);
+			}
+		}
+		fprintf(fp, " (+ a b c)");
+		for(int i=0; i<nbranch; i++) fprintf(fp, ")");
+		fprintf(fp, ")\n");
+	}
+	fprintf(fp, "(f%d %d 1 2)\n", nfunc - 1, nbranch);
+	return fclose(fp) == 0;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// run the script once, returns the wall time in ms or -1 on error
+static double runOnce(const char *lisp, const char *opt, int workers, const char *file,
+		const char *expect) {
+	int fds[2];
+	if(pipe(fds) == -1) return -1;
+	char wstr[16];
+	snprintf(wstr, sizeof(wstr), "%d", workers);
+	const char *argv[6];
+	int argc = 0;
+	argv[argc++] = lisp;
+	if(opt != NULL) argv[argc++] = opt;
+	argv[argc++] = "-worker";
+	argv[argc++] = wstr;
+	argv[argc++] = file;
+	argv[argc] = NULL;
+	double start = now();
+	pid_t pid = fork();
+	if(pid == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if(pid == 0) {
+		dup2(fds[1], 1);
+		close(fds[0]);
+		close(fds[1]);
+		execv(lisp, (char **)argv);
+		_exit(127);
+	}
+	close(fds[1]);
+	// keep the tail of the output
+	char buf[OUTPUT_MAX];
+	int len = 0;
+	ssize_t n;
+	char tmp[OUTPUT_MAX];
+	while((n = read(fds[0], tmp, sizeof(tmp))) > 0) {
+		if(len + n > OUTPUT_MAX) {
+			int keep = OUTPUT_MAX - n > len ? len : OUTPUT_MAX - n;
+			memmove(buf, buf + len - keep, keep);
+			len = keep;
+		}
+		memcpy(buf + len, tmp, n);
+		len += n;
+	}
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	double time = now() - start;
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: exit status %d\n", file, status);
+		return -1;
+	}
+	// last line
+	while(len > 0 && buf[len - 1] == '\n') len--;
+	int b = len;
+	while(b > 0 && buf[b - 1] != '\n') b--;
+	if((int)strlen(expect) != len - b || memcmp(buf + b, expect, len - b) != 0) {
+		fprintf(stderr, "%s: wrong result \"%.*s\", expected %s\n", file, len - b, buf + b, expect);
+		return -1;
+	}
+	return time;
+}
+
+static int cmpDouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// nearest rank on sorted times
+static double percentile(double *t, int n, int p) {
+	int k = (p * n + 99) / 100;
+	return t[k < 1 ? 0 : k - 1];
+}
+
+static void runBench(const char *lisp, Bench *b, const char *file, const char *expect,
+		int *workers, int nworkers, int runs, Result *res) {
+	double *times = new double[runs];
+	for(int w=0; w<nworkers; w++) {
+		Result *r = &res[w];
+		r->workers = workers[w];
+		r->ok = runOnce(lisp, b->opt, workers[w], file, expect) >= 0; // warm up
+		for(int i=0; r->ok && i<runs; i++) {
+			times[i] = runOnce(lisp, b->opt, workers[w], file, expect);
+			r->ok = times[i] >= 0;
+		}
+		if(!r->ok) {
+			printf("%-14s %7d  failed\n", b->name, workers[w]);
+			continue;
+		}
+		qsort(times, runs, sizeof(double), cmpDouble);
+		r->median = runs % 2 == 1 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+		r->p10 = percentile(times, runs, 10);
+		r->p90 = percentile(times, runs, 90);
+		r->min = times[0];
+		r->max = times[runs - 1];
+		// relative to the first worker count
+		Result *base = &res[0];
+		r->speedup = base->ok ? base->median / r->median : 0;
+		r->efficiency = r->speedup * base->workers / r->workers;
+		printf("%-14s %7d %9.1f %9.1f %9.1f %8.2f %6.2f\n", b->name, r->workers,
+				r->median, r->p10, r->p90, r->speedup, r->efficiency);
+		fflush(stdout);
+	}
+	delete [] times;
+}
+
+//------------------------------------------------------
+static void writeJson(FILE *fp, const char *lisp, int runs, Bench **sel, int nsel,
+		Result *res, int nworkers) {
+	char date[32];
+	time_t t = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"lisp\": \"%s\",\n", lisp);
+	fprintf(fp, "  \"date\": \"%s\",\n", date);
+	fprintf(fp, "  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(fp, "  \"runs\": %d,\n", runs);
+	fprintf(fp, "  \"benchmarks\": [\n");
+	for(int i=0; i<nsel; i++) {
+		fprintf(fp, "    {\n");
+		fprintf(fp, "      \"name\": \"%s\",\n", sel[i]->name);
+		fprintf(fp, "      \"results\": [\n");
+		for(int w=0; w<nworkers; w++) {
+			Result *r = &res[i * nworkers + w];
+			fprintf(fp, "        { \"workers\": %d, ", r->workers);
+			if(r->ok) {
+				fprintf(fp, "\"median_ms\": %.3f, \"p10_ms\": %.3f, \"p90_ms\": %.3f, "
+						"\"min_ms\": %.3f, \"max_ms\": %.3f, \"speedup\": %.3f, \"efficiency\": %.3f }",
+						r->median, r->p10, r->p90, r->min, r->max, r->speedup, r->efficiency);
+			} else {
+				fprintf(fp, "\"error\": true }");
+			}
+			fprintf(fp, w < nworkers - 1 ? ",\n" : "\n");
+		}
+		fprintf(fp, "      ]\n");
+		fprintf(fp, i < nsel - 1 ? "    },\n" : "    }\n");
+	}
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+}
+
+// "1,2,4"
+static int parseWorkers(const char *s, int *workers) {
+	int n = 0;
+	while(*s != '\0' && n < WORKER_MAX) {
+		int w = atoi(s);
+		if(w < 1 || w > WORKER_MAX) return 0;
+		workers[n++] = w;
+		s = strchr(s, ',');
+		if(s == NULL) break;
+		s++;
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	const char *lisp = "./lisp";
+	const char *dir = "bench";
+	const char *json = NULL;
+	int runs = 5;
+	int workers[WORKER_MAX];
+	int nworkers = 0;
+	Bench *sel[BENCH_COUNT];
+	int nsel = 0;
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-lisp") == 0 && i + 1 < argc) {
+			lisp = argv[++i];
+		} else if(strcmp(argv[i], "-dir") == 0 && i + 1 < argc) {
+			dir = argv[++i];
+		} else if(strcmp(argv[i], "-json") == 0 && i + 1 < argc) {
+			json = argv[++i];
+		} else if(strcmp(argv[i], "-runs") == 0 && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-workers") == 0 && i + 1 < argc) {
+			nworkers = parseWorkers(argv[++i], workers);
+			if(nworkers == 0) {
+				fprintf(stderr, "bad worker list: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			int n = 0;
+			for(; n<BENCH_COUNT; n++) {
+				if(strcmp(argv[i], benchs[n].name) == 0) break;
+			}
+			if(n == BENCH_COUNT) {
+				fprintf(stderr, "unknown benchmark: %s\n", argv[i]);
+				return 1;
+			}
+			sel[nsel++] = &benchs[n];
+		}
+	}
+	if(runs < 1) runs = 1;
+	if(nworkers == 0) {
+		// 1, 2, 4, ... up to the cpus
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		for(int w=1; w<=WORKER_MAX && (w <= cpus || w <= 2); w *= 2) {
+			workers[nworkers++] = w;
+		}
+		if(cpus > workers[nworkers - 1] && cpus <= WORKER_MAX) workers[nworkers++] = cpus;
+	}
+	if(nsel == 0) {
+		for(int i=0; i<BENCH_COUNT; i++) sel[nsel++] = &benchs[i];
+	}
+
+	Result *res = new Result[nsel * nworkers];
+	bool ok = true;
+	printf("%-14s %7s %9s %9s %9s %8s %6s\n", "name", "workers", "median", "p10", "p90",
+			"speedup", "eff");
+	for(int i=0; i<nsel; i++) {
+		Bench *b = sel[i];
+		char file[1024];
+		char expect[32];
+		if(b->file != NULL) {
+			snprintf(file, sizeof(file), "%s/%s", dir, b->file);
+			snprintf(expect, sizeof(expect), "%s", b->expect);
+		} else {
+			snprintf(file, sizeof(file), "/tmp/lispbench.%d.%s.lisp", (int)getpid(), b->name);
+			snprintf(expect, sizeof(expect), "%d", b->nbranch + 3);
+			if(!genCompileScript(file, b->nfunc, b->nbranch)) {
+				fprintf(stderr, "cannot write %s\n", file);
+				return 1;
+			}
+		}
+		runBench(lisp, b, file, expect, workers, nworkers, runs, &res[i * nworkers]);
+		if(b->file == NULL) unlink(file);
+		for(int w=0; w<nworkers; w++) ok = ok && res[i * nworkers + w].ok;
+	}
+
+	if(json != NULL) {
+		FILE *fp = fopen(json, "w");
+		if(fp == NULL) {
+			fprintf(stderr, "cannot write %s\n", json);
+			return 1;
+		}
+		writeJson(fp, lisp, runs, sel, nsel, res, nworkers);
+		fclose(fp);
+		printf("wrote %s\n", json);
+	}
+	delete [] res;
+	return ok ? 0 : 1;
+}
+
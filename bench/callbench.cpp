@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "liblisp.h"
+
+//------------------------------------------------------
+// liblisp call overhead: ns per call of a small function through the
+// worker pool, on the calling thread and batched, and a spawning
+// function for comparison. then the spawning function from several
+// threads while lisp_load reoptimizes it, and through the pool from
+// more threads than the pool has tasks. uses only the C API
+// usage: callbench [-n calls] [-worker n] [-thread n]
+
+static const char *src =
+	"(defun add3 (a b c) (+ a b c))\n"
+	"(defun fib (n) (if (< n 3) 1 (+ (fib (- n 1)) (fib (- n 2)))))\n";
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+enum {
+	MODE_POOL,
+	MODE_HERE,
+	MODE_BATCH,
+};
+
+// ns per call, checks the results
+static double run(lisp_ctx *lc, lisp_caller *c, lisp_func *f, int mode,
+		lisp_value *args, lisp_value *rets, int n, int64_t (*expect)(lisp_value *)) {
+	int argc = lisp_func_argc(f);
+	double start = now();
+	if(mode == MODE_BATCH) {
+		lisp_call_batch(c, f, args, n, rets);
+	} else {
+		for(int i=0; i<n; i++) {
+			if(mode == MODE_POOL) lisp_call(lc, f, args + i * argc, &rets[i]);
+			else lisp_call_here(c, f, args + i * argc, &rets[i]);
+		}
+	}
+	double ns = (now() - start) / n;
+	for(int i=0; i<n; i++) {
+		if(rets[i].i != expect(args + i * argc)) {
+			fprintf(stderr, "wrong result at %d: %lld\n", i, (long long)rets[i].i);
+			exit(1);
+		}
+	}
+	return ns;
+}
+
+static int64_t add3(lisp_value *a) {
+	return a[0].i + a[1].i + a[2].i;
+}
+
+static int64_t fib(lisp_value *a) {
+	int64_t x = 1, y = 1;
+	for(int64_t i=2; i<a[0].i; i++) {
+		int64_t t = x + y;
+		x = y;
+		y = t;
+	}
+	return y;
+}
+
+//------------------------------------------------------
+// calls from several threads, each on its own part of args
+
+struct CallerArg {
+	lisp_ctx *lc;
+	lisp_func *f;
+	int mode;
+	lisp_value *args;
+	lisp_value *rets;
+	int n;
+	int64_t (*expect)(lisp_value *);
+	volatile int *running;
+};
+
+static void *callerMain(void *p) {
+	CallerArg *a = (CallerArg *)p;
+	lisp_caller *c = lisp_caller_new(a->lc);
+	run(a->lc, c, a->f, a->mode, a->args, a->rets, a->n, a->expect);
+	lisp_caller_free(c);
+	__sync_fetch_and_sub(a->running, 1);
+	return NULL;
+}
+
+// ns per call of all threads. with load, the main thread defines
+// functions until the calls end, each load reoptimizes the hot ones
+static double runThreads(lisp_ctx *lc, lisp_func *f, int mode, int nth, bool load,
+		lisp_value *args, lisp_value *rets, int n, int64_t (*expect)(lisp_value *)) {
+	int argc = lisp_func_argc(f);
+	pthread_t *th = new pthread_t[nth];
+	CallerArg *ca = new CallerArg[nth];
+	volatile int running = nth;
+	double start = now();
+	for(int i=0; i<nth; i++) {
+		CallerArg *a = &ca[i];
+		a->lc = lc;
+		a->f = f;
+		a->mode = mode;
+		a->args = args + (size_t)i * n * argc;
+		a->rets = rets + (size_t)i * n;
+		a->n = n;
+		a->expect = expect;
+		a->running = &running;
+		pthread_create(&th[i], NULL, callerMain, a);
+	}
+	for(int k=0; load && running != 0; k++) {
+		char def[64];
+		snprintf(def, sizeof(def), "(defun load%d (a) (+ a %d))\n", k, k);
+		if(lisp_load(lc, def, strlen(def)) != 0) {
+			fprintf(stderr, "load failed\n");
+			exit(1);
+		}
+	}
+	for(int i=0; i<nth; i++) pthread_join(th[i], NULL);
+	double ns = (now() - start) / ((double)n * nth);
+	delete [] th;
+	delete [] ca;
+	return ns;
+}
+
+int main(int argc, char **argv) {
+	int n = 1000000;
+	int workers = 0;
+	int nth = 4;
+	for(int i=1; i+1<argc; i+=2) {
+		if(strcmp(argv[i], "-n") == 0) n = atoi(argv[i + 1]);
+		else if(strcmp(argv[i], "-worker") == 0) workers = atoi(argv[i + 1]);
+		else if(strcmp(argv[i], "-thread") == 0) nth = atoi(argv[i + 1]);
+	}
+	if(n < 1) n = 1;
+	if(nth < 1) nth = 1;
+	lisp_ctx *lc = lisp_new(workers);
+	if(lc == NULL || lisp_load(lc, src, strlen(src)) != 0) {
+		fprintf(stderr, "load failed\n");
+		return 1;
+	}
+	lisp_caller *c = lisp_caller_new(lc);
+	lisp_func *fadd = lisp_func_get(lc, "add3");
+	lisp_func *ffib = lisp_func_get(lc, "fib");
+	lisp_value *args = new lisp_value[(size_t)n * 3];
+	lisp_value *rets = new lisp_value[n];
+	for(int i=0; i<n * 3; i++) args[i].i = i;
+
+	static const char *modes[] = { "pool", "here", "batch" };
+	printf("%-10s %-6s %10s %10s\n", "func", "mode", "calls", "ns/call");
+	for(int m=0; m<3; m++) {
+		double ns = run(lc, c, fadd, m, args, rets, n, add3);
+		printf("%-10s %-6s %10d %10.1f\n", "add3", modes[m], n, ns);
+	}
+	// fewer calls of a spawning function
+	int nf = n / 1000 > 0 ? n / 1000 : 1;
+	for(int i=0; i<nf; i++) args[i].i = 15 + i % 5;
+	for(int m=0; m<3; m++) {
+		double ns = run(lc, c, ffib, m, args, rets, nf, fib);
+		printf("%-10s %-6s %10d %10.1f\n", "fib 15-19", modes[m], nf, ns);
+	}
+	delete [] args;
+	delete [] rets;
+	// fib is hot, the first load reoptimizes it while the threads run it
+	int npool = nth * 4;
+	args = new lisp_value[(size_t)nf * npool];
+	rets = new lisp_value[(size_t)nf * npool];
+	for(int i=0; i<nf * npool; i++) args[i].i = 15 + i % 5;
+	double ns = runThreads(lc, ffib, MODE_HERE, nth, true, args, rets, nf, fib);
+	printf("%-10s %-6s %10d %10.1f  %d threads, loading\n", "fib 15-19", modes[MODE_HERE], nf * nth, ns, nth);
+	ns = runThreads(lc, ffib, MODE_POOL, npool, false, args, rets, nf, fib);
+	printf("%-10s %-6s %10d %10.1f  %d threads\n", "fib 15-19", modes[MODE_POOL], nf * npool, ns, npool);
+	delete [] args;
+	delete [] rets;
+	lisp_caller_free(c);
+	lisp_free(lc);
+	return 0;
+}
+
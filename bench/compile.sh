@@ -0,0 +1,31 @@
+#!/bin/sh
+# compile time benchmark: defines synthetic large functions
+# usage: bench/compile.sh [lisp] [functions] [branches]
+LISP=${1:-./lisp}
+NFUNC=${2:-20}
+NBRANCH=${3:-300}
+SRC=/tmp/lisp_bench_compile.$$.lisp
+
+awk -v nf=$NFUNC -v nb=$NBRANCH 'BEGIN {
+	printf("(defun dec (x) (- x 1))\n");
+	for(f = 0; f < nf; f++) {
+		printf("(defun f%d (a b c)\n", f);
+		for(i = 0; i < nb; i++) {
+			if(f > 0 && i % 50 == 0) {
+				printf(" (if (< a %d) (f%d (- a 1) (+ b %d) c)\n", i, f - 1, i);
+			} else {
+				printf(" (if (< a %d) (+ (* b %d) (- c %d) (dec a))\n", i, i % 7 + 1, i);
+			}
+		}
+		printf(" (+ a b c)");
+		for(i = 0; i < nb; i++) printf(")");
+		printf(")\n");
+	}
+	printf("(f%d %d 1 2)\n", nf - 1, nb);
+}' > $SRC
+
+START=$(date +%s%N)
+$LISP $SRC > /dev/null
+END=$(date +%s%N)
+echo "$NFUNC defuns x $NBRANCH branches: $(( (END - START) / 1000000 )) ms"
+rm -f $SRC
@@ -0,0 +1,18 @@
+(defun fill (h lo n)
+	(if (= n 1)
+		(puthash h (* lo 7919) lo)
+		(+ (fill h lo (/ n 2)) (fill h (+ lo (/ n 2)) (- n (/ n 2))))))
+(defun sum (h lo n)
+	(if (= n 1)
+		(gethash h (* lo 7919))
+		(+ (sum h lo (/ n 2)) (sum h (+ lo (/ n 2)) (- n (/ n 2))))))
+(defun drop (h lo n)
+	(if (= n 1)
+		(if (remhash h (* lo 7919)) 1 0)
+		(+ (drop h lo (/ n 2)) (drop h (+ lo (/ n 2)) (- n (/ n 2))))))
+(setq h (make-hash))
+(fill h 0 1000000)
+(sum h 0 1000000)
+(sum h 0 1000000)
+(drop h 0 500000)
+(sum h 0 1000000)
@@ -0,0 +1,9 @@
+(defun build (n acc)
+	(if (= n 0) acc (build (- n 1) (cons n acc))))
+(defun total (l acc)
+	(if (= l nil) acc (total (cdr l) (+ acc (car l)))))
+(defun tree (n len)
+	(if (= n 1)
+		(total (build len nil) 0)
+		(+ (tree (/ n 2) len) (tree (- n (/ n 2)) len))))
+(tree 65536 200)
@@ -0,0 +1,15 @@
+(defun low (x) (logand x (- 0 x)))
+(defun free (all cols d1 d2) (logand all (logxor all (logior cols d1 d2))))
+(defun queens (all cols d1 d2 avail)
+	(if (= avail 0)
+		0
+		(+ (queens all cols d1 d2 (logxor avail (low avail)))
+			(if (= (logior cols (low avail)) all)
+				1
+				(queens all (logior cols (low avail))
+					(ash (logior d1 (low avail)) 1)
+					(ash (logior d2 (low avail)) -1)
+					(free all (logior cols (low avail))
+						(ash (logior d1 (low avail)) 1)
+						(ash (logior d2 (low avail)) -1)))))))
+(queens 4095 0 0 0 4095)
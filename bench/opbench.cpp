@@ -0,0 +1,345 @@
+#include "lisp.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+//------------------------------------------------------
+// opcode microbenchmark: a loop of UNROLL copies of one instruction is
+// built with CodeBuilder and run through vmrun. the cost of the loop
+// without the copies is subtracted, so ns/op, ins/op and miss/op are
+// per executed instruction. IPC and the branch miss rate are of the
+// whole run. make opbench runs the threaded and the switch builds
+// usage: opbench [-n iterations] [opname...]
+
+#define UNROLL 32
+#define REPEAT 5
+
+//------------------------------------------------------
+// hardware counters, not available in some containers and VMs
+
+enum {
+	PC_CYCLES,
+	PC_INSTRUCTIONS,
+	PC_BRANCHES,
+	PC_BRANCH_MISSES,
+	PC_COUNT,
+};
+
+static int perffd[PC_COUNT];
+static bool perfok;
+
+static int perfOpen(uint64_t config, int group) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = group == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void perfInit() {
+	static const uint64_t configs[PC_COUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+	perfok = true;
+	for(int i=0; i<PC_COUNT; i++) {
+		perffd[i] = perfOpen(configs[i], i == 0 ? -1 : perffd[0]);
+		if(perffd[i] == -1) perfok = false;
+	}
+	if(!perfok) fprintf(stderr, "perf_event_open failed, counters are not shown\n");
+}
+
+struct Sample {
+	double ns;
+	uint64_t count[PC_COUNT];
+};
+
+//------------------------------------------------------
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static Task task;
+
+static void runCode(Context *ctx, WorkerThread *wth, Code *code, Sample *s) {
+	task.pc = code;
+	task.sp = task.stack + 2;
+	task.stat = TASK_RUN;
+	if(perfok) {
+		ioctl(perffd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(perffd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+	double start = now();
+	ctx->heap->enter();
+	vmrun(ctx, wth, &task);
+	ctx->heap->leave();
+	s->ns = now() - start;
+	memset(s->count, 0, sizeof(s->count));
+	if(perfok) {
+		ioctl(perffd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		uint64_t buf[1 + PC_COUNT];
+		if(read(perffd[0], buf, sizeof(buf)) == sizeof(buf)) {
+			for(int i=0; i<PC_COUNT; i++) s->count[i] = buf[1 + i];
+		}
+	}
+	if(task.stat != TASK_END) {
+		fprintf(stderr, "task did not end\n");
+		exit(1);
+	}
+}
+
+// the fastest of REPEAT runs
+static void measure(Context *ctx, WorkerThread *wth, Code *code, Sample *best) {
+	for(int i=0; i<REPEAT; i++) {
+		Sample s;
+		runCode(ctx, wth, code, &s);
+		if(i == 0 || s.ns < best->ns) *best = s;
+	}
+}
+
+//------------------------------------------------------
+// registers: [0] loop counter, [1] operand, [2] second operand
+// CALL and SPAWN use the frame at SHIFT, FCALL calls an identity function on [1],
+// MEMO calls a memo function whose key [SHIFT] is cached after the first call,
+// HASH looks up a key that is in a table after setting its three arguments,
+// CONS drops the last cell, so its time includes the collections
+
+#define SHIFT 8
+
+static Func *retcFunc;
+static Func *retFunc;
+static Func *memoFunc;
+static Variable *var;
+static Foreign native;
+static int64_t table;
+
+static int64_t nativeId(int64_t x) {
+	return x;
+}
+
+static Func *newCallee(Context *ctx, const char *name, bool retc) {
+	Func *f = newUserFunc(ctx, ctx->symtab->intern(name), 0);
+	CodeBuilder cb(ctx, f, true, false);
+	if(retc) cb.createRetC(1);
+	else cb.createRet(0);
+	cb.createEnd();
+	f->code = cb.getCode();
+	f->codeLength = cb.getCodeLength();
+	f->runcode = f->code;
+	f->runLength = f->codeLength;
+	f->callcount = REOPT_CALLCOUNT;
+	return f;
+}
+
+static Func *newMemoCallee(Context *ctx, const char *name) {
+	Func *f = newUserFunc(ctx, ctx->symtab->intern(name), 1);
+	f->memo = newMemo(1);
+	CodeBuilder cb(ctx, f, true, false);
+	cb.createMemoIns(INS_MEMO, f->memo, 1);
+	cb.createIConst(2, 1);
+	cb.createMemoIns(INS_MEMOSET, f->memo, 1);
+	cb.createRet(2);
+	cb.createEnd();
+	f->code = cb.getCode();
+	f->codeLength = cb.getCodeLength();
+	f->runcode = f->code;
+	f->runLength = f->codeLength;
+	f->callcount = REOPT_CALLCOUNT;
+	return f;
+}
+
+static int64_t operand(int op) {
+	switch(op) {
+	case INS_IMUL: case INS_IMULC:
+	case INS_IDIV: case INS_IDIVC:
+		return 1; // keeps [1]
+	case INS_IMOD: case INS_IMODC:
+		return (int64_t)1 << 40;
+	case INS_ISHL: case INS_ISAR: case INS_ISHR:
+	case INS_ISHLC: case INS_ISARC: case INS_ISHRC:
+		return 1;
+	default:
+		return 3;
+	}
+}
+
+// one instance of op, or the sequence it needs; false if not measured
+static bool genOp(CodeBuilder *cb, int op, const char **name) {
+	switch(op) {
+	case INS_ICONST: cb->createIConst(1, 7); break;
+	case INS_MOV: cb->createMov(1, 2); break;
+	case INS_INEG: cb->createINeg(1); break;
+	case INS_IADD: case INS_ISUB: case INS_IMUL: case INS_IDIV: case INS_IMOD:
+	case INS_ISHL: case INS_ISAR: case INS_ISHR: case INS_IAND: case INS_IOR: case INS_IXOR:
+		cb->createReg2Ins(op, 1, 2);
+		break;
+	case INS_IADDC: case INS_ISUBC: case INS_IMULC: case INS_IDIVC: case INS_IMODC:
+	case INS_ISHLC: case INS_ISARC: case INS_ISHRC: case INS_IANDC: case INS_IORC: case INS_IXORC:
+		cb->createRegIntIns(op, 1, operand(op));
+		break;
+	case INS_IDIVP2: case INS_IMODP2:
+		cb->createRegIntIns(op, 1, 3);
+		break;
+	case INS_IDIVMC: case INS_IMODMC:
+		cb->createMagicIns(op, 1, 7, 0x4924924924924925LL, 1); // x / 7
+		break;
+	case INS_IJMPLT: case INS_IJMPLE: case INS_IJMPGT:
+	case INS_IJMPGE: case INS_IJMPEQ: case INS_IJMPNE:
+		cb->createCondOp(op, 1, 2, 4); // to the next instruction
+		break;
+	case INS_IJMPLTC: case INS_IJMPLEC: case INS_IJMPGTC:
+	case INS_IJMPGEC: case INS_IJMPEQC: case INS_IJMPNEC:
+		cb->createCondOpC(op, 1, 3, 4);
+		break;
+	case INS_JMP: cb->createJmp(2); break;
+	case INS_LOAD_GLOBAL: cb->createLoadGlobal(1, var); break;
+	case INS_STORE_GLOBAL: cb->createStoreGlobal(1, var); break;
+	case INS_CALL:
+		cb->createCall(retcFunc, SHIFT);
+		*name = "CALL+RETC";
+		break;
+	case INS_RET:
+		cb->createCall(retFunc, SHIFT);
+		*name = "CALL+RET";
+		break;
+	case INS_SPAWN:
+		// no free task, so the spawn is called in place
+		cb->createSpawn(retcFunc, SHIFT);
+		cb->createJoin(SHIFT - 3);
+		*name = "SPAWN+RETC+JOIN";
+		break;
+	case INS_FCALL: cb->createForeignIns(op, &native, 1); break;
+	case INS_MEMO:
+		cb->createCall(memoFunc, SHIFT);
+		*name = "CALL+MEMO hit";
+		break;
+	case INS_HASH:
+		cb->createIConst(SHIFT, table);
+		cb->createIConst(SHIFT + 1, 1);
+		cb->createIConst(SHIFT + 2, 0);
+		cb->createRegIntIns(op, SHIFT, HK_GET);
+		*name = "ICONST x3+HASH";
+		break;
+	case INS_CONS: cb->createRegIns(op, SHIFT); break;
+	default:
+		// RETC and JOIN are in the sequences above, MEMOSET runs once,
+		// the others print, compile or end the task
+		return false;
+	}
+	return true;
+}
+
+static Code *genLoop(Context *ctx, int op, int64_t n, int unroll, const char **name) {
+	CodeBuilder cb(ctx, NULL, true, false);
+	cb.createIConst(0, n);
+	cb.createIConst(1, 1000003);
+	cb.createIConst(2, op == INS_IJMPLT || op == INS_IJMPLE || op == INS_IJMPGT ||
+			op == INS_IJMPGE || op == INS_IJMPEQ || op == INS_IJMPNE ? 3 : operand(op));
+	int head = cb.getCodeLength();
+	for(int i=0; i<unroll; i++) {
+		if(!genOp(&cb, op, name)) return NULL;
+	}
+	cb.createISubC(0, 1);
+	int lb = cb.getCodeLength();
+	cb.createCondOpC(INS_IJMPGTC, 0, 0, head - lb);
+	cb.createEnd();
+	return cb.getCode();
+}
+
+//------------------------------------------------------
+int main(int argc, char **argv) {
+	int64_t n = 1 << 18;
+	const char **filter = new const char *[argc];
+	int nfilter = 0;
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			n = atoll(argv[++i]);
+			if(n < 1) n = 1;
+		} else {
+			filter[nfilter++] = argv[i];
+		}
+	}
+	Context *ctx = new Context();
+	ctx->workers = 1;
+	ctx->sche->initWorkers();
+	retcFunc = newCallee(ctx, "opbench-retc", true);
+	retFunc = newCallee(ctx, "opbench-ret", false);
+	memoFunc = newMemoCallee(ctx, "opbench-memo");
+	while(!ctx->sche->isTaskEmpty()) ctx->sche->newTask(retcFunc, NULL);
+	var = new Variable();
+	var->value.i = 0;
+	var->type = VT_INT;
+	var->name = ctx->symtab->intern("opbench-var");
+	native.fn = (void *)nativeId;
+	native.lib = NULL;
+	native.name = ctx->symtab->intern("opbench-native");
+	native.argc = 1;
+	native.intargs = 0;
+	native.rtype = FT_LONG;
+	Value args[3];
+	table = hashOp(ctx, HK_NEW, args);
+	args[0].i = table;
+	args[1].i = 1;
+	args[2].i = 1;
+	hashOp(ctx, HK_PUT, args);
+	WorkerThread wth;
+	wth.ctx = ctx;
+	wth.sche = ctx->sche;
+	wth.id = 0;
+	wth.curtask = NULL;
+	initOutBuf(&wth.out);
+	ctx->heap->addThread(&wth);
+	perfInit();
+
+#ifdef USING_THCODE
+	printf("dispatch: direct threaded code\n");
+#else
+	printf("dispatch: switch\n");
+#endif
+	printf("%-16s %8s %8s %6s %8s %8s\n", "op", "ns/op", "ins/op", "IPC", "br-miss%", "miss/op");
+	const char *none = NULL;
+	Code *empty = genLoop(ctx, INS_ICONST, n, 0, &none);
+	Sample base;
+	measure(ctx, &wth, empty, &base);
+	double ops = (double)n * UNROLL;
+	for(int op=0; op<INS_COUNT; op++) {
+		const char *name = ctx->getInstName(op);
+		bool sel = nfilter == 0;
+		for(int i=0; i<nfilter; i++) {
+			if(strcasecmp(filter[i], name) == 0) sel = true;
+		}
+		if(!sel) continue;
+		Code *code = genLoop(ctx, op, n, UNROLL, &name);
+		if(code == NULL) continue;
+		Sample s;
+		measure(ctx, &wth, code, &s);
+		double ns = (s.ns - base.ns) / ops;
+		if(perfok) {
+			double ins = (double)(s.count[PC_INSTRUCTIONS] - base.count[PC_INSTRUCTIONS]) / ops;
+			double ipc = s.count[PC_CYCLES] != 0 ?
+				(double)s.count[PC_INSTRUCTIONS] / s.count[PC_CYCLES] : 0;
+			double rate = s.count[PC_BRANCHES] != 0 ?
+				100.0 * s.count[PC_BRANCH_MISSES] / s.count[PC_BRANCHES] : 0;
+			double miss = ((double)s.count[PC_BRANCH_MISSES] - base.count[PC_BRANCH_MISSES]) / ops;
+			printf("%-16s %8.2f %8.1f %6.2f %8.2f %8.3f\n", name, ns, ins, ipc, rate, miss);
+		} else {
+			printf("%-16s %8.2f %8s %6s %8s %8s\n", name, ns, "-", "-", "-", "-");
+		}
+		delete [] code;
+	}
+	delete [] empty;
+	delete [] filter;
+	return 0;
+}
+
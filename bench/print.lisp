@@ -0,0 +1,5 @@
+(defun show (lo hi)
+	(if (= lo hi)
+		(print lo)
+		(+ (show lo (/ (+ lo hi) 2)) (show (+ (/ (+ lo hi) 2) 1) hi))))
+(show 1 1000000)
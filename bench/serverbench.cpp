@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+//------------------------------------------------------
+// evaluation server benchmark: each client connection sends one form at
+// a time and waits for the answer. reports requests per second and the
+// latency percentiles over all clients. with -lisp the server is started
+// and stopped here, otherwise it must be listening on -sock
+// usage: serverbench [-lisp path] [-sock path] [-clients n] [-requests n]
+//                    [-def form] [-form form] [-expect line]
+
+static const char *sockpath = "/tmp/lispbench.sock";
+static const char *defform = "(defun fib (n) (if (< n 3) 1 (+ (fib (- n 1)) (fib (- n 2)))))";
+static const char *form = "(fib 15)";
+static const char *expect = "610";
+static int nrequests = 1000; /* per client */
+
+struct Client {
+	pthread_t pth;
+	double *lat; /* ns of each request */
+	int errors;
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int connectServer() {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool writeAll(int fd, const char *s, size_t len) {
+	while(len > 0) {
+		ssize_t n = write(fd, s, len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		s += n;
+		len -= n;
+	}
+	return true;
+}
+
+// sends src and reads the answer up to the empty line into buf
+static bool request(int fd, const char *src, char *buf, size_t size) {
+	if(!writeAll(fd, src, strlen(src)) || !writeAll(fd, "\n", 1)) return false;
+	// one request at a time, so everything read is this answer
+	size_t len = 0;
+	while(len == 0 || buf[len - 1] != '\n' || (len > 1 && buf[len - 2] != '\n')) {
+		if(len == size - 1) return false;
+		ssize_t n = read(fd, buf + len, size - 1 - len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		len += n;
+	}
+	buf[len] = '\0';
+	return true;
+}
+
+static void *clientMain(void *arg) {
+	Client *c = (Client *)arg;
+	char buf[4096];
+	int fd = connectServer();
+	if(fd == -1) {
+		c->errors = nrequests;
+		return NULL;
+	}
+	size_t elen = strlen(expect);
+	for(int i=0; i<nrequests; i++) {
+		double start = now();
+		bool ok = request(fd, form, buf, sizeof(buf));
+		c->lat[i] = now() - start;
+		if(!ok) {
+			c->errors += nrequests - i;
+			break;
+		}
+		if(elen != 0 && (strncmp(buf, expect, elen) != 0 || buf[elen] != '\n')) c->errors++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static int cmpDouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+//------------------------------------------------------
+static pid_t startServer(const char *lisp) {
+	unlink(sockpath);
+	pid_t pid = fork();
+	if(pid == 0) {
+		execl(lisp, lisp, "-server", sockpath, (char *)NULL);
+		_exit(127);
+	}
+	// wait for the socket
+	for(int i=0; i<500; i++) {
+		int fd = connectServer();
+		if(fd != -1) {
+			close(fd);
+			return pid;
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "server did not start\n");
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	const char *lisp = NULL;
+	int nclients = 8;
+	for(int i=1; i<argc; i++) {
+		if(i + 1 == argc) {
+			fprintf(stderr, "missing argument of %s\n", argv[i]);
+			return 1;
+		} else if(strcmp(argv[i], "-lisp") == 0) {
+			lisp = argv[++i];
+		} else if(strcmp(argv[i], "-sock") == 0) {
+			sockpath = argv[++i];
+		} else if(strcmp(argv[i], "-clients") == 0) {
+			nclients = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-requests") == 0) {
+			nrequests = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-def") == 0) {
+			defform = argv[++i];
+		} else if(strcmp(argv[i], "-form") == 0) {
+			form = argv[++i];
+		} else if(strcmp(argv[i], "-expect") == 0) {
+			expect = argv[++i];
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if(nclients < 1 || nrequests < 1) {
+		fprintf(stderr, "error\n");
+		return 1;
+	}
+	pid_t pid = lisp != NULL ? startServer(lisp) : 0;
+	if(pid == -1) return 1;
+
+	// definitions are shared, so one connection defines them
+	char buf[4096];
+	int fd = connectServer();
+	if(fd == -1 || (defform[0] != '\0' && !request(fd, defform, buf, sizeof(buf)))) {
+		fprintf(stderr, "cannot connect to %s\n", sockpath);
+		return 1;
+	}
+	close(fd);
+
+	Client *clients = new Client[nclients];
+	double *lat = new double[(size_t)nclients * nrequests];
+	double start = now();
+	for(int i=0; i<nclients; i++) {
+		clients[i].lat = lat + (size_t)i * nrequests;
+		clients[i].errors = 0;
+		pthread_create(&clients[i].pth, NULL, clientMain, &clients[i]);
+	}
+	int errors = 0;
+	for(int i=0; i<nclients; i++) {
+		pthread_join(clients[i].pth, NULL);
+		errors += clients[i].errors;
+	}
+	double sec = (now() - start) / 1e9;
+
+	int n = nclients * nrequests;
+	qsort(lat, n, sizeof(double), cmpDouble);
+	printf("clients %d, requests %d, form %s\n", nclients, n, form);
+	printf("%10s %10s %10s %10s %10s\n", "req/s", "p50 us", "p90 us", "p99 us", "max us");
+	printf("%10.0f %10.1f %10.1f %10.1f %10.1f\n", n / sec, lat[n / 2] / 1e3,
+			lat[(int)(n * 0.9)] / 1e3, lat[(int)(n * 0.99)] / 1e3, lat[n - 1] / 1e3);
+	if(errors != 0) printf("errors %d\n", errors);
+
+	if(pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	delete [] lat;
+	delete [] clients;
+	return errors != 0;
+}
+
@@ -0,0 +1,5 @@
+(defun tree (d)
+	(if (= d 0)
+		1
+		(+ (tree (- d 1)) (tree (- d 1)))))
+(tree 23)
@@ -0,0 +1,9 @@
+(defun seqtree (d)
+	(if (= d 0)
+		1
+		(- (seqtree (- d 1)) (- 0 (seqtree (- d 1))))))
+(defun leaves (n)
+	(if (= n 1)
+		(seqtree 21)
+		(+ (leaves (/ n 2)) (leaves (- n (/ n 2))))))
+(leaves 8)
@@ -0,0 +1,5 @@
+(defun tak (x y z)
+	(if (<= x y)
+		y
+		(tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))))
+(tak 18 12 6)
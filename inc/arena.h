@@ -0,0 +1,70 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+//------------------------------------------------------
+// bump allocator, everything is released at once by reset
+
+#define ARENA_CHUNKSIZE (1024 * 16)
+
+class Arena {
+private:
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+	};
+	Chunk *head;
+	char *cur;
+	char *end;
+
+	void newChunk(size_t n) {
+		size_t size = n + sizeof(Chunk) > ARENA_CHUNKSIZE ? n + sizeof(Chunk) : ARENA_CHUNKSIZE;
+		if(head != NULL && size < head->size * 2) size = head->size * 2;
+		Chunk *c = (Chunk *)new char[size];
+		c->next = head;
+		c->size = size;
+		head = c;
+		cur = (char *)(c + 1);
+		end = (char *)c + size;
+	}
+public:
+	Arena() {
+		head = NULL;
+		cur = NULL;
+		end = NULL;
+	}
+	~Arena() {
+		while(head != NULL) {
+			Chunk *next = head->next;
+			delete [] (char *)head;
+			head = next;
+		}
+	}
+	void *alloc(size_t n) {
+		n = (n + 15) & ~(size_t)15;
+		if((size_t)(end - cur) < n) newChunk(n);
+		void *p = cur;
+		cur += n;
+		return p;
+	}
+	// keep only the last (largest) chunk for reuse
+	void reset() {
+		if(head == NULL) return;
+		while(head->next != NULL) {
+			Chunk *next = head->next->next;
+			delete [] (char *)head->next;
+			head->next = next;
+		}
+		cur = (char *)(head + 1);
+	}
+};
+
+inline void *operator new(size_t n, Arena *arena) {
+	return arena->alloc(n);
+}
+
+inline void *operator new[](size_t n, Arena *arena) {
+	return arena->alloc(n);
+}
+
+#endif
+
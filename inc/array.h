@@ -9,21 +9,33 @@ private:
 	size_t size;
 	size_t capacity;
 	T *data;
+	Arena *arena; /* buffers are taken from arena if not NULL */
+
+	T *newData(size_t n) {
+		return arena != NULL ? (T *)arena->alloc(sizeof(T) * n) : new T[n];
+	}
 public:
-	ArrayBuilder(int capa = 8) {
+	ArrayBuilder(int capa = 8, Arena *arena = NULL) {
 		size = 0;
 		capacity = capa;
-		data = new T[capacity];
+		this->arena = arena;
+		data = newData(capacity);
+	}
+	ArrayBuilder(Arena *arena) {
+		size = 0;
+		capacity = 8;
+		this->arena = arena;
+		data = newData(capacity);
 	}
 	~ArrayBuilder() {
-		delete [] data;
+		if(arena == NULL) delete [] data;
 	}
 	void add(T v) {
 		if(size == capacity) {
 			capacity *= 2;
-			T *newdata = new T[capacity];
+			T *newdata = newData(capacity);
 			memcpy(newdata, data, sizeof(T) * size);
-			delete [] data;
+			if(arena == NULL) delete [] data;
 			data = newdata;
 		}
 		data[size++] = v;
@@ -45,6 +57,10 @@ public:
 	void clear() {
 		size = 0;
 	}
+	void truncate(size_t n) {
+		assert(n <= size);
+		size = n;
+	}
 	T *toArray() {
 		T *newdata = new T[size];
 		memcpy(newdata, data, sizeof(T) * size);
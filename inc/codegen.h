@@ -1,6 +1,11 @@
 #ifndef CODEGEN_H
 #define CODEGEN_H
 
+// flags in the shift operand of IDIVMC and IMODMC
+#define MAGIC_SHIFT(s) ((s) & 63)
+#define MAGIC_ADD 0x100 /* add the dividend after multiply high */
+#define MAGIC_SUB 0x200 /* subtract the dividend after multiply high */
+
 class CodeBuilder {
 private:
 	Context *ctx;
@@ -10,39 +15,46 @@ private:
 	bool showir;
 
 public:
-	CodeBuilder(Context *_ctx, Func *_func, bool genthc, bool showir);
+	CodeBuilder(Context *_ctx, Func *_func, bool genthc, bool showir, Arena *arena = NULL);
 	
 	void createIns(int ins);
-	void createIntIns(int ins, int n);
-	void createRegIntIns(int ins, int reg, int ival);
+	void createIntIns(int ins, int64_t n);
+	void createRegIntIns(int ins, int reg, int64_t ival);
 	void createRegIns(int ins, int reg);
 	void createReg2Ins(int ins, int reg, int reg2);
 	void createVarIns(int ins, int reg, Variable *var);
 	void createFuncIns(int ins, Func *func, int sftsfp);
 	void createConsIns(int ins, Cons *cons);
+	void createForeignIns(int ins, Foreign *ff, int reg);
+	void createMemoIns(int ins, Memo *m, int reg);
+	void createMagicIns(int ins, int reg, int64_t d, int64_t magic, int shift);
+	void createRace(int reg, int n, int kind);
 	
-	void createIConst(int r, int v) { createRegIntIns(INS_ICONST, r, v); }
+	void createIConst(int r, int64_t v) { createRegIntIns(INS_ICONST, r, v); }
 	void createMov(int r, int r2) { createReg2Ins(INS_MOV, r, r2); }
 	void createIAdd(int r, int r2) { createReg2Ins(INS_IADD, r, r2); }
 	void createISub(int r, int r2) { createReg2Ins(INS_ISUB, r, r2); }
 	void createIMul(int r, int r2) { createReg2Ins(INS_IMUL, r, r2); }
 	void createIDiv(int r, int r2) { createReg2Ins(INS_IDIV, r, r2); }
 	void createIMod(int r, int r2) { createReg2Ins(INS_IMOD, r, r2); }
-	void createIAddC(int r, int v) { createRegIntIns(INS_IADDC, r, v); }
-	void createISubC(int r, int v) { createRegIntIns(INS_ISUBC, r, v); }
+	void createIAddC(int r, int64_t v) { createRegIntIns(INS_IADDC, r, v); }
+	void createISubC(int r, int64_t v) { createRegIntIns(INS_ISUBC, r, v); }
 	void createINeg(int r) { createRegIns(INS_INEG, r); }
 	void createJoin(int r) { createRegIns(INS_JOIN, r); }
+	void createScope(int r) { createRegIns(INS_SCOPE, r); }
 	void createRet(int r) { createRegIns(INS_RET, r); }
-	void createRetC(int n) { createIntIns(INS_RETC, n); }
+	void createRetC(int64_t n) { createIntIns(INS_RETC, n); }
 	void createEnd() { createIns(INS_END); }
 	void createLoadGlobal(int reg, Variable *var) { createVarIns(INS_LOAD_GLOBAL, reg, var); }
 	void createStoreGlobal(int reg, Variable *var) { createVarIns(INS_STORE_GLOBAL, reg, var); }
 	void createPrintInt(int r) { createRegIns(INS_IPRINT, r); }
 	void createPrintBoolean(int r) { createRegIns(INS_BPRINT, r); }
+	void createPrintFloat(int r) { createRegIns(INS_FPRINT, r); }
+	void createPrintList(int r) { createRegIns(INS_LPRINT, r); }
 	void createCall(Func *func, int ss) { createFuncIns(INS_CALL, func, ss); }
 	void createSpawn(Func *func, int ss) { createFuncIns(INS_SPAWN, func, ss); }
 	int  createCondOp(int inst, int a, int b, int offset = 0);
-	int  createCondOpC(int inst, int a, int b, int offset = 0);
+	int  createCondOpC(int inst, int a, int64_t b, int offset = 0);
 	int  createJmp(int offset = 0);
 	void setLabel(int n);
 	Code *getCode();
@@ -52,8 +64,23 @@ public:
 };
 
 ValueType codegen(Cons *cons, CodeBuilder *cb, int sp, bool spawn = false);
-void codeopt(Context *ctx, Func *func);
+Func *defineFunc(Context *ctx, Cons *cons);
+Func *newUserFunc(Context *ctx, const char *name, int argc);
 void defun(Context *ctx, Cons *cons);
+void codeopt(Context *ctx, Func *func);
+void codeunopt(Context *ctx, Func *func);
+void recodeopt(Context *ctx, Func *func);
+bool opt_ssa(Context *ctx, Func *func, bool showir, Arena *arena = NULL);
+
+// instruction properties (opt.cpp)
+int  getOpSize(int i);
+bool isReg2Op(int i);
+bool isReg2COp(int i);
+int  toConstOp(int i);
+bool isCondJmpOp(int i);
+bool isCondJmpCOp(int i);
+int  toRevCondJmpOp(int i);
+int  toSwapCondJmpOp(int i);
 
 #endif
 
@@ -0,0 +1,57 @@
+#ifndef FOREIGN_H
+#define FOREIGN_H
+
+//------------------------------------------------------
+// native functions (defforeign name "lib.so" "symbol" (int long) int)
+// the library is opened and the symbol bound when the form is compiled,
+// "" is the program and the libraries it is linked with. FCALL [foreign] r
+// passes [r, r+argc) in the integer argument registers and writes the
+// result to [r]. it runs on the worker thread's own C stack, so the
+// function must be thread safe and should not block for long
+
+#define FOREIGN_MAXARGS 6
+
+enum ForeignType {
+	FT_INT,  /* C int */
+	FT_LONG, /* int64_t */
+	FT_VOID, /* result only, returns 0 */
+};
+
+struct Foreign {
+	void *fn;
+	void *lib; /* dlopen handle */
+	const char *name; /* atom */
+	int argc;
+	uint32_t intargs; /* bit n: argument n is an int */
+	ForeignType rtype;
+};
+
+// an int is passed sign extended and the upper half of an int result is
+// dropped, as a C caller does
+#define FOREIGN_ARG(n) ((ff->intargs >> (n)) & 1 ? (L)(int)args[n].i : args[n].i)
+static inline int64_t callForeign(Foreign *ff, Value *args) {
+	typedef int64_t L;
+	void *fn = ff->fn;
+	L r;
+	switch(ff->argc) {
+	case 0: r = ((L (*)())fn)(); break;
+	case 1: r = ((L (*)(L))fn)(FOREIGN_ARG(0)); break;
+	case 2: r = ((L (*)(L, L))fn)(FOREIGN_ARG(0), FOREIGN_ARG(1)); break;
+	case 3: r = ((L (*)(L, L, L))fn)(FOREIGN_ARG(0), FOREIGN_ARG(1), FOREIGN_ARG(2)); break;
+	case 4: r = ((L (*)(L, L, L, L))fn)(FOREIGN_ARG(0), FOREIGN_ARG(1), FOREIGN_ARG(2),
+					FOREIGN_ARG(3)); break;
+	case 5: r = ((L (*)(L, L, L, L, L))fn)(FOREIGN_ARG(0), FOREIGN_ARG(1), FOREIGN_ARG(2),
+					FOREIGN_ARG(3), FOREIGN_ARG(4)); break;
+	default: r = ((L (*)(L, L, L, L, L, L))fn)(FOREIGN_ARG(0), FOREIGN_ARG(1), FOREIGN_ARG(2),
+					 FOREIGN_ARG(3), FOREIGN_ARG(4), FOREIGN_ARG(5)); break;
+	}
+	if(ff->rtype == FT_INT) return (int)r;
+	return ff->rtype == FT_VOID ? 0 : r;
+}
+#undef FOREIGN_ARG
+
+ValueType genDefforeign(Func *, Cons *cons, CodeBuilder *cb, int sp);
+void freeForeign(Foreign *ff);
+
+#endif
+
@@ -0,0 +1,98 @@
+#ifndef HASHTAB_H
+#define HASHTAB_H
+
+//------------------------------------------------------
+// concurrent hash table of int64 keys and values, (make-hash) returns
+// the table as an int, its index in the registry of the context. an int
+// that is not one is reported, and the op returns the default of gethash
+// or 0. a reader takes no lock: a node is written before
+// it is linked at the head of its chain, and a removed node or an old
+// bucket array stays until the context is freed. a writer locks the
+// stripe of the key, which owns every bucket of that stripe; growing
+// takes all stripes and copies the chains into a new bucket array.
+// HASH r kind runs op kind with the arguments from [r] and writes [r]
+
+#define HASH_STRIPES  64 /* a power of 2 */
+#define HASH_MINSIZE  256 /* buckets, a multiple of HASH_STRIPES */
+#define HASH_LOAD     1 /* nodes per bucket before growing */
+#define HASH_CHUNK    256 /* nodes allocated at once by a stripe */
+#define HASH_SPIN     100 /* pauses waiting for a stripe before yielding */
+#define HASH_DIRSIZE  256 /* chunks of the registry */
+#define HASH_DIRCHUNK 256 /* tables of a chunk */
+
+enum HashKind {
+	HK_NEW,   /* () */
+	HK_GET,   /* (table key default) */
+	HK_PUT,   /* (table key value), returns value */
+	HK_REM,   /* (table key), T if it was there */
+	HK_COUNT, /* (table) */
+};
+
+struct HashNode {
+	int64_t key;
+	volatile int64_t value;
+	HashNode *volatile next; /* in the chain */
+};
+
+struct HashChunk {
+	HashChunk *next;
+	HashNode nodes[HASH_CHUNK];
+};
+
+struct HashBuckets {
+	int64_t mask;
+	HashNode *volatile *heads;
+	HashBuckets *old; /* the arrays it replaced */
+};
+
+struct HashStripe {
+	volatile int lock;
+	int64_t count;
+	int nfree; /* nodes left in the first chunk */
+	HashChunk *chunks; /* all nodes of the stripe, live or removed */
+} __attribute__((aligned(64)));
+
+struct HashTable {
+	HashStripe stripes[HASH_STRIPES];
+	HashBuckets *volatile buckets;
+};
+
+// a table is written before count is raised past it
+struct HashRegistry {
+	HashTable **chunks[HASH_DIRSIZE];
+	volatile int64_t count;
+	pthread_mutex_t lock; /* make-hash */
+};
+
+static inline uint64_t hashKey(int64_t key) {
+	uint64_t h = (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static inline int hashArgc(int kind) {
+	static const int argc[] = { 0, 3, 3, 2, 1 };
+	return argc[kind];
+}
+
+// NULL if h is not a table of r
+static inline HashTable *getHashTable(HashRegistry *r, int64_t h) {
+	if((uint64_t)h >= (uint64_t)__atomic_load_n(&r->count, __ATOMIC_ACQUIRE)) return NULL;
+	return r->chunks[h / HASH_DIRCHUNK][h % HASH_DIRCHUNK];
+}
+
+static inline int64_t hashGet(HashTable *t, int64_t key, int64_t def) {
+	uint64_t h = hashKey(key);
+	HashBuckets *b = t->buckets;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	for(HashNode *n = b->heads[h & b->mask]; n != NULL; n = n->next) {
+		if(n->key == key) return n->value;
+	}
+	return def;
+}
+
+int64_t hashOp(Context *ctx, int kind, Value *args);
+HashRegistry *newHashRegistry();
+void freeHashTables(HashRegistry *r);
+
+#endif
+
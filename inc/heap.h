@@ -0,0 +1,111 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+//------------------------------------------------------
+// runtime cons cells (cons car cdr list). a thread allocates cells from
+// its own region, by bump or from the free cells a sweep left in it.
+// when no region has free cells and the heap is over its limit, the
+// allocating thread stops the threads running tasks at their next
+// safepoint, and all of them mark from the roots and sweep the regions
+// together. the value slots carry no type, so the roots are scanned
+// conservatively: a word that is the address of a cell keeps it, and
+// cells never move
+
+#define HEAP_MAX      ((int64_t)1 << 30) /* reserved bytes */
+#define HEAP_MINLIMIT ((int64_t)8 << 20) /* bytes before the first collection */
+#define REGION_SIZE   (64 * 1024) /* bytes, a power of 2 */
+#define REGION_CELLS  (REGION_SIZE / 16)
+#define REGION_REUSE  (REGION_CELLS / 8) /* free cells to allocate from a swept region */
+
+struct Cell {
+	Value car;
+	Value cdr;
+};
+
+// at the start of its region, over the first cells
+struct Region {
+	Region *next; /* with free cells */
+	Cell *free; /* linked by car */
+	int64_t nfree;
+	volatile uint64_t marks[REGION_CELLS / 64];
+};
+
+#define REGION_FIRST ((int)((sizeof(Region) + sizeof(Cell) - 1) / sizeof(Cell)))
+
+// cells of a thread, free ones first
+struct HeapAlloc {
+	Cell *free;
+	Cell *top;
+	Cell *end;
+};
+
+struct HeapRange {
+	Value *begin;
+	Value *end;
+};
+
+static inline Cell *allocCell(HeapAlloc *a) {
+	Cell *c = a->free;
+	if(likely(c != NULL)) {
+		a->free = c->car.cell;
+		return c;
+	}
+	if(likely(a->top < a->end)) return a->top++;
+	return NULL;
+}
+
+class Heap {
+private:
+	Context *ctx;
+	char *base;
+	volatile int64_t nregions; /* from base */
+	Region *avail; /* swept regions with free cells */
+	int64_t limit; /* bytes of regions before a collection */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	volatile int running; /* threads in vmrun */
+	int parked;
+	bool collecting;
+	ArrayBuilder<WorkerThread *> threads;
+	ArrayBuilder<Task *> stopped; /* by the threads in the collection */
+	// collection
+	ArrayBuilder<HeapRange> roots;
+	int nworkers;
+	volatile int nextRoot;
+	volatile int64_t nextRegion;
+	volatile int marked;
+	volatile int swept;
+	volatile int64_t nfree;
+
+	Region *getRegion(int64_t i) { return (Region *)(base + i * REGION_SIZE); }
+	Region *takeRegion();
+	void collect(Task *task);
+	void waitCollection(Task *task);
+	void addRoots();
+	void work();
+	void markRange(Value *begin, Value *end, ArrayBuilder<Cell *> *stack);
+	void sweep(Region *r);
+	void finish();
+
+public:
+	volatile int stopping; /* threads park at their next safepoint */
+	int64_t collections;
+
+	Heap(Context *ctx);
+	~Heap();
+	bool isCell(int64_t v) {
+		uint64_t off = (uint64_t)v - (uint64_t)base;
+		return off < (uint64_t)nregions * REGION_SIZE && (off & (sizeof(Cell) - 1)) == 0 &&
+			(off & (REGION_SIZE - 1)) >= REGION_FIRST * sizeof(Cell);
+	}
+	void addThread(WorkerThread *wth);
+	void removeThread(WorkerThread *wth);
+	void enter(); /* around vmrun */
+	void leave();
+	void park(Task *task);
+	Cell *allocSlow(WorkerThread *wth, Task *task);
+	void print(OutBuf *o, int64_t v);
+};
+
+#endif
+
@@ -0,0 +1,41 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+//------------------------------------------------------
+// compiled code image (file.lispc)
+// the optimized code of each top-level defun, keyed by the number of
+// defun forms before it. funcs and variables are stored by name and
+// resolved when the form is reached, as the compiler would have
+// resolved them
+
+struct ImageFunc {
+	int form; /* n-th defun */
+	Func *func;
+};
+
+class Image {
+private:
+	const int64_t *data; /* mapped file, NULL if not loaded */
+	size_t size;
+	uint64_t srchash;
+	int inlinecount;
+	const int64_t **byform; /* func record of each defun */
+	int nforms;
+	ArrayBuilder<ImageFunc> recs; /* compiled in this run */
+
+	const char *getSym(int64_t n);
+	bool relocate(Context *ctx, Func *func, const int64_t *src, int len, Code *code, Code *runcode);
+public:
+	Image(const char *src, size_t len, Context *ctx);
+	~Image();
+	bool load(const char *fname);
+	bool isLoaded() { return data != NULL; }
+	Func *loadFunc(Context *ctx, int form);
+	void record(int form, Func *func);
+	bool save(const char *fname);
+};
+
+bool isDefunForm(Cons *cons, const char *defunAtom);
+
+#endif
+
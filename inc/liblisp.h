@@ -0,0 +1,51 @@
+#ifndef LIBLISP_H
+#define LIBLISP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//------------------------------------------------------
+// embedding API (liblisp.a, liblisp.so)
+// load definitions once with lisp_load, look up a function and call it.
+// lisp_call runs the call as a task on the worker pool. a caller runs
+// calls on its own thread with its own task, so repeated and batched
+// calls do not take a task from the pool; spawned tasks still go to the
+// workers. lisp_load may run while calls are running, the code of a
+// hot function it reoptimizes is freed when no call is left running it.
+// functions return 0, or -1 on an error
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lisp_ctx lisp_ctx;
+typedef struct lisp_func lisp_func;
+typedef struct lisp_caller lisp_caller; /* used by one thread at a time */
+
+typedef union {
+	int64_t i;
+	double f;
+} lisp_value;
+
+lisp_ctx *lisp_new(int workers); /* 0 for the default */
+void lisp_free(lisp_ctx *lc);
+int lisp_load(lisp_ctx *lc, const char *src, size_t len);
+
+lisp_func *lisp_func_get(lisp_ctx *lc, const char *name); /* NULL if not a defun */
+int lisp_func_argc(lisp_func *f);
+
+// args has lisp_func_argc values
+int lisp_call(lisp_ctx *lc, lisp_func *f, const lisp_value *args, lisp_value *ret);
+
+lisp_caller *lisp_caller_new(lisp_ctx *lc);
+void lisp_caller_free(lisp_caller *c);
+int lisp_call_here(lisp_caller *c, lisp_func *f, const lisp_value *args, lisp_value *ret);
+// n calls, the argument vectors of the calls follow each other in args
+int lisp_call_batch(lisp_caller *c, lisp_func *f, const lisp_value *args, size_t n, lisp_value *rets);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
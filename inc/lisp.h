@@ -4,8 +4,12 @@
 //------------------------------------------------------
 // configuration
 
+#ifndef USING_SWITCH /* switch dispatch, or make lisp-switch */
 #define USING_THCODE
+#endif
+//#define USING_PROFILE /* count branches and instructions, or make lisp-prof */
 #define TASK_STACKSIZE 1024*4
+#define REOPT_CALLCOUNT 1024 /* reoptimize a function after this many calls */
 
 //------------------------------------------------------
 // includes and structs
@@ -16,6 +20,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include "arena.h"
 #include "array.h"
 
 struct Code;
@@ -25,9 +30,18 @@ struct Variable;
 struct Cons;
 struct WorkerThread;
 struct Task;
+struct VMStat;
+struct SampleBuf;
+struct Foreign;
+struct Memo;
+struct MemoEntry;
+struct HashTable;
+struct HashRegistry;
+struct Cell;
 class Scheduler;
 class Context;
 class CodeBuilder;
+class Heap;
 
 //------------------------------------------------------
 // builtin function
@@ -57,6 +71,8 @@ struct Code {
 		Func *func;
 		Variable *var;
 		Cons *cons;
+		Foreign *ffi;
+		Memo *memo;
 	};
 };
 
@@ -68,6 +84,8 @@ struct Value {
 		Task *task;
 		Code *pc;
 		Value *sp;
+		MemoEntry *claim;
+		Cell *cell;
 	};
 };
 
@@ -79,35 +97,64 @@ enum ValueType {
 	VT_FLOAT,
 	VT_BOOLEAN, // T or NIL
 	VT_FUTURE,
+	VT_CONS, // a cell or NIL
 	VT_VOID,
 };
 
+// what a call may do besides computing its result, in increasing order
+enum Effect {
+	EFF_PURE,
+	EFF_READ,   // reads globals or hash tables
+	EFF_SHARED, // makes hash tables, safe alongside any task
+	EFF_WRITE,  // sets globals, changes hash tables, defines functions or calls native code
+};
+
 typedef ValueType (*CodeGenFunc)(Func *, Cons *, CodeBuilder *, int sp);
 
 struct Func {
-#ifdef USING_THCODE
-	Code *thcode;
-#endif
+	Code *runcode; /* the code the vm runs, threaded or laid out */
+	int runLength;
 	Code *code;
 	int codeLength;
-	const char *name;
+	Code *srccode; /* code before codeopt */
+	int srcLength;
+	int64_t callcount; /* saturates at REOPT_CALLCOUNT */
+	bool reopt;
+#ifdef USING_PROFILE
+	int64_t *brcount; /* taken and not taken count at each pc */
+	int id; /* index of the counters in VMStat */
+#endif
+	const char *name; /* atom */
 	size_t argc;
-	const char **args;
+	const char **args; /* atoms */
 	ValueType rtype;
+	Effect effect; /* of a call, including its callees */
 	CodeGenFunc codegen;
+	Foreign *foreign; /* defforeign, NULL otherwise */
+	Memo *memo; /* defun-memo, NULL otherwise */
 	Func *next;
 };
 
 struct Variable {
 	Value value;
 	ValueType type;
-	const char *name;
+	const char *name; /* atom */
 	Variable *next;
 };
 
+#include "output.h"
+#include "heap.h"
 #include "scheduler.h"
+#include "symbol.h"
 #include "parse.h"
 #include "codegen.h"
+#include "profile.h"
+#include "image.h"
+#include "sampler.h"
+#include "phase.h"
+#include "foreign.h"
+#include "memo.h"
+#include "hashtab.h"
 
 //------------------------------------------------------
 // context
@@ -116,20 +163,35 @@ class Context {
 private:
 	Func *funclist;
 	Variable *varlist;
+	AtomMap<Func *> funcmap;
+	AtomMap<Variable *> varmap;
 
 public:
 	Scheduler *sche;
+	Heap *heap; /* cons cells */
+	Profile *prof;
+	Sampler *sampler; /* NULL if not sampling */
+	PhaseTimer *phases; /* NULL if not timing */
+	FILE *out; /* the print instructions write here by default, see output.h */
+	SymbolTable *symtab;
 	bool flagShowIR;
+	bool flagBatch;
+	bool flagOrderedOutput;
 	int inlinecount;
 	int workers;
-	ArrayBuilder<Cons *> code_cons;
+	Arena code_arena; /* defun bodies */
+	HashRegistry *hashtabs; /* made by make-hash, freed with the context */
+	pthread_mutex_t codelock; /* compiling, defining and reoptimizing */
+	ArrayBuilder<Code *> retired; /* run code replaced by recodeopt */
 
 	Context();
 	~Context();
 	void putFunc(Func *func);
-	Func *getFunc(const char *name);
+	Func *getFunc(const char *atom);
 	void putVar(Variable *var);
-	Variable *getVar(const char *name);
+	Variable *getVar(const char *atom);
+	void reoptFuncs();
+	void addRoots(ArrayBuilder<HeapRange> *roots);
 	const char *getInstName(int ins);
 #ifdef USING_THCODE
 	void *jmptable[INS_COUNT];
@@ -154,7 +216,7 @@ struct Cons {
 	union {
 		int i;
 		double f;
-		const char *str;
+		const char *str; /* atom */
 		Cons *car;
 	};
 	Cons *cdr;
@@ -162,11 +224,15 @@ struct Cons {
 	Cons(ConsType type) { this->type = type; car = NULL; cdr = NULL; }
 };
 
-void cons_free(Cons *cons);
 void cons_print(Cons *cons, FILE *fp = stdout);
 void cons_println(Cons *cons, FILE *fp = stdout);
 
-bool parseCons(Tokenizer *tk, Cons **res);
+bool parseCons(Tokenizer *tk, Arena *arena, Cons **res);
+
+bool runCons(Context *ctx, Cons *cons, Arena *arena, const char *label = NULL, FILE *out = NULL);
+bool compileAndRun(Context *ctx, const char *src, size_t len, Image *img);
+bool runBatch(Context *ctx, const char *src, size_t len, Image *img);
+void runServer(Context *ctx, const char *path);
 
 #endif
 
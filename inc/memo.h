@@ -0,0 +1,83 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+//------------------------------------------------------
+// memo cache of a defun-memo function, open addressing over a fixed
+// number of entries. a key is looked up in MEMO_PROBE entries from its
+// hash; when none is free, a full entry that was not hit since the last
+// pass is evicted (second chance). an entry is claimed by the task that
+// computes its value, and other tasks needing the same key wait for it
+// instead of computing it again
+
+#define MEMO_MAXARGS 4
+#define MEMO_SIZE    4096 /* entries, a power of 2 */
+#define MEMO_PROBE   8
+
+// the state of an entry is in the low 2 bits of seq, the rest counts the
+// writes to it. a reader checks seq again after reading the key and value
+enum MemoState {
+	MS_EMPTY,
+	MS_LOCKED,  /* key being written */
+	MS_PENDING, /* key set, the owner computes the value */
+	MS_FULL,
+};
+
+struct MemoEntry {
+	volatile uint64_t seq;
+	int64_t key[MEMO_MAXARGS];
+	volatile int64_t value;
+	volatile int used; /* hit since the last eviction pass */
+	MemoEntry *nextClaim; /* the owner's claims, innermost first */
+};
+
+struct Memo {
+	int argc;
+	MemoEntry *entries;
+};
+
+enum MemoResult {
+	MEMO_MISS, /* compute, and store into the claimed entry if not NULL */
+	MEMO_HIT,
+	MEMO_WAIT, /* another task computes it */
+};
+
+#define MEMO_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+static inline uint64_t memoHash(const Value *args, int argc) {
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for(int i=0; i<argc; i++) {
+		h = (h ^ (uint64_t)args[i].i) * 0xff51afd7ed558ccdULL;
+	}
+	return h ^ (h >> 32);
+}
+
+static inline bool memoSameKey(const MemoEntry *e, const Value *args, int argc) {
+	for(int i=0; i<argc; i++) {
+		if(e->key[i] != args[i].i) return false;
+	}
+	return true;
+}
+
+// a full entry for the key at its hash, the common hit in the VM
+static inline bool memoHit(Memo *m, const Value *args, int64_t *value) {
+	MemoEntry *e = &m->entries[memoHash(args, m->argc) & (MEMO_SIZE - 1)];
+	uint64_t s = e->seq;
+	if((s & 3) != MS_FULL) return false;
+	MEMO_ACQUIRE();
+	bool same = memoSameKey(e, args, m->argc);
+	int64_t v = e->value;
+	MEMO_ACQUIRE();
+	if(!same || e->seq != s) return false;
+	if(!e->used) e->used = 1;
+	*value = v;
+	return true;
+}
+
+Memo *newMemo(int argc);
+void freeMemo(Memo *m);
+MemoResult memoLookup(Memo *m, const Value *args, Task *task, int64_t *value, MemoEntry **claim);
+void memoStore(MemoEntry *e, int64_t value, Task *task);
+void memoRelease(Task *task);
+
+#endif
+
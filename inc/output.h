@@ -0,0 +1,85 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+//------------------------------------------------------
+// output of the print instructions. a thread formats into its own
+// buffer and writes it to the task's outfp in one fwrite when it grows
+// past OUT_FLUSH, before its task is requeued and before the task
+// ends, so the lines of a task keep their order and are out when it is
+// joined.
+// with -ordered-output a task prints into a buffer of its own instead,
+// and a spawned task notes where the parent's output was at the spawn.
+// a joined child's output is kept as a piece of the parent, and the
+// pieces are merged in at these places when the parent ends, so the
+// output is in the order of a run where every spawn is called in place.
+// a root task writes it
+
+#define OUT_FLUSH  (64 * 1024) /* bytes */
+#define OUT_MINCAP 256
+
+struct OutBuf {
+	char *buf;
+	int64_t len;
+	int64_t cap;
+};
+
+// the output of a joined child, at pos of the parent's own output
+struct OutPiece {
+	int64_t pos;
+	int seq; /* of the spawn, for pieces at the same pos */
+	OutBuf *out;
+	OutPiece *next; /* by pos and seq */
+};
+
+void outGrow(OutBuf *o, int64_t n);
+void outWrite(OutBuf *o, FILE *fp);
+void freeOutBuf(OutBuf *o);
+void outJoin(Task *task, Task *child);
+void outEnd(Task *task);
+
+static inline void initOutBuf(OutBuf *o) {
+	o->buf = NULL;
+	o->len = 0;
+	o->cap = 0;
+}
+
+static inline char *outReserve(OutBuf *o, int64_t n) {
+	if(unlikely(o->len + n > o->cap)) outGrow(o, n);
+	return o->buf + o->len;
+}
+
+static inline void outPutc(OutBuf *o, char c) {
+	*outReserve(o, 1) = c;
+	o->len++;
+}
+
+static inline void outPuts(OutBuf *o, const char *s) {
+	int n = (int)strlen(s);
+	memcpy(outReserve(o, n), s, n);
+	o->len += n;
+}
+
+// the digits are made from the end, INT64_MIN included
+static inline void outInt(OutBuf *o, int64_t v) {
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	do {
+		*--p = (char)('0' + u % 10);
+		u /= 10;
+	} while(u != 0);
+	int n = (int)(tmp + sizeof(tmp) - p);
+	char *d = outReserve(o, n + 1);
+	if(v < 0) *d++ = '-';
+	memcpy(d, p, n);
+	o->len += n + (v < 0);
+}
+
+// %lf of the largest double is 316 chars
+static inline void outFloat(OutBuf *o, double f) {
+	char *d = outReserve(o, 320);
+	o->len += snprintf(d, 320, "%lf", f);
+}
+
+#endif
+
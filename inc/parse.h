@@ -1,15 +1,6 @@
 #ifndef PARSE_H
 #define PARSE_H
 
-//------------------------------------------------------
-// reader
-
-class Reader {
-public:
-	virtual ~Reader() {}
-	virtual int read() = 0;
-};
-
 //------------------------------------------------------
 // tokenizer
 
@@ -22,22 +13,24 @@ enum TokenType {
 	TT_EOF,
 };
 
+// tokenizes straight from a source buffer, which need not be
+// null terminated and must live as long as the tokenizer
 class Tokenizer {
 private:
-	Reader *reader;
-	int linenum;
-	int nextch;
-	ArrayBuilder<char> linebuf;
+	const char *begin;
+	const char *cur;
+	const char *end;
+	SymbolTable *symtab;
 public:
-	ArrayBuilder<char> tokenbuf;
+	const char *token; /* points into the source */
+	int tokenlen;
 	union {
 		int ival;
 		double fval;
 	};
-	const char *sval() { return tokenbuf.toArray(); }
+	const char *sval(); /* interned, lower case unless quoted */
 
-	Tokenizer(Reader *r);
-	void nextChar();
+	Tokenizer(const char *src, size_t len, SymbolTable *symtab);
 	TokenType nextToken();
 	void printErrorMsg(const char *msg);
 };
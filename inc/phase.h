@@ -0,0 +1,61 @@
+#ifndef PHASE_H
+#define PHASE_H
+
+//------------------------------------------------------
+// compiler phase timing (-time-phases)
+// wall time, heap allocations and code length of each phase of each
+// defun and top-level form. a defun is reported under its name, other
+// forms as "#n head"
+
+enum Phase {
+	PHASE_PARSE,
+	PHASE_LOAD,     /* from the image cache */
+	PHASE_CODEGEN,
+	PHASE_FIXPOINT, /* ssa passes before inlining */
+	PHASE_INLINE,   /* inlining and the passes after each round */
+	PHASE_STRENGTH, /* constant multiply, divide and mod */
+	PHASE_LAYOUT,
+	PHASE_RUNCODE,  /* the code the vm runs */
+	PHASE_RUN,
+	PHASE_COUNT,
+};
+
+struct PhaseClock {
+	int64_t ns;
+	int64_t allocs;
+	int64_t bytes;
+	int len; /* code length before */
+};
+
+struct PhaseRow {
+	const char *name;
+	int64_t seq; /* order of end */
+	Phase phase;
+	int64_t ns;
+	int64_t allocs;
+	int64_t bytes;
+	int before; /* -1 if there is no code before */
+	int after;
+};
+
+// heap allocations of this thread, counted by the operator new of the
+// lisp executable. the library leaves the host's operator new alone
+extern __thread int64_t phaseAllocs;
+extern __thread int64_t phaseAllocBytes;
+
+class PhaseTimer {
+private:
+	pthread_mutex_t lock;
+	ArrayBuilder<PhaseRow> rows;
+	Arena labels;
+public:
+	PhaseTimer();
+	~PhaseTimer();
+	void start(PhaseClock *c, int len);
+	void end(PhaseClock *c, const char *name, Phase phase, int len);
+	const char *formName(Cons *cons, const char *defunAtom, int n);
+	void printReport(FILE *fp);
+};
+
+#endif
+
@@ -0,0 +1,67 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+//------------------------------------------------------
+// branch profile
+
+struct BranchProfile {
+	const char *name;
+	int codeLength;
+	int nbranch;
+	int64_t *counts; /* taken and not taken count of each conditional branch */
+};
+
+#ifdef USING_PROFILE
+//------------------------------------------------------
+// execution counters, each worker has its own and the report adds
+// them up
+
+struct FuncStat {
+	int64_t calls;  /* CALL, and SPAWN run in place */
+	int64_t spawns; /* SPAWN run as a new task */
+	int64_t self;   /* instructions */
+	int64_t total;  /* instructions including callees and joined tasks */
+};
+
+struct VMStat {
+	int64_t opcount[INS_COUNT];
+	FuncStat *funcs; /* by Func::id */
+	int nfuncs;
+
+	void grow(int id);
+	FuncStat *get(Func *func) {
+		if(unlikely(func->id >= nfuncs)) grow(func->id);
+		return &funcs[func->id];
+	}
+};
+#endif
+
+class Profile {
+private:
+	ArrayBuilder<BranchProfile> profs;
+#ifdef USING_PROFILE
+	pthread_mutex_t lock;
+	ArrayBuilder<Func *> funcs; /* instrumented functions, sorted by code address */
+	ArrayBuilder<BranchProfile> retired; /* counts of the replaced code */
+	ArrayBuilder<const char *> funcnames; /* by Func::id */
+	ArrayBuilder<VMStat *> stats;
+#endif
+
+public:
+	Profile();
+	~Profile();
+	bool load(const char *fname);
+	const int64_t *getBranchCounts(Func *func);
+#ifdef USING_PROFILE
+	void addFunc(Func *func);
+	void removeFunc(Func *func);
+	bool countBranch(Code *pc, bool taken); /* returns taken */
+	bool save(const char *fname);
+	int newFuncId(const char *name);
+	VMStat *newStat();
+	void printReport(Context *ctx, FILE *fp);
+#endif
+};
+
+#endif
+
@@ -0,0 +1,69 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <signal.h>
+#include <time.h>
+
+//------------------------------------------------------
+// sampling profiler (-sample)
+// a cpu time timer of each worker raises SIGPROF. the handler looks for
+// the vm registers of the running task in the interrupted registers:
+// sp is the deepest one that links down to the bottom of the task stack,
+// and the return chain is read from sp[-1].pc and sp[-2].sp. the pc is
+// one of the other registers, found later in the table of code ranges
+
+#define SAMPLE_DEPTH 32
+#define SAMPLE_REGS 16
+#define SAMPLE_MAX 16384 /* per worker, the interval doubles when full */
+
+struct StackSample {
+	int64_t epoch; /* of the code table */
+	Task *task; /* NULL if not running a task */
+	int nregs;
+	int depth;
+	bool truncated;
+	uintptr_t regs[SAMPLE_REGS]; /* pc candidates */
+	Code *retpc[SAMPLE_DEPTH]; /* innermost first */
+};
+
+struct SampleBuf {
+	StackSample *samples;
+	int count;
+	int64_t interval; /* ns */
+	timer_t timer;
+	bool running;
+};
+
+struct CodeRange {
+	Code *begin;
+	Code *end;
+	const char *name;
+	Code *saved; /* copy of the code after it is freed */
+	int64_t from; /* epochs [from, to) */
+	int64_t to;
+};
+
+class Sampler {
+private:
+	pthread_mutex_t lock;
+	ArrayBuilder<CodeRange> ranges;
+	ArrayBuilder<SampleBuf *> bufs;
+	int64_t interval;
+
+	CodeRange *lookup(uintptr_t addr, int64_t epoch);
+	const char *leafName(StackSample *s, CodeRange **range, int *offset);
+	const char *frameName(StackSample *s, int d);
+	void prepare();
+public:
+	Sampler(int interval_us);
+	~Sampler();
+	void addCode(Func *func);
+	void removeCode(Func *func);
+	void startThread(WorkerThread *wth);
+	void stop();
+	void printReport(Context *ctx, FILE *fp);
+	bool writeStacks(const char *fname);
+};
+
+#endif
+
@@ -7,14 +7,63 @@
 enum TaskStat {
 	TASK_RUN,
 	TASK_END,
+	TASK_WAIT, /* running, a thread sleeps in waitTask */
+	TASK_FREE, /* in the pool's free list */
 };
 
+// cancellation token of a por, pand or pfind scope, in two stack slots of
+// the task that opened it. a task is cancelled when its token or an
+// enclosing one is, and it stops at the next CALL, SPAWN or backward JMP
+struct CancelToken {
+	volatile int64_t cancelled;
+	CancelToken *parent;
+};
+
+static inline bool isCancelled(CancelToken *t) {
+	for(; t != NULL; t = t->parent) {
+		if(t->cancelled) return true;
+	}
+	return false;
+}
+
+// RACE kinds: the result a branch decides on, and the default
+enum RaceKind {
+	RACE_POR,   /* non-nil, nil */
+	RACE_PAND,  /* nil, the last branch */
+	RACE_PFIND, /* not -1, -1 */
+};
+
+#ifdef USING_PROFILE
+// a call on the task, for the inclusive instruction count
+struct ProfFrame {
+	Func *func;
+	int64_t start; /* icount at the call */
+	bool outer; /* not a recursive call */
+};
+#endif
+
 struct Task {
 	volatile TaskStat stat;
 	Task *next;
 	Code  *pc;
 	Value *sp;
+	CancelToken *token; /* NULL if it cannot be cancelled */
+	Task *child; /* spawned and not joined, kept when token is set */
+	Task *sibling;
+	MemoEntry *claims; /* being computed by the task, innermost first */
+	FILE *outfp; /* of the root task, see Scheduler::runWait */
+	// -ordered-output, see output.h
+	OutBuf *out; /* NULL if nothing printed */
+	OutPiece *pieces;
+	int64_t outpos; /* in the parent's output, -1 for a root */
+	int outseq;
+	int nspawn;
 	Value stack[TASK_STACKSIZE];
+#ifdef USING_PROFILE
+	int64_t icount; /* instructions, including joined tasks */
+	int pdepth;
+	ProfFrame pframes[TASK_STACKSIZE / 2];
+#endif
 };
 
 //------------------------------------------------------
@@ -25,6 +74,13 @@ struct WorkerThread {
 	Scheduler *sche;
 	int id;
 	pthread_t pth;
+	Task *volatile curtask; /* read by the sampler */
+	SampleBuf *samples;
+	HeapAlloc alloc; /* see Heap::addThread */
+	OutBuf out; /* see output.h */
+#ifdef USING_PROFILE
+	VMStat *stat;
+#endif
 };
 
 void vmrun(Context *ctx, WorkerThread *wth, Task *task);
@@ -39,15 +95,17 @@ private:
 	volatile int taskEnqIndex;
 	volatile int taskDeqIndex;
 	volatile int waitCount;
+	volatile int live; /* tasks started and not ended, see isQuiescent */
 	int queuemask;
 	pthread_mutex_t tl_lock;
 	pthread_cond_t  tl_cond;
-	pthread_cond_t  tl_maincond;
+	pthread_cond_t  tl_donecond; /* a TASK_WAIT task ended */
 	Task *taskpool;
 	Task *freelist;
 	volatile bool dead_flag;
 	WorkerThread *wthpool;
 	Code endcode;
+	void growQueue();
 
 public:
 	Scheduler(Context *ctx);
@@ -55,10 +113,17 @@ public:
 	void initWorkers();
 	void enqueue(Task *task);
 	Task *dequeue();
-	void enqueueWaitFor(Task *task);
+	void runWait(Func *func, Value *args, FILE *out, Value *ret);
+	void initTask(Task *task, Func *func, Value *args);
 	Task *newTask(Func *func, Value *args);
+	void waitTask(Task *task);
+	void endTask(Task *task);
 	void deleteTask(Task *task);
 	bool isTaskEmpty() { return freelist == NULL; }
+	void endRun() { ATOMIC_SUB(live, 1); } /* at END, the task holds no pc */
+	// no task can be running a code that is no longer published
+	bool isQuiescent() { __sync_synchronize(); return live == 0; }
+	void getTasks(ArrayBuilder<Task *> *tasks);
 	Context *getCtx() { return ctx; }
 };
 
@@ -0,0 +1,85 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+//------------------------------------------------------
+// symbol table
+// intern returns the same pointer (atom) for equal strings, so atoms
+// are compared by pointer
+
+class SymbolTable {
+private:
+	const char **table;
+	int mask;
+	int count;
+	pthread_mutex_t lock; /* the batch loader parses in parallel */
+	void rehash();
+public:
+	SymbolTable();
+	~SymbolTable();
+	const char *intern(const char *s, size_t len);
+	const char *intern(const char *s) { return intern(s, strlen(s)); }
+};
+
+//------------------------------------------------------
+// open addressing hash table keyed by atom
+
+static inline int atomHash(const char *atom, int mask) {
+	uint64_t h = ((uint64_t)(uintptr_t)atom >> 3) * 0x9e3779b97f4a7c15ULL;
+	return (int)(h >> 32) & mask;
+}
+
+template<class T> class AtomMap {
+private:
+	struct Entry {
+		const char *key;
+		T val;
+	};
+	Entry *table;
+	int mask;
+	int count;
+
+	void rehash() {
+		Entry *old = table;
+		int n = mask + 1;
+		mask = mask * 2 + 1;
+		table = new Entry[mask + 1];
+		for(int i=0; i<=mask; i++) table[i].key = NULL;
+		for(int i=0; i<n; i++) {
+			if(old[i].key != NULL) put(old[i].key, old[i].val);
+		}
+		delete [] old;
+	}
+public:
+	AtomMap() {
+		mask = 63;
+		count = 0;
+		table = new Entry[mask + 1];
+		for(int i=0; i<=mask; i++) table[i].key = NULL;
+	}
+	~AtomMap() { delete [] table; }
+	T get(const char *key) {
+		for(int i = atomHash(key, mask); table[i].key != NULL; i = (i + 1) & mask) {
+			if(table[i].key == key) return table[i].val;
+		}
+		return T();
+	}
+	// replaces the value of the same key
+	void put(const char *key, T val) {
+		int i = atomHash(key, mask);
+		for(; table[i].key != NULL; i = (i + 1) & mask) {
+			if(table[i].key == key) {
+				table[i].val = val;
+				return;
+			}
+		}
+		table[i].key = key;
+		table[i].val = val;
+		if(++count * 2 > mask) {
+			count = 0;
+			rehash();
+		}
+	}
+};
+
+#endif
+
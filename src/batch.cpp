@@ -0,0 +1,277 @@
+#include "lisp.h"
+
+//------------------------------------------------------
+// batch load: parse the top-level forms in parallel, compile the
+// defuns on a thread pool and run the other forms in source order
+
+struct Form {
+	const char *src;
+	size_t len;
+	Cons *cons;
+	const char *name; /* in the phase report */
+};
+
+// split src into top-level forms by counting parens
+static void splitForms(const char *src, size_t len, ArrayBuilder<Form> *forms) {
+	size_t i = 0;
+	while(i < len) {
+		char ch = src[i];
+		if(ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t') {
+			i++;
+			continue;
+		}
+		Form f;
+		f.src = src + i;
+		f.cons = NULL;
+		f.name = NULL;
+		if(ch == '(') {
+			int depth = 0;
+			for(; i < len; i++) {
+				if(src[i] == '(') depth++;
+				else if(src[i] == ')' && --depth == 0) break;
+			}
+			if(i < len) i++;
+		} else if(ch == ')') {
+			i++;
+		} else {
+			while(i < len && !(src[i] == ' ' || src[i] == '\n' || src[i] == '\r' ||
+						src[i] == '\t' || src[i] == '(' || src[i] == ')')) i++;
+		}
+		f.len = src + i - f.src;
+		forms->add(f);
+	}
+}
+
+//------------------------------------------------------
+// parallel parse
+
+struct ParseChunk {
+	Context *ctx;
+	Form *forms;
+	int begin;
+	int end;
+	Arena *arena;
+	pthread_t pth;
+};
+
+static void *parseChunk(void *arg) {
+	ParseChunk *pc = (ParseChunk *)arg;
+	PhaseTimer *pt = pc->ctx->phases;
+	const char *defunAtom = pc->ctx->symtab->intern("defun");
+	for(int i=pc->begin; i<pc->end; i++) {
+		Form *f = &pc->forms[i];
+		PhaseClock clk;
+		if(pt != NULL) pt->start(&clk, -1);
+		Tokenizer tk(f->src, f->len, pc->ctx->symtab);
+		if(!parseCons(&tk, pc->arena, &f->cons)) f->cons = NULL;
+		if(pt != NULL && f->cons != NULL) {
+			f->name = pt->formName(f->cons, defunAtom, i);
+			pt->end(&clk, f->name, PHASE_PARSE, -1);
+		}
+	}
+	return NULL;
+}
+
+static void parseForms(Context *ctx, Form *forms, int n, Arena *arenas, int nthreads) {
+	ParseChunk *chunks = new ParseChunk[nthreads];
+	size_t total = n > 0 ? forms[n-1].src + forms[n-1].len - forms[0].src : 0;
+	int i = 0;
+	for(int t=0; t<nthreads; t++) {
+		// about the same number of bytes for each thread
+		size_t limit = total * (t + 1) / nthreads;
+		chunks[t].ctx = ctx;
+		chunks[t].forms = forms;
+		chunks[t].begin = i;
+		while(i < n && (t == nthreads - 1 ||
+					(size_t)(forms[i].src - forms[0].src) < limit)) i++;
+		chunks[t].end = i;
+		chunks[t].arena = &arenas[t];
+	}
+	for(int t=1; t<nthreads; t++) {
+		pthread_create(&chunks[t].pth, NULL, parseChunk, &chunks[t]);
+	}
+	parseChunk(&chunks[0]);
+	for(int t=1; t<nthreads; t++) {
+		pthread_join(chunks[t].pth, NULL);
+	}
+	delete [] chunks;
+}
+
+//------------------------------------------------------
+// compile queue: a defun is optimized after the defuns it calls
+
+struct CompileJob {
+	Func *func;
+	int waiting; /* callees not optimized yet */
+	bool done;
+	ArrayBuilder<CompileJob *> users;
+};
+
+class CompileQueue {
+private:
+	Context *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t donecond;
+	ArrayBuilder<CompileJob *> jobs;
+	ArrayBuilder<CompileJob *> ready;
+	AtomMap<CompileJob *> byname; /* last job of each name */
+	int pending;
+	bool dead;
+	int nthreads;
+	pthread_t *pth;
+
+	static void *main(void *arg);
+public:
+	CompileQueue(Context *ctx, int nthreads);
+	~CompileQueue();
+	void submit(Func *func);
+	void wait();
+};
+
+void *CompileQueue::main(void *arg) {
+	CompileQueue *cq = (CompileQueue *)arg;
+	pthread_mutex_lock(&cq->lock);
+	while(true) {
+		while(cq->ready.getSize() == 0 && !cq->dead) {
+			pthread_cond_wait(&cq->cond, &cq->lock);
+		}
+		if(cq->ready.getSize() == 0) break;
+		CompileJob *job = cq->ready[cq->ready.getSize() - 1];
+		cq->ready.truncate(cq->ready.getSize() - 1);
+		pthread_mutex_unlock(&cq->lock);
+		codeopt(cq->ctx, job->func);
+		pthread_mutex_lock(&cq->lock);
+		job->done = true;
+		for(int i=0, j=job->users.getSize(); i<j; i++) {
+			CompileJob *u = job->users[i];
+			if(--u->waiting == 0) {
+				cq->ready.add(u);
+				pthread_cond_signal(&cq->cond);
+			}
+		}
+		if(--cq->pending == 0) pthread_cond_broadcast(&cq->donecond);
+	}
+	pthread_mutex_unlock(&cq->lock);
+	return NULL;
+}
+
+CompileQueue::CompileQueue(Context *ctx, int nthreads) {
+	this->ctx = ctx;
+	this->pending = 0;
+	this->dead = false;
+	this->nthreads = nthreads;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	pthread_cond_init(&donecond, NULL);
+	pth = new pthread_t[nthreads];
+	for(int i=0; i<nthreads; i++) {
+		pthread_create(&pth[i], NULL, main, this);
+	}
+}
+
+CompileQueue::~CompileQueue() {
+	pthread_mutex_lock(&lock);
+	dead = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for(int i=0; i<nthreads; i++) {
+		pthread_join(pth[i], NULL);
+	}
+	delete [] pth;
+	for(int i=0, j=jobs.getSize(); i<j; i++) {
+		delete jobs[i];
+	}
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+	pthread_cond_destroy(&donecond);
+}
+
+void CompileQueue::submit(Func *func) {
+	CompileJob *job = new CompileJob();
+	job->func = func;
+	job->waiting = 0;
+	job->done = false;
+	pthread_mutex_lock(&lock);
+	jobs.add(job);
+	for(Code *pc = func->code; pc->i != INS_END; pc += getOpSize(pc->i)) {
+		if(pc->i != INS_CALL && pc->i != INS_SPAWN) continue;
+		CompileJob *dep = byname.get(pc[1].func->name);
+		if(dep == NULL || dep->func != pc[1].func || dep->done || dep == job) continue;
+		// the callee may be called several times
+		int n = dep->users.getSize();
+		if(n > 0 && dep->users[n - 1] == job) continue;
+		dep->users.add(job);
+		job->waiting++;
+	}
+	byname.put(func->name, job);
+	pending++;
+	if(job->waiting == 0) {
+		ready.add(job);
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void CompileQueue::wait() {
+	pthread_mutex_lock(&lock);
+	while(pending != 0) {
+		pthread_cond_wait(&donecond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+//------------------------------------------------------
+bool runBatch(Context *ctx, const char *src, size_t len, Image *img) {
+	ArrayBuilder<Form> formbuf(1024);
+	splitForms(src, len, &formbuf);
+	Form *forms = formbuf.getPtr();
+	int n = formbuf.getSize();
+	int nthreads = ctx->workers;
+	Arena *arenas = new Arena[nthreads];
+	parseForms(ctx, forms, n, arenas, nthreads);
+
+	// print the IR in order
+	CompileQueue *cq = ctx->flagShowIR ? NULL : new CompileQueue(ctx, nthreads);
+	Arena arena;
+	const char *defunAtom = ctx->symtab->intern("defun");
+	int ndefun = 0;
+	bool ok = true;
+	for(int i=0; i<n; i++) {
+		Cons *cons = forms[i].cons;
+		if(cons == NULL) continue;
+		if(isDefunForm(cons, defunAtom)) {
+			int form = ndefun++;
+			PhaseClock clk;
+			if(ctx->phases != NULL) ctx->phases->start(&clk, -1);
+			Func *loaded = img != NULL ? img->loadFunc(ctx, form) : NULL;
+			if(loaded != NULL) {
+				if(ctx->phases != NULL) ctx->phases->end(&clk, forms[i].name, PHASE_LOAD, loaded->codeLength);
+				continue;
+			}
+			Func *func;
+			try {
+				func = defineFunc(ctx, cons->car->cdr);
+			} catch(const char *) {
+				ok = false;
+				continue;
+			}
+			if(cq != NULL) cq->submit(func);
+			else codeopt(ctx, func);
+			if(img != NULL) img->record(form, func);
+		} else {
+			// side effects in source order, after all defuns before it
+			if(cq != NULL) cq->wait();
+			cons->cdr = NULL;
+			if(!runCons(ctx, cons, &arena, forms[i].name)) ok = false;
+			arena.reset();
+		}
+	}
+	if(cq != NULL) {
+		cq->wait();
+		delete cq;
+	}
+	delete [] arenas;
+	return ok;
+}
+
@@ -1,6 +1,7 @@
 #include "lisp.h"
 
-CodeBuilder::CodeBuilder(Context *ctx, Func *func, bool genthc, bool _showir) {
+CodeBuilder::CodeBuilder(Context *ctx, Func *func, bool genthc, bool _showir, Arena *arena)
+		: codebuf(arena) {
 	this->ctx = ctx;
 	this->func = func;
 	this->genthc = genthc;
@@ -39,17 +40,17 @@ void CodeBuilder::createIns(int ins) {
 	ADDINS(ins);
 }
 
-void CodeBuilder::createIntIns(int ins, int n) {
+void CodeBuilder::createIntIns(int ins, int64_t n) {
 	if(showir) {
-		printf("%04d: %s\t%d\n", ci, ctx->getInstName(ins), n);
+		printf("%04d: %s\t%lld\n", ci, ctx->getInstName(ins), (long long)n);
 	}
 	ADDINS(ins);
 	ADD(i, n);
 }
 
-void CodeBuilder::createRegIntIns(int ins, int reg, int ival) {
+void CodeBuilder::createRegIntIns(int ins, int reg, int64_t ival) {
 	if(showir) {
-		printf("%04d: %s\t[%d] %d\n", ci, ctx->getInstName(ins), reg, ival);
+		printf("%04d: %s\t[%d] %lld\n", ci, ctx->getInstName(ins), reg, (long long)ival);
 	}
 	ADDINS(ins);
 	ADD(i, reg);
@@ -99,6 +100,46 @@ void CodeBuilder::createConsIns(int ins, Cons *cons) {
 	ADD(cons, cons);
 }
 
+void CodeBuilder::createForeignIns(int ins, Foreign *ff, int reg) {
+	if(showir) {
+		printf("%04d: %s\t%s [%d]\n", ci, ctx->getInstName(ins), ff->name, reg);
+	}
+	ADDINS(ins);
+	ADD(ffi, ff);
+	ADD(i, reg);
+}
+
+void CodeBuilder::createMemoIns(int ins, Memo *m, int reg) {
+	if(showir) {
+		printf("%04d: %s\t%p [%d]\n", ci, ctx->getInstName(ins), m, reg);
+	}
+	ADDINS(ins);
+	ADD(memo, m);
+	ADD(i, reg);
+}
+
+void CodeBuilder::createMagicIns(int ins, int reg, int64_t d, int64_t magic, int shift) {
+	if(showir) {
+		printf("%04d: %s\t[%d] %lld (%lld >> %d)\n", ci, ctx->getInstName(ins), reg,
+				(long long)d, (long long)magic, MAGIC_SHIFT(shift));
+	}
+	ADDINS(ins);
+	ADD(i, reg);
+	ADD(i, d);
+	ADD(i, magic);
+	ADD(i, shift);
+}
+
+void CodeBuilder::createRace(int reg, int n, int kind) {
+	if(showir) {
+		printf("%04d: %s\t[%d] %d %d\n", ci, ctx->getInstName(INS_RACE), reg, n, kind);
+	}
+	ADDINS(INS_RACE);
+	ADD(i, reg);
+	ADD(i, n);
+	ADD(i, kind);
+}
+
 int CodeBuilder::createCondOp(int inst, int a, int b, int offset) {
 	int lb = ci;
 	if(showir) {
@@ -111,10 +152,10 @@ int CodeBuilder::createCondOp(int inst, int a, int b, int offset) {
 	return lb;
 }
 
-int CodeBuilder::createCondOpC(int inst, int a, int b, int offset) {
+int CodeBuilder::createCondOpC(int inst, int a, int64_t b, int offset) {
 	int lb = ci;
 	if(showir) {
-		printf("%04d: %s\t[%d] %d L%d\n", ci, ctx->getInstName(inst), a, b, lb);
+		printf("%04d: %s\t[%d] %lld L%d\n", ci, ctx->getInstName(inst), a, (long long)b, lb);
 	}
 	ADDINS(inst);
 	ADD(i, offset);
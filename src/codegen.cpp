@@ -1,10 +1,15 @@
 #include "lisp.h"
 
 static ValueType genSpawn(Func *func, Cons *cons, CodeBuilder *cb, int sp);
+static ValueType genPfind(Func *, Cons *cons, CodeBuilder *cb, int sp);
+static ValueType genAssoc(Func *op, Cons *cons, int n, CodeBuilder *cb, int sp, bool first);
+static bool hasCall(CodeBuilder *cb, Cons *cons, int n);
+static Effect listEffect(CodeBuilder *cb, Cons *cons, int n);
+static bool canFork(Effect spawned, Effect rest);
 
 static int getArgIndex(Func *func, const char *name) {
 	for(int i=0; i<(int)func->argc; i++) {
-		if(strcmp(name, func->args[i]) == 0) {
+		if(name == func->args[i]) {
 			return i;
 		}
 	}
@@ -62,27 +67,18 @@ ValueType codegen(Cons *cons, CodeBuilder *cb, int sp, bool spawn) {
 	}
 }
 
-static ValueType genAdd(Func *, Cons *cons, CodeBuilder *cb, int sp) {
+static int length(Cons *cons) {
+	int n = 0;
+	for(; cons != NULL; cons = cons->cdr) n++;
+	return n;
+}
+
+static ValueType genAdd(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
 	if(cons == NULL) {
 		cb->createIConst(sp, 0);
 		return VT_INT;
 	}
-	ValueType vt = codegen(cons, cb, sp, cons->cdr != NULL);
-	cons = cons->cdr;
-	bool tf = vt == VT_FUTURE;
-	for(; cons != NULL; cons = cons->cdr) {
-		int sft = tf ? 2 : 1;
-		if(codegen(cons, cb, sp + sft) != VT_INT) {
-			fprintf(stderr, "not integer\n");
-			throw "";
-		}
-		if(tf) {
-			cb->createJoin(sp);
-			tf = false;
-		}
-		cb->createIAdd(sp, sp + sft);
-	}
-	return VT_INT;
+	return genAssoc(func, cons, length(cons), cb, sp, true);
 }
 
 static ValueType genSub(Func *, Cons *cons, CodeBuilder *cb, int sp) {
@@ -103,14 +99,12 @@ static ValueType genSub(Func *, Cons *cons, CodeBuilder *cb, int sp) {
 	return VT_INT;
 }
 
-static ValueType genMul(Func *, Cons *cons, CodeBuilder *cb, int sp) {
-	codegen(cons, cb, sp);
-	cons = cons->cdr;
-	for(; cons != NULL; cons = cons->cdr) {
-		codegen(cons, cb, sp + 1);
-		cb->createIMul(sp, sp + 1);
+static ValueType genMul(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	if(cons == NULL) {
+		cb->createIConst(sp, 1);
+		return VT_INT;
 	}
-	return VT_INT;
+	return genAssoc(func, cons, length(cons), cb, sp, true);
 }
 
 static ValueType genDiv(Func *, Cons *cons, CodeBuilder *cb, int sp) {
@@ -133,6 +127,59 @@ static ValueType genMod(Func *, Cons *cons, CodeBuilder *cb, int sp) {
 	return VT_INT;
 }
 
+#define genBitFunc(_fname, _op, _unit) \
+static ValueType _fname(Func *, Cons *cons, CodeBuilder *cb, int sp) { \
+	if(cons == NULL) { \
+		cb->createIConst(sp, _unit); \
+		return VT_INT; \
+	} \
+	codegen(cons, cb, sp); \
+	for(cons = cons->cdr; cons != NULL; cons = cons->cdr) { \
+		codegen(cons, cb, sp + 1); \
+		cb->createReg2Ins(_op, sp, sp + 1); \
+	} \
+	return VT_INT; \
+}
+
+genBitFunc(genLogAnd, INS_IAND, -1);
+genBitFunc(genLogIor, INS_IOR, 0);
+genBitFunc(genLogXor, INS_IXOR, 0);
+
+/* (ash x n) shifts x left by n, or right by -n. the count is taken modulo 64 */
+static ValueType genShift(Func *func, Cons *cons, CodeBuilder *cb, int sp, int rop) {
+	if(cons == NULL || cons->cdr == NULL || cons->cdr->cdr != NULL) {
+		fprintf(stderr, "%s: 2 arguments required\n", func->name);
+		throw "";
+	}
+	codegen(cons, cb, sp);
+	Cons *n = cons->cdr;
+	if(n->type == CONS_INT) {
+		if(n->i >= 0) {
+			cb->createRegIntIns(INS_ISHLC, sp, n->i);
+		} else {
+			cb->createRegIntIns(toConstOp(rop), sp, -n->i);
+		}
+		return VT_INT;
+	}
+	codegen(n, cb, sp + 1);
+	int l = cb->createCondOpC(INS_IJMPLTC, sp + 1, 0);
+	cb->createReg2Ins(INS_ISHL, sp, sp + 1);
+	int m = cb->createJmp();
+	cb->setLabel(l);
+	cb->createINeg(sp + 1);
+	cb->createReg2Ins(rop, sp, sp + 1);
+	cb->setLabel(m);
+	return VT_INT;
+}
+
+static ValueType genAsh(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	return genShift(func, cons, cb, sp, INS_ISAR);
+}
+
+static ValueType genLsh(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	return genShift(func, cons, cb, sp, INS_ISHR);
+}
+
 static int toOp(const char *s) {
 	if(strcmp(s, "<") == 0)  return INS_IJMPGE;
 	if(strcmp(s, "<=") == 0) return INS_IJMPGT;
@@ -183,7 +230,7 @@ static ValueType genIf(Func *, Cons *cons, CodeBuilder *cb, int sp) {
 		label = cb->createCondOp(op, sp, sp+1);
 	} else {
 		ValueType cty = codegen(cond, cb, sp);
-		if(cty == VT_BOOLEAN) {
+		if(cty == VT_BOOLEAN || cty == VT_CONS) {
 			cb->createIConst(sp + 1, 0); /* nil */
 			op = INS_IJMPEQ;
 			label = cb->createCondOp(op, sp, sp+1);
@@ -204,45 +251,58 @@ static ValueType genIf(Func *, Cons *cons, CodeBuilder *cb, int sp) {
 		elsetype = VT_BOOLEAN;
 	}
 	cb->setLabel(merge);
-	return thentype == elsetype ? thentype : VT_INT;
-}
-
-static const char *newStr(const char *ss) {
-	int len = strlen(ss);
-	char *s = new char[len + 1];
-	strcpy(s, ss);
-	return s;
+	if(thentype == elsetype) return thentype;
+	// a list or nil
+	if((thentype == VT_CONS && elsetype == VT_BOOLEAN) ||
+			(thentype == VT_BOOLEAN && elsetype == VT_CONS)) return VT_CONS;
+	return VT_INT;
 }
 
-static Cons *copyCons(Cons *cons) {
-	if(cons == NULL) return NULL;
-	Cons *c = new Cons(cons->type);
-	switch(cons->type) {
-	case CONS_INT: c->i = cons->i; break;
-	case CONS_STR: c->str = newStr(cons->str); break;
-	case CONS_FLOAT: c->f = cons->f; break;
-	case CONS_CAR: c->car = copyCons(cons->car); break;
-	default: abort();
+// copy into arena, recursive only on car
+static Cons *copyCons(Cons *cons, Arena *arena) {
+	Cons *res = NULL;
+	Cons **p = &res;
+	for(; cons != NULL; cons = cons->cdr) {
+		Cons *c = new(arena) Cons(cons->type);
+		switch(cons->type) {
+		case CONS_INT: c->i = cons->i; break;
+		case CONS_STR: c->str = cons->str; break;
+		case CONS_FLOAT: c->f = cons->f; break;
+		case CONS_CAR: c->car = copyCons(cons->car, arena); break;
+		default: abort();
+		}
+		*p = c;
+		p = &c->cdr;
 	}
-	if(cons->cdr != NULL) c->cdr = copyCons(cons->cdr);
-	return c;
+	return res;
 }
 
-static Func *newFunc(const char *name, Cons *args, CodeGenFunc gen) {
+static Func *newFunc(Context *ctx, const char *name, Cons *args, CodeGenFunc gen) {
 	int argc = 0;
 	for(Cons *c=args; c!=NULL; c=c->cdr) {
 		argc++;
 	}
 	Func *f = new Func();
-	f->name = newStr(name);
+	f->name = ctx->symtab->intern(name);
 	f->argc = argc;
 	f->args = argc != 0 ? new const char *[argc] : NULL;
 	int i = 0;
 	for(Cons *c=args; c!=NULL; c=c->cdr) {
-		f->args[i++] = newStr(c->str);
+		f->args[i++] = c->str;
 	}
+	f->runcode = NULL;
 	f->code = NULL;
+	f->srccode = NULL;
+	f->callcount = 0;
+	f->reopt = false;
 	f->codegen = gen;
+	f->effect = EFF_PURE;
+	f->foreign = NULL;
+	f->memo = NULL;
+#ifdef USING_PROFILE
+	f->brcount = NULL;
+	f->id = ctx->prof->newFuncId(f->name);
+#endif
 	return f;
 }
 
@@ -252,7 +312,10 @@ static ValueType genCall(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
 	int n = 0;
 	sp += RSFT;
 	for(; cons != NULL; cons = cons->cdr) {
-		ValueType v = codegen(cons, cb, sp + n, cons->cdr != NULL);
+		// the other arguments are evaluated while it runs
+		bool fork = hasCall(cb, cons->cdr, -1) &&
+			canFork(listEffect(cb, cons, 1), listEffect(cb, cons->cdr, -1));
+		ValueType v = codegen(cons, cb, sp + n, fork);
 		vals.add(v);
 		n += v == VT_FUTURE ? 2 : 1;
 	}
@@ -282,6 +345,386 @@ static ValueType genSpawn(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
 	return VT_FUTURE;
 }
 
+//------------------------------------------------------
+// effect analysis on the source. a call has the effect of its function,
+// set when the function is defined from the effects of its body, joined
+// with the effects of its arguments. a function calling itself is taken
+// as pure while its body is analysed. a redefinition is a new Func, so the
+// effect compiled into a caller stays right for the function it calls
+
+static Effect maxEffect(Effect a, Effect b) {
+	return a > b ? a : b;
+}
+
+static Effect exprEffect(CodeBuilder *cb, Cons *cons) {
+	if(cons->type == CONS_STR) {
+		const char *name = cons->str;
+		if(strcmp(name, "t") == 0 || strcmp(name, "nil") == 0) return EFF_PURE;
+		if(cb->getFunc() != NULL && getArgIndex(cb->getFunc(), name) != -1) return EFF_PURE;
+		return EFF_READ;
+	}
+	if(cons->type != CONS_CAR || cons->car == NULL || cons->car->type != CONS_STR) {
+		return EFF_PURE;
+	}
+	Func *func = cb->getCtx()->getFunc(cons->car->str);
+	if(func == NULL) return EFF_PURE; // reported by codegen
+	if(func->effect == EFF_WRITE) return EFF_WRITE;
+	Cons *args = cons->car->cdr;
+	if(func->codegen == genPfind) {
+		// (pfind f lo hi) calls f
+		Func *pred = args != NULL && args->type == CONS_STR ? cb->getCtx()->getFunc(args->str) : NULL;
+		return pred != NULL ? maxEffect(pred->effect, listEffect(cb, args->cdr, -1)) : EFF_WRITE;
+	}
+	return maxEffect(func->effect, listEffect(cb, args, -1));
+}
+
+// of the first n expressions, all of them if n < 0
+static Effect listEffect(CodeBuilder *cb, Cons *cons, int n) {
+	Effect e = EFF_PURE;
+	for(int i=0; cons != NULL && i != n && e != EFF_WRITE; cons = cons->cdr, i++) {
+		e = maxEffect(e, exprEffect(cb, cons));
+	}
+	return e;
+}
+
+// a task may run alongside the rest: it does not write, and it only reads
+// when the rest does not write. a change of a hash table is a write
+static bool canFork(Effect spawned, Effect rest) {
+	return spawned == EFF_PURE || (spawned != EFF_WRITE && rest != EFF_WRITE);
+}
+
+// the code and the copy kept for reoptimization
+static void setCode(Func *func, CodeBuilder *cb) {
+	func->code = cb->getCode();
+	func->codeLength = cb->getCodeLength();
+	func->srccode = new Code[func->codeLength];
+	func->srcLength = func->codeLength;
+	memcpy(func->srccode, func->code, sizeof(Code) * func->codeLength);
+}
+
+//------------------------------------------------------
+// a branch is an expression compiled as a function of its own, named
+// after the enclosing function, so that it can be spawned
+
+static Func *newBranchFunc(CodeBuilder *cb, const char *kind, int argc) {
+	Context *ctx = cb->getCtx();
+	char name[256];
+	snprintf(name, sizeof(name), "%s/%s", cb->getFunc()->name, kind);
+	return newUserFunc(ctx, ctx->symtab->intern(name), argc);
+}
+
+// a future at sp, the arguments of the enclosing function are passed
+static void spawnBranch(CodeBuilder *cb, Func *func, int sp) {
+	for(int i=0; i<(int)func->argc; i++) {
+		cb->createMov(sp + SRSFT + i, i);
+	}
+	cb->createSpawn(func, sp + SRSFT);
+}
+
+static void optimizeFunc(Context *ctx, Func *func) {
+	// the batch compile threads may be optimizing its callees
+	if(ctx->flagBatch) codeunopt(ctx, func);
+	else codeopt(ctx, func);
+}
+
+static void addBranchFunc(Context *ctx, Func *func) {
+	ctx->putFunc(func);
+	optimizeFunc(ctx, func);
+}
+
+// a branch takes the arguments of the enclosing function
+static Func *genBranch(CodeBuilder *cb, Cons *body, const char *kind) {
+	Context *ctx = cb->getCtx();
+	Func *outer = cb->getFunc();
+	Func *func = newBranchFunc(cb, kind, outer->argc);
+	for(int i=0; i<(int)outer->argc; i++) {
+		func->args[i] = outer->args[i];
+	}
+	Arena arena;
+	CodeBuilder bcb(ctx, func, false, true, &arena);
+	func->effect = listEffect(&bcb, body, 1);
+	func->rtype = codegen(body, &bcb, func->argc);
+	bcb.createRet(func->argc);
+	bcb.createEnd();
+	setCode(func, &bcb);
+	addBranchFunc(ctx, func);
+	return func;
+}
+
+//------------------------------------------------------
+// por, pand, pfind: the branches run as tasks in a cancel scope and RACE
+// waits until one decides the result, then cancels the others.
+// at sp: the result, the token and a future for each branch
+
+#define RACE_FUTURES 3
+
+static ValueType genRace(Cons *cons, CodeBuilder *cb, int sp, int kind, const char *name) {
+	if(cons == NULL) {
+		cb->createIConst(sp, kind == RACE_PAND ? 1 : 0);
+		return VT_BOOLEAN;
+	}
+	ValueType vt = VT_VOID;
+	int n = 0;
+	cb->createScope(sp);
+	for(; cons != NULL; cons = cons->cdr) {
+		Func *func = genBranch(cb, cons, name);
+		spawnBranch(cb, func, sp + RACE_FUTURES + n * 2);
+		vt = n == 0 || vt == func->rtype ? func->rtype : VT_INT;
+		n++;
+	}
+	cb->createRace(sp, n, kind);
+	return vt;
+}
+
+// the value of the first branch that is not nil
+static ValueType genPor(Func *, Cons *cons, CodeBuilder *cb, int sp) {
+	return genRace(cons, cb, sp, RACE_POR, "por");
+}
+
+// nil if a branch is nil, else the value of the last one
+static ValueType genPand(Func *, Cons *cons, CodeBuilder *cb, int sp) {
+	return genRace(cons, cb, sp, RACE_PAND, "pand");
+}
+
+//------------------------------------------------------
+// n-ary + and *: the operands are split in half, the right half is
+// spawned as (op ...) when both halves call a function and the left half
+// is evaluated in place, recursively. each join waits for the half it
+// pairs with, so the joins follow the tree
+
+static bool isCall(CodeBuilder *cb, Cons *cons) {
+	if(cons->type != CONS_CAR || cons->car == NULL || cons->car->type != CONS_STR) return false;
+	Func *func = cb->getCtx()->getFunc(cons->car->str);
+	return func != NULL && func->args != NULL;
+}
+
+// a call to a defun in the first n expressions, all of them if n < 0
+static bool hasCall(CodeBuilder *cb, Cons *cons, int n) {
+	for(int i=0; cons != NULL && i != n; cons = cons->cdr, i++) {
+		if(isCall(cb, cons)) return true;
+		if(cons->type == CONS_CAR && cons->car != NULL && hasCall(cb, cons->car->cdr, -1)) return true;
+	}
+	return false;
+}
+
+static void genOp(Func *op, CodeBuilder *cb, int r, int r2) {
+	if(op->codegen == genAdd) cb->createIAdd(r, r2);
+	else cb->createIMul(r, r2);
+}
+
+// + takes anything as the first operand, integers after it
+static ValueType genOperand(Func *op, Cons *cons, CodeBuilder *cb, int sp, bool first) {
+	ValueType vt = codegen(cons, cb, sp);
+	if(!first && vt != VT_INT && op->codegen == genAdd) {
+		fprintf(stderr, "not integer\n");
+		throw "";
+	}
+	return vt;
+}
+
+static ValueType genFold(Func *op, Cons *cons, int n, CodeBuilder *cb, int sp, bool first) {
+	ValueType vt = genOperand(op, cons, cb, sp, first);
+	for(int i=1; i<n; i++) {
+		cons = cons->cdr;
+		genOperand(op, cons, cb, sp + 1, false);
+		genOp(op, cb, sp, sp + 1);
+		vt = VT_INT;
+	}
+	return vt;
+}
+
+// n operands as (op ...), a future at sp
+static void spawnOperands(Func *op, Cons *cons, int n, CodeBuilder *cb, int sp) {
+	if(n == 1 && isCall(cb, cons)) {
+		codegen(cons, cb, sp, true);
+		return;
+	}
+	Arena arena;
+	Cons *call = new(&arena) Cons(CONS_CAR);
+	Cons *c = call->car = new(&arena) Cons(CONS_STR);
+	c->str = op->name;
+	for(int i=0; i<n; i++, cons = cons->cdr) {
+		c->cdr = new(&arena) Cons(*cons);
+		c = c->cdr;
+		c->cdr = NULL;
+	}
+	spawnBranch(cb, genBranch(cb, n == 1 ? call->car->cdr : call, op->name), sp);
+}
+
+static ValueType genAssoc(Func *op, Cons *cons, int n, CodeBuilder *cb, int sp, bool first) {
+	int m = n / 2;
+	Cons *right = cons;
+	for(int i=0; i<m; i++) right = right->cdr;
+	if(n < 2 || !hasCall(cb, cons, m) || !hasCall(cb, right, -1) ||
+			!canFork(listEffect(cb, right, n - m), listEffect(cb, cons, m))) {
+		return genFold(op, cons, n, cb, sp, first);
+	}
+	spawnOperands(op, right, n - m, cb, sp);
+	genAssoc(op, cons, m, cb, sp + 2, first);
+	cb->createJoin(sp);
+	genOp(op, cb, sp, sp + 2);
+	return VT_INT;
+}
+
+// searches [lo, hi) for an i where (pred i) is not nil, -1 if none.
+// the backward jump is a safepoint. not reoptimized, the passes take
+// no loops
+static Func *genFindFunc(CodeBuilder *cb, Func *pred) {
+	Context *ctx = cb->getCtx();
+	Func *func = newBranchFunc(cb, "pfind", 2);
+	func->effect = pred->effect;
+	func->args[0] = ctx->symtab->intern("lo");
+	func->args[1] = ctx->symtab->intern("hi");
+	Arena arena;
+	CodeBuilder fcb(ctx, func, false, true, &arena);
+	int head = fcb.getCodeLength();
+	int none = fcb.createCondOp(INS_IJMPGE, 0, 1);
+	fcb.createMov(2 + RSFT, 0);
+	fcb.createCall(pred, 2 + RSFT);
+	int found = fcb.createCondOpC(INS_IJMPNEC, 2, 0);
+	fcb.createIAddC(0, 1);
+	fcb.createJmp(head - fcb.getCodeLength());
+	fcb.setLabel(found);
+	fcb.createRet(0);
+	fcb.setLabel(none);
+	fcb.createRetC(-1);
+	fcb.createEnd();
+	func->code = fcb.getCode();
+	func->codeLength = fcb.getCodeLength();
+	ctx->putFunc(func);
+	codeunopt(ctx, func);
+	return func;
+}
+
+// [d] = lo + (hi - lo) * c / k, lo in [r] and hi in [r+1]
+static void genChunkBound(CodeBuilder *cb, int d, int r, int c, int k) {
+	if(c == 0 || c == k) {
+		cb->createMov(d, c == 0 ? r : r + 1);
+		return;
+	}
+	cb->createMov(d, r + 1);
+	cb->createISub(d, r);
+	cb->createRegIntIns(INS_IMULC, d, c);
+	cb->createRegIntIns(INS_IDIVC, d, k);
+	cb->createIAdd(d, r);
+}
+
+// (pfind f lo hi), a chunk of the range for each worker
+static ValueType genPfind(Func *, Cons *cons, CodeBuilder *cb, int sp) {
+	if(cons == NULL || cons->type != CONS_STR || cons->cdr == NULL ||
+			cons->cdr->cdr == NULL || cons->cdr->cdr->cdr != NULL) {
+		fprintf(stderr, "pfind: (pfind f lo hi) required\n");
+		throw "";
+	}
+	Func *pred = cb->getCtx()->getFunc(cons->str);
+	if(pred == NULL || pred->codegen != genCall || pred->argc != 1) {
+		fprintf(stderr, "pfind: %s is not a function of one argument\n", cons->str);
+		throw "";
+	}
+	codegen(cons->cdr, cb, sp);
+	codegen(cons->cdr->cdr, cb, sp + 1);
+	Func *func = genFindFunc(cb, pred);
+	int k = cb->getCtx()->workers;
+	int g = sp + 2;
+	cb->createScope(g);
+	for(int c=0; c<k; c++) {
+		int s = g + RACE_FUTURES + c * 2 + SRSFT;
+		genChunkBound(cb, s, sp, c, k);
+		genChunkBound(cb, s + 1, sp, c + 1, k);
+		cb->createSpawn(func, s);
+	}
+	cb->createRace(g, k, RACE_PFIND);
+	cb->createMov(sp, g);
+	return VT_INT;
+}
+
+// (make-hash) (gethash h key [default]) (puthash h key value) (remhash h key)
+// (hash-count h), see hashtab.h. the default of gethash is 0
+static ValueType genHash(Func *func, Cons *cons, CodeBuilder *cb, int sp, int kind, ValueType rtype) {
+	int argc = hashArgc(kind);
+	int n = 0;
+	for(; cons != NULL && n < argc; cons = cons->cdr, n++) {
+		codegen(cons, cb, sp + n);
+	}
+	if(kind == HK_GET && n == 2) {
+		cb->createIConst(sp + n, 0);
+		n++;
+	}
+	if(n != argc || cons != NULL) {
+		fprintf(stderr, "%s: %d arguments required\n", func->name, argc);
+		throw "";
+	}
+	cb->createRegIntIns(INS_HASH, sp, kind);
+	return rtype;
+}
+
+#define genHashFunc(_fname, _kind, _rtype) \
+static ValueType _fname(Func *func, Cons *cons, CodeBuilder *cb, int sp) { \
+	return genHash(func, cons, cb, sp, _kind, _rtype); \
+}
+
+genHashFunc(genMakeHash, HK_NEW, VT_INT);
+genHashFunc(genGetHash, HK_GET, VT_INT);
+genHashFunc(genPutHash, HK_PUT, VT_INT);
+genHashFunc(genRemHash, HK_REM, VT_BOOLEAN);
+genHashFunc(genHashCount, HK_COUNT, VT_INT);
+
+// (cons a d) (car l) (cdr l) (list a ...), see heap.h. car and cdr of
+// what is not a cell are nil
+static ValueType genCellOp(Func *func, Cons *cons, CodeBuilder *cb, int sp, int op, int argc) {
+	int n = 0;
+	for(; cons != NULL && n < argc; cons = cons->cdr, n++) {
+		codegen(cons, cb, sp + n);
+	}
+	if(n != argc || cons != NULL) {
+		fprintf(stderr, "%s: %d arguments required\n", func->name, argc);
+		throw "";
+	}
+	cb->createRegIns(op, sp);
+	return op == INS_CAR ? VT_INT : VT_CONS;
+}
+
+static ValueType genCons(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	return genCellOp(func, cons, cb, sp, INS_CONS, 2);
+}
+
+static ValueType genCar(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	return genCellOp(func, cons, cb, sp, INS_CAR, 1);
+}
+
+static ValueType genCdr(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	return genCellOp(func, cons, cb, sp, INS_CDR, 1);
+}
+
+// the elements in [sp..sp+n), consed from the last one
+static ValueType genList(Func *, Cons *cons, CodeBuilder *cb, int sp) {
+	int n = 0;
+	for(; cons != NULL; cons = cons->cdr, n++) {
+		codegen(cons, cb, sp + n);
+	}
+	cb->createIConst(sp + n, 0);
+	for(int i=n-1; i>=0; i--) {
+		cb->createRegIns(INS_CONS, sp + i);
+	}
+	return n != 0 ? VT_CONS : VT_BOOLEAN;
+}
+
+// (print x) prints x on a line and returns it, see output.h
+static ValueType genPrint(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	if(cons == NULL || cons->cdr != NULL) {
+		fprintf(stderr, "%s: 1 argument required\n", func->name);
+		throw "";
+	}
+	ValueType ty = codegen(cons, cb, sp);
+	switch(ty) {
+	case VT_BOOLEAN: cb->createPrintBoolean(sp); break;
+	case VT_FLOAT: cb->createPrintFloat(sp); break;
+	case VT_CONS: cb->createPrintList(sp); break;
+	default: cb->createPrintInt(sp); break;
+	}
+	return ty;
+}
+
 static ValueType genSetq(Func *, Cons *cons, CodeBuilder *cb, int sp) {
 	assert(cons->type == CONS_STR);
 	const char *name = cons->str;
@@ -289,7 +732,7 @@ static ValueType genSetq(Func *, Cons *cons, CodeBuilder *cb, int sp) {
 	Cons *expr = cons;
 
 	Variable *v = new Variable();
-	v->name = newStr(name);
+	v->name = name;
 	v->value.i = 0;
 	cb->getCtx()->putVar(v);
 
@@ -299,23 +742,17 @@ static ValueType genSetq(Func *, Cons *cons, CodeBuilder *cb, int sp) {
 }
 
 static ValueType genDefun(Func *, Cons *cons, CodeBuilder *cb, int sp) {
-	Cons *c = copyCons(cons);
+	// the body outlives the form
+	Cons *c = copyCons(cons, &cb->getCtx()->code_arena);
 	cb->createConsIns(INS_DEFUN, c);
-	cb->getCtx()->code_cons.add(c);
 	return VT_VOID;
 }
 
-void defun(Context *ctx, Cons *cons) {
-	const char *name = cons->str;
-	cons = cons->cdr;
-	Cons *args = cons->car;
-	cons = cons->cdr;
-	Func *func = newFunc(name, args, genCall);
-	func->rtype = VT_INT;
-
-	ctx->putFunc(func);
-
-	CodeBuilder cb(ctx, func, false, true);
+// the forms of a defun, the value of the last one is returned
+static void genBody(Context *ctx, Func *func, Cons *cons) {
+	Arena arena;
+	CodeBuilder cb(ctx, func, false, true, &arena);
+	func->effect = listEffect(&cb, cons, -1);
 	if(cons == NULL) {
 		cb.createIConst(0, 0);
 		func->rtype = VT_BOOLEAN;
@@ -327,27 +764,149 @@ void defun(Context *ctx, Cons *cons) {
 	}
 	cb.createRet(func->argc);
 	cb.createEnd();
-	func->code = cb.getCode();
-	func->codeLength = cb.getCodeLength();
-	codeopt(ctx, func);
+	setCode(func, &cb);
+}
+
+// define the function and generate its unoptimized code
+Func *defineFunc(Context *ctx, Cons *cons) {
+	const char *name = cons->str;
+	PhaseClock clk;
+	if(ctx->phases != NULL) ctx->phases->start(&clk, -1);
+	cons = cons->cdr;
+	Cons *args = cons->car;
+	cons = cons->cdr;
+	Func *func = newFunc(ctx, name, args, genCall);
+	func->rtype = VT_INT;
+
+	ctx->putFunc(func);
+	genBody(ctx, func, cons);
+	if(ctx->phases != NULL) ctx->phases->end(&clk, name, PHASE_CODEGEN, func->codeLength);
+	return func;
+}
+
+// a defun whose code is set by the caller, args are left to fill
+Func *newUserFunc(Context *ctx, const char *name, int argc) {
+	Func *f = newFunc(ctx, name, NULL, genCall);
+	f->argc = argc;
+	f->args = argc != 0 ? new const char *[argc] : NULL;
+	f->rtype = VT_INT;
+	return f;
+}
+
+// run by DEFUN, forms of other threads may be compiling
+void defun(Context *ctx, Cons *cons) {
+	pthread_mutex_lock(&ctx->codelock);
+	try {
+		codeopt(ctx, defineFunc(ctx, cons));
+	} catch(const char *) {
+		pthread_mutex_unlock(&ctx->codelock);
+		throw;
+	}
+	pthread_mutex_unlock(&ctx->codelock);
+}
+
+//------------------------------------------------------
+// (defun-memo name (args) body...) of a pure function: name is a wrapper
+// that looks the arguments up in a memo cache and calls the body
+// "name/memo" on a miss. the recursive calls in the body go through the
+// wrapper. defined when the form is compiled, it emits no code
+static ValueType genDefunMemo(Func *, Cons *cons, CodeBuilder *cb, int) {
+	Context *ctx = cb->getCtx();
+	if(cons == NULL || cons->type != CONS_STR || cons->cdr == NULL || cons->cdr->type != CONS_CAR) {
+		fprintf(stderr, "defun-memo: name and arguments required\n");
+		throw "";
+	}
+	const char *name = cons->str;
+	Func *func = newFunc(ctx, name, cons->cdr->car, genCall);
+	int argc = func->argc;
+	if(argc < 1 || argc > MEMO_MAXARGS) {
+		fprintf(stderr, "defun-memo: %s: 1 to %d arguments required\n", name, MEMO_MAXARGS);
+		throw "";
+	}
+	func->rtype = VT_INT;
+	ctx->putFunc(func);
+	char bname[256];
+	snprintf(bname, sizeof(bname), "%s/memo", name);
+	Func *body = newFunc(ctx, bname, cons->cdr->car, genCall);
+	body->rtype = VT_INT;
+	ctx->putFunc(body);
+	genBody(ctx, body, cons->cdr->cdr);
+	func->rtype = body->rtype;
+	if(body->effect == EFF_PURE) {
+		func->memo = newMemo(argc);
+	} else {
+		fprintf(stderr, "defun-memo: %s is not pure, defined without a cache\n", name);
+		func->effect = body->effect;
+	}
+	// [argc] the claimed entry, [argc+1] the value
+	Arena arena;
+	CodeBuilder wcb(ctx, func, false, true, &arena);
+	if(func->memo != NULL) wcb.createMemoIns(INS_MEMO, func->memo, argc);
+	int s = argc + 1 + RSFT;
+	for(int i=0; i<argc; i++) {
+		wcb.createMov(s + i, i);
+	}
+	wcb.createCall(body, s);
+	if(func->memo != NULL) wcb.createMemoIns(INS_MEMOSET, func->memo, argc);
+	wcb.createRet(argc + 1);
+	wcb.createEnd();
+	setCode(func, &wcb);
+	optimizeFunc(ctx, body);
+	optimizeFunc(ctx, func);
+	return VT_VOID;
+}
+
+static Func *effectful(Func *func) {
+	func->effect = EFF_WRITE;
+	return func;
+}
+
+static Func *shared(Func *func) {
+	func->effect = EFF_SHARED;
+	return func;
+}
+
+static Func *reading(Func *func) {
+	func->effect = EFF_READ;
+	return func;
 }
 
 void addDefaultFuncs(Context *ctx) {
-	ctx->putFunc(newFunc("+" , NULL, genAdd));
-	ctx->putFunc(newFunc("-" , NULL, genSub));
-	ctx->putFunc(newFunc("*" , NULL, genMul));
-	ctx->putFunc(newFunc("/" , NULL, genDiv));
-	ctx->putFunc(newFunc("mod" , NULL, genMod));
-	ctx->putFunc(newFunc("<" , NULL, genLT));
-	ctx->putFunc(newFunc(">" , NULL, genGT));
-	ctx->putFunc(newFunc("<=", NULL, genLE));
-	ctx->putFunc(newFunc(">=", NULL, genGE));
-	ctx->putFunc(newFunc("=", NULL, genEQ));
-	ctx->putFunc(newFunc("eq", NULL, genEQ));
-	ctx->putFunc(newFunc("equal", NULL, genEQ));
-	ctx->putFunc(newFunc("!=", NULL, genNE));
-	ctx->putFunc(newFunc("if", NULL, genIf));
-	ctx->putFunc(newFunc("setq", NULL, genSetq));
-	ctx->putFunc(newFunc("defun", NULL, genDefun));
+	ctx->putFunc(newFunc(ctx, "+" , NULL, genAdd));
+	ctx->putFunc(newFunc(ctx, "-" , NULL, genSub));
+	ctx->putFunc(newFunc(ctx, "*" , NULL, genMul));
+	ctx->putFunc(newFunc(ctx, "/" , NULL, genDiv));
+	ctx->putFunc(newFunc(ctx, "mod" , NULL, genMod));
+	ctx->putFunc(newFunc(ctx, "logand", NULL, genLogAnd));
+	ctx->putFunc(newFunc(ctx, "logior", NULL, genLogIor));
+	ctx->putFunc(newFunc(ctx, "logxor", NULL, genLogXor));
+	ctx->putFunc(newFunc(ctx, "ash", NULL, genAsh));
+	ctx->putFunc(newFunc(ctx, "lsh", NULL, genLsh));
+	ctx->putFunc(newFunc(ctx, "<" , NULL, genLT));
+	ctx->putFunc(newFunc(ctx, ">" , NULL, genGT));
+	ctx->putFunc(newFunc(ctx, "<=", NULL, genLE));
+	ctx->putFunc(newFunc(ctx, ">=", NULL, genGE));
+	ctx->putFunc(newFunc(ctx, "=", NULL, genEQ));
+	ctx->putFunc(newFunc(ctx, "eq", NULL, genEQ));
+	ctx->putFunc(newFunc(ctx, "equal", NULL, genEQ));
+	ctx->putFunc(newFunc(ctx, "!=", NULL, genNE));
+	ctx->putFunc(newFunc(ctx, "if", NULL, genIf));
+	ctx->putFunc(effectful(newFunc(ctx, "setq", NULL, genSetq)));
+	ctx->putFunc(effectful(newFunc(ctx, "defun", NULL, genDefun)));
+	ctx->putFunc(effectful(newFunc(ctx, "defun-memo", NULL, genDefunMemo)));
+	ctx->putFunc(effectful(newFunc(ctx, "defforeign", NULL, genDefforeign)));
+	ctx->putFunc(newFunc(ctx, "por", NULL, genPor));
+	ctx->putFunc(newFunc(ctx, "pand", NULL, genPand));
+	ctx->putFunc(newFunc(ctx, "pfind", NULL, genPfind));
+	ctx->putFunc(shared(newFunc(ctx, "make-hash", NULL, genMakeHash)));
+	ctx->putFunc(reading(newFunc(ctx, "gethash", NULL, genGetHash)));
+	ctx->putFunc(effectful(newFunc(ctx, "puthash", NULL, genPutHash)));
+	ctx->putFunc(effectful(newFunc(ctx, "remhash", NULL, genRemHash)));
+	ctx->putFunc(reading(newFunc(ctx, "hash-count", NULL, genHashCount)));
+	ctx->putFunc(newFunc(ctx, "cons", NULL, genCons));
+	ctx->putFunc(newFunc(ctx, "car", NULL, genCar));
+	ctx->putFunc(newFunc(ctx, "cdr", NULL, genCdr));
+	ctx->putFunc(newFunc(ctx, "list", NULL, genList));
+	ctx->putFunc(shared(newFunc(ctx, "print", NULL, genPrint)));
 }
 
@@ -5,30 +5,41 @@ Context::Context() {
 	funclist = NULL;
 	varlist = NULL;
 	flagShowIR = false;
+	flagBatch = false;
+	flagOrderedOutput = false;
 	inlinecount = 16;
 	workers = 5;
+	symtab = new SymbolTable();
+	prof = new Profile();
+	sampler = NULL;
+	phases = NULL;
+	out = stdout;
+	hashtabs = newHashRegistry();
+	pthread_mutex_init(&codelock, NULL);
 #ifdef USING_THCODE
 	vmrun(this, NULL, NULL); // init jmptable
 #endif
 	addDefaultFuncs(this);   // init funcs
+	heap = new Heap(this);
 	sche = new Scheduler(this);
 }
 
 Context::~Context() {
-	for(int i=0, j=code_cons.getSize(); i<j; i++) {
-		cons_free(code_cons[i]);
-	}
 	delete sche;
+	delete heap;
+	delete prof;
+	delete sampler;
+	delete phases;
 	for(Func *l=funclist; l!=NULL; ){
 		Func *next = l->next;
-		for(int i=0; i<(int)l->argc; i++) {
-			delete [] l->args[i];
-		}
 		if(l->argc != 0) delete [] l->args;
-		delete [] l->name;
+		if(l->runcode != NULL && l->runcode != l->code) delete [] l->runcode;
 		if(l->code != NULL) delete [] l->code;
-#ifdef USING_THCODE
-		if(l->thcode != NULL) delete [] l->thcode;
+		if(l->srccode != NULL) delete [] l->srccode;
+		if(l->foreign != NULL) freeForeign(l->foreign);
+		if(l->memo != NULL) freeMemo(l->memo);
+#ifdef USING_PROFILE
+		if(l->brcount != NULL) delete [] l->brcount;
 #endif
 		delete l;
 		l = next;
@@ -38,32 +49,75 @@ Context::~Context() {
 		delete l;
 		l = next;
 	}
+	freeHashTables(hashtabs);
+	for(int i=0, j=retired.getSize(); i<j; i++) delete [] retired[i];
+	pthread_mutex_destroy(&codelock);
+	delete symtab;
+}
+
+// the values of globals, memo caches and hash tables, for the cons heap
+void Context::addRoots(ArrayBuilder<HeapRange> *roots) {
+	for(Variable *v=varlist; v!=NULL; v=v->next) {
+		HeapRange r = { &v->value, &v->value + 1 };
+		roots->add(r);
+	}
+	for(Func *f=funclist; f!=NULL; f=f->next) {
+		if(f->memo == NULL) continue;
+		HeapRange r = { (Value *)f->memo->entries, (Value *)(f->memo->entries + MEMO_SIZE) };
+		roots->add(r);
+	}
+	for(int64_t h=0; h<hashtabs->count; h++) {
+		HashTable *t = getHashTable(hashtabs, h);
+		for(int i=0; i<HASH_STRIPES; i++) {
+			for(HashChunk *c=t->stripes[i].chunks; c!=NULL; c=c->next) {
+				HeapRange r = { (Value *)c->nodes, (Value *)(c->nodes + HASH_CHUNK) };
+				roots->add(r);
+			}
+		}
+	}
 }
 
 //------------------------------------------------------
 void Context::putFunc(Func *func) {
 	func->next = funclist;
 	funclist = func;
+	funcmap.put(func->name, func);
 }
 
-Func *Context::getFunc(const char *name) {
-	for(Func *f = funclist; f != NULL; f = f->next) {
-		if(strcmp(f->name, name) == 0) return f;
-	}
-	return NULL;
+Func *Context::getFunc(const char *atom) {
+	return funcmap.get(atom);
 }
 
 //------------------------------------------------------
 void Context::putVar(Variable *var) {
 	var->next = varlist;
 	varlist = var;
+	varmap.put(var->name, var);
 }
 
-Variable *Context::getVar(const char *name) {
-	for(Variable *v = varlist; v != NULL; v = v->next) {
-		if(strcmp(v->name, name) == 0) return v;
+Variable *Context::getVar(const char *atom) {
+	return varmap.get(atom);
+}
+
+//------------------------------------------------------
+// reoptimize the functions that got hot, callees first. tasks of other
+// threads may be running the old code, it is freed when none is left
+void Context::reoptFuncs() {
+	ArrayBuilder<Func *> fs;
+	pthread_mutex_lock(&codelock);
+	for(Func *f = funclist; f != NULL; f = f->next) {
+		if(f->srccode != NULL && !f->reopt && f->callcount >= REOPT_CALLCOUNT) {
+			fs.add(f);
+		}
+	}
+	for(int i=fs.getSize()-1; i>=0; i--) {
+		recodeopt(this, fs[i]);
+	}
+	if(retired.getSize() != 0 && sche->isQuiescent()) {
+		for(int i=0, j=retired.getSize(); i<j; i++) delete [] retired[i];
+		retired.clear();
 	}
-	return NULL;
+	pthread_mutex_unlock(&codelock);
 }
 
 //------------------------------------------------------
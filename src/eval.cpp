@@ -0,0 +1,124 @@
+#include "lisp.h"
+
+//------------------------------------------------------
+void cons_print(Cons *cons, FILE *fp) {
+	bool b = false;
+	for(; cons != NULL; cons = cons->cdr) {
+		if(b) printf(" ");
+		b = true;
+		switch(cons->type) {
+		case CONS_INT: printf("%d", cons->i); break;
+		case CONS_STR: printf("%s", cons->str); break;
+		case CONS_FLOAT: printf("%lf", cons->f); break;
+		case CONS_CAR:
+			fprintf(fp, "(");
+			cons_print(cons->car, fp);
+			fprintf(fp, ")");
+			break;
+		}
+	}
+}
+
+void cons_println(Cons *cons, FILE *fp) {
+	cons_print(cons, fp);
+	fprintf(fp, "\n");
+}
+
+//------------------------------------------------------
+// label: the form in the phase report, NULL if not reported. out: where
+// the form prints, ctx->out if NULL. false on a compile error. forms of
+// several threads run at the same time, the codegen holds ctx->codelock
+bool runCons(Context *ctx, Cons *cons, Arena *arena, const char *label, FILE *out) {
+	PhaseTimer *pt = label != NULL ? ctx->phases : NULL;
+	PhaseClock clk;
+	bool ok = true;
+	Func *func = new Func();
+	func->name = "__script";
+	func->argc = 0;
+#ifdef USING_PROFILE
+	func->id = ctx->prof->newFuncId(func->name);
+#endif
+	pthread_mutex_lock(&ctx->codelock);
+	try {
+		if(pt != NULL) pt->start(&clk, -1);
+		CodeBuilder cb(ctx, func, true, true, arena);
+		ValueType ty = codegen(cons, &cb, 0);
+		if(ty == VT_INT) {
+			cb.createPrintInt(0);
+		} else if(ty == VT_BOOLEAN) {
+			cb.createPrintBoolean(0);
+		} else if(ty == VT_CONS) {
+			cb.createPrintList(0);
+		}
+		cb.createRet(0);
+		func->code = cb.getCode();
+		func->codeLength = cb.getCodeLength();
+		func->runcode = func->code;
+		func->runLength = func->codeLength;
+		if(pt != NULL) pt->end(&clk, label, PHASE_CODEGEN, func->codeLength);
+	} catch(const char *str) {
+		ok = false;
+	}
+	pthread_mutex_unlock(&ctx->codelock);
+	if(ok) {
+		if(ctx->sampler != NULL) ctx->sampler->addCode(func);
+		if(pt != NULL) pt->start(&clk, -1);
+		ctx->sche->runWait(func, NULL, out, NULL);
+		if(pt != NULL) pt->end(&clk, label, PHASE_RUN, -1);
+		if(ctx->sampler != NULL) ctx->sampler->removeCode(func);
+		delete [] func->code;
+		ctx->reoptFuncs();
+	}
+	delete func;
+	return ok;
+}
+
+//------------------------------------------------------
+// img: compiled defuns of this source, NULL if not cached.
+// false if a form did not compile
+bool compileAndRun(Context *ctx, const char *src, size_t len, Image *img) {
+	if(ctx->flagBatch) {
+		return runBatch(ctx, src, len, img);
+	}
+	Tokenizer tk(src, len, ctx->symtab);
+	Arena arena; // per form
+	const char *defunAtom = ctx->symtab->intern("defun");
+	int ndefun = 0;
+	int nform = 0;
+	bool ok = true;
+	PhaseTimer *pt = ctx->phases;
+	PhaseClock clk;
+	Cons *res;
+	if(pt != NULL) pt->start(&clk, -1);
+	while(parseCons(&tk, &arena, &res)) {
+		if(res != NULL) {
+			res->cdr = NULL;
+			//cons_println(res);
+			const char *label = NULL;
+			if(pt != NULL) {
+				label = pt->formName(res, defunAtom, nform);
+				pt->end(&clk, label, PHASE_PARSE, -1);
+			}
+			nform++;
+			bool isdefun = isDefunForm(res, defunAtom);
+			if(img != NULL && isdefun) {
+				int form = ndefun++;
+				if(pt != NULL) pt->start(&clk, -1);
+				Func *func = img->loadFunc(ctx, form);
+				if(func == NULL) {
+					if(!runCons(ctx, res, &arena)) ok = false;
+					img->record(form, ctx->getFunc(res->car->cdr->str));
+				} else if(pt != NULL) {
+					pt->end(&clk, label, PHASE_LOAD, func->codeLength);
+				}
+			} else {
+				// a defun reports its own phases
+				if(!runCons(ctx, res, &arena, isdefun ? NULL : label)) ok = false;
+			}
+		}
+		arena.reset();
+		if(pt != NULL) pt->start(&clk, -1);
+	}
+	return ok;
+}
+
@@ -0,0 +1,97 @@
+#include "lisp.h"
+#include <dlfcn.h>
+
+//------------------------------------------------------
+// defforeign, see foreign.h
+
+static bool toType(Cons *c, ForeignType *t) {
+	if(c == NULL || c->type != CONS_STR) return false;
+	if(strcmp(c->str, "int") == 0) *t = FT_INT;
+	else if(strcmp(c->str, "long") == 0) *t = FT_LONG;
+	else if(strcmp(c->str, "void") == 0) *t = FT_VOID;
+	else return false;
+	return true;
+}
+
+// the text of a "..." token without the quotes
+static bool toString(Cons *c, char *buf, size_t size) {
+	if(c == NULL || c->type != CONS_STR || c->str[0] != '"') return false;
+	size_t len = strlen(c->str);
+	if(len < 2 || c->str[len - 1] != '"' || len - 2 >= size) return false;
+	memcpy(buf, c->str + 1, len - 2);
+	buf[len - 2] = '\0';
+	return true;
+}
+
+static ValueType genFCall(Func *func, Cons *cons, CodeBuilder *cb, int sp) {
+	Foreign *ff = func->foreign;
+	int n = 0;
+	for(; cons != NULL; cons = cons->cdr) {
+		if(n == ff->argc) break;
+		codegen(cons, cb, sp + n);
+		n++;
+	}
+	if(n != ff->argc || cons != NULL) {
+		fprintf(stderr, "%s: %d arguments required\n", func->name, ff->argc);
+		throw "";
+	}
+	cb->createForeignIns(INS_FCALL, ff, sp);
+	return func->rtype;
+}
+
+static void bindError(const char *msg, const char *arg) {
+	fprintf(stderr, "defforeign: %s%s\n", msg, arg);
+	throw "";
+}
+
+// (defforeign name "lib" "symbol" (types) type), emits no code
+ValueType genDefforeign(Func *, Cons *cons, CodeBuilder *cb, int) {
+	Context *ctx = cb->getCtx();
+	char lib[256], sym[256];
+	if(cons == NULL || cons->type != CONS_STR) bindError("name required", "");
+	const char *name = cons->str;
+	Cons *c = cons->cdr;
+	if(!toString(c, lib, sizeof(lib)) || !toString(c->cdr, sym, sizeof(sym))) {
+		bindError("library and symbol strings required: ", name);
+	}
+	c = c->cdr->cdr;
+	if(c == NULL || c->type != CONS_CAR || c->cdr == NULL || c->cdr->cdr != NULL) {
+		bindError("argument and result types required: ", name);
+	}
+	Foreign ff;
+	ff.name = name;
+	ff.argc = 0;
+	ff.intargs = 0;
+	for(Cons *a = c->car; a != NULL; a = a->cdr) {
+		ForeignType t;
+		if(!toType(a, &t) || t == FT_VOID) bindError("argument type must be int or long: ", name);
+		if(ff.argc == FOREIGN_MAXARGS) bindError("too many arguments: ", name);
+		if(t == FT_INT) ff.intargs |= 1u << ff.argc;
+		ff.argc++;
+	}
+	if(!toType(c->cdr, &ff.rtype)) bindError("result type must be int, long or void: ", name);
+
+	ff.lib = dlopen(lib[0] != '\0' ? lib : NULL, RTLD_NOW | RTLD_LOCAL);
+	if(ff.lib == NULL) bindError("", dlerror());
+	dlerror();
+	ff.fn = dlsym(ff.lib, sym);
+	const char *err = dlerror();
+	if(err != NULL || ff.fn == NULL) {
+		dlclose(ff.lib);
+		bindError("symbol not found: ", sym);
+	}
+
+	Func *f = newUserFunc(ctx, name, 0);
+	f->codegen = genFCall;
+	f->effect = EFF_WRITE; // unknown native code
+	f->foreign = new Foreign(ff);
+	f->rtype = ff.rtype == FT_VOID ? VT_VOID : VT_INT;
+	ctx->putFunc(f);
+	return VT_VOID;
+}
+
+void freeForeign(Foreign *ff) {
+	dlclose(ff->lib);
+	delete ff;
+}
+
@@ -0,0 +1,196 @@
+#include "lisp.h"
+#include <sched.h>
+
+//------------------------------------------------------
+// concurrent hash table, see hashtab.h
+
+#define RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+static HashBuckets *newBuckets(int64_t size, HashBuckets *old) {
+	HashBuckets *b = new HashBuckets();
+	b->mask = size - 1;
+	b->heads = new HashNode *volatile[size];
+	memset((void *)b->heads, 0, sizeof(HashNode *) * size);
+	b->old = old;
+	return b;
+}
+
+// the handle of a new table, -1 if the registry is full
+static int64_t newHashTable(Context *ctx) {
+	HashRegistry *r = ctx->hashtabs;
+	pthread_mutex_lock(&r->lock);
+	int64_t h = r->count;
+	if(h == HASH_DIRSIZE * HASH_DIRCHUNK) {
+		pthread_mutex_unlock(&r->lock);
+		fprintf(stderr, "make-hash: more than %d tables\n", HASH_DIRSIZE * HASH_DIRCHUNK);
+		return -1;
+	}
+	HashTable **chunk = r->chunks[h / HASH_DIRCHUNK];
+	if(chunk == NULL) {
+		chunk = new HashTable *[HASH_DIRCHUNK];
+		r->chunks[h / HASH_DIRCHUNK] = chunk;
+	}
+	HashTable *t = new HashTable();
+	for(int i=0; i<HASH_STRIPES; i++) {
+		t->stripes[i].lock = 0;
+		t->stripes[i].count = 0;
+		t->stripes[i].nfree = 0;
+		t->stripes[i].chunks = NULL;
+	}
+	t->buckets = newBuckets(HASH_MINSIZE, NULL);
+	chunk[h % HASH_DIRCHUNK] = t;
+	__atomic_store_n(&r->count, h + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&r->lock);
+	return h;
+}
+
+// the holder may be preempted when there are more workers than cores
+static void lockStripe(HashStripe *s) {
+	for(int n=0; !CAS(s->lock, 0, 1); ) {
+		while(s->lock != 0) {
+			if(++n < HASH_SPIN) __builtin_ia32_pause();
+			else sched_yield();
+		}
+	}
+}
+
+static void unlockStripe(HashStripe *s) {
+	__atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+static HashStripe *getStripe(HashTable *t, uint64_t h) {
+	return &t->stripes[h & (HASH_STRIPES - 1)];
+}
+
+// the stripe is locked
+static HashNode *newNode(HashStripe *s, int64_t key, int64_t value, HashNode *next) {
+	if(s->nfree == 0) {
+		HashChunk *c = new HashChunk();
+		c->next = s->chunks;
+		s->chunks = c;
+		s->nfree = HASH_CHUNK;
+	}
+	HashNode *n = &s->chunks->nodes[HASH_CHUNK - s->nfree--];
+	n->key = key;
+	n->value = value;
+	n->next = next;
+	return n;
+}
+
+// a stripe is over the load when the table of its size would be
+static bool overLoad(HashTable *t, HashStripe *s) {
+	return s->count * HASH_STRIPES > (t->buckets->mask + 1) * HASH_LOAD;
+}
+
+static void grow(HashTable *t, HashStripe *full) {
+	for(int i=0; i<HASH_STRIPES; i++) lockStripe(&t->stripes[i]);
+	HashBuckets *b = t->buckets;
+	if(overLoad(t, full)) {
+		HashBuckets *nb = newBuckets((b->mask + 1) * 2, b);
+		for(int64_t i=0; i<=b->mask; i++) {
+			for(HashNode *n = b->heads[i]; n != NULL; n = n->next) {
+				uint64_t h = hashKey(n->key);
+				HashNode *volatile *head = &nb->heads[h & nb->mask];
+				*head = newNode(getStripe(t, h), n->key, n->value, *head);
+			}
+		}
+		RELEASE();
+		t->buckets = nb;
+	}
+	for(int i=0; i<HASH_STRIPES; i++) unlockStripe(&t->stripes[i]);
+}
+
+static void hashPut(HashTable *t, int64_t key, int64_t value) {
+	uint64_t h = hashKey(key);
+	HashStripe *s = getStripe(t, h);
+	lockStripe(s);
+	HashBuckets *b = t->buckets;
+	HashNode *volatile *head = &b->heads[h & b->mask];
+	for(HashNode *n = *head; n != NULL; n = n->next) {
+		if(n->key == key) {
+			n->value = value;
+			unlockStripe(s);
+			return;
+		}
+	}
+	HashNode *n = newNode(s, key, value, *head);
+	RELEASE();
+	*head = n;
+	s->count++;
+	bool full = overLoad(t, s);
+	unlockStripe(s);
+	if(full) grow(t, s);
+}
+
+// the node is unlinked, a reader on it still finds the rest of the chain
+static bool hashRemove(HashTable *t, int64_t key) {
+	uint64_t h = hashKey(key);
+	HashStripe *s = getStripe(t, h);
+	lockStripe(s);
+	HashBuckets *b = t->buckets;
+	bool found = false;
+	for(HashNode *volatile *p = &b->heads[h & b->mask]; *p != NULL; p = &(*p)->next) {
+		if((*p)->key == key) {
+			*p = (*p)->next;
+			s->count--;
+			found = true;
+			break;
+		}
+	}
+	unlockStripe(s);
+	return found;
+}
+
+static int64_t hashCount(HashTable *t) {
+	int64_t n = 0;
+	for(int i=0; i<HASH_STRIPES; i++) n += t->stripes[i].count;
+	return n;
+}
+
+int64_t hashOp(Context *ctx, int kind, Value *args) {
+	if(kind == HK_NEW) return newHashTable(ctx);
+	HashTable *t = getHashTable(ctx->hashtabs, args[0].i);
+	if(t == NULL) {
+		fprintf(stderr, "not a hash table: %ld\n", (long int)args[0].i);
+		return kind == HK_GET ? args[2].i : 0;
+	}
+	switch(kind) {
+	case HK_GET: return hashGet(t, args[1].i, args[2].i);
+	case HK_PUT: hashPut(t, args[1].i, args[2].i); return args[2].i;
+	case HK_REM: return hashRemove(t, args[1].i);
+	default: return hashCount(t);
+	}
+}
+
+HashRegistry *newHashRegistry() {
+	HashRegistry *r = new HashRegistry();
+	for(int i=0; i<HASH_DIRSIZE; i++) r->chunks[i] = NULL;
+	r->count = 0;
+	pthread_mutex_init(&r->lock, NULL);
+	return r;
+}
+
+void freeHashTables(HashRegistry *r) {
+	for(int64_t h=0; h<r->count; h++) {
+		HashTable *t = r->chunks[h / HASH_DIRCHUNK][h % HASH_DIRCHUNK];
+		for(HashBuckets *b = t->buckets; b != NULL; ) {
+			HashBuckets *old = b->old;
+			delete [] b->heads;
+			delete b;
+			b = old;
+		}
+		for(int i=0; i<HASH_STRIPES; i++) {
+			for(HashChunk *c = t->stripes[i].chunks; c != NULL; ) {
+				HashChunk *next = c->next;
+				delete c;
+				c = next;
+			}
+		}
+		delete t;
+	}
+	for(int i=0; i<HASH_DIRSIZE; i++) {
+		if(r->chunks[i] != NULL) delete [] r->chunks[i];
+	}
+	pthread_mutex_destroy(&r->lock);
+	delete r;
+}
@@ -0,0 +1,319 @@
+#include "lisp.h"
+#include <sched.h>
+#include <sys/mman.h>
+
+//------------------------------------------------------
+// cons heap, see heap.h
+
+Heap::Heap(Context *ctx) {
+	this->ctx = ctx;
+	// pages are taken when a region is first used
+	base = (char *)mmap(NULL, HEAP_MAX, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED) {
+		fprintf(stderr, "cons heap: cannot reserve %lld bytes\n", (long long)HEAP_MAX);
+		exit(1);
+	}
+	nregions = 0;
+	avail = NULL;
+	limit = HEAP_MINLIMIT;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	running = 0;
+	parked = 0;
+	collecting = false;
+	stopping = 0;
+	collections = 0;
+}
+
+Heap::~Heap() {
+	munmap(base, HEAP_MAX);
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+static void resetAlloc(WorkerThread *wth) {
+	wth->alloc.free = NULL;
+	wth->alloc.top = NULL;
+	wth->alloc.end = NULL;
+}
+
+// a thread that runs tasks, its cells are dropped by a collection
+void Heap::addThread(WorkerThread *wth) {
+	pthread_mutex_lock(&lock);
+	resetAlloc(wth);
+	threads.add(wth);
+	pthread_mutex_unlock(&lock);
+}
+
+void Heap::removeThread(WorkerThread *wth) {
+	pthread_mutex_lock(&lock);
+	int n = threads.getSize();
+	for(int i=0; i<n; i++) {
+		if(threads[i] == wth) {
+			threads[i] = threads[n - 1];
+			threads.truncate(n - 1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+//------------------------------------------------------
+// stopping the threads. a collector sets stopping and then counts the
+// threads in vmrun, a thread entering counts itself and then looks at
+// stopping; both are full barriers, so one of them sees the other
+
+void Heap::enter() {
+	while(true) {
+		ATOMIC_ADD(running, 1);
+		if(likely(!stopping)) return;
+		pthread_mutex_lock(&lock);
+		ATOMIC_SUB(running, 1);
+		pthread_cond_broadcast(&cond);
+		while(stopping) pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void Heap::leave() {
+	ATOMIC_SUB(running, 1);
+	if(unlikely(stopping)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+// at a safepoint, the task is scanned as it is
+void Heap::park(Task *task) {
+	pthread_mutex_lock(&lock);
+	waitCollection(task);
+	pthread_mutex_unlock(&lock);
+}
+
+// the lock is held. helps with the collection and returns after it
+void Heap::waitCollection(Task *task) {
+	if(!stopping) return;
+	int64_t gen = collections;
+	stopped.add(task);
+	parked++;
+	pthread_cond_broadcast(&cond);
+	while(!collecting && collections == gen) pthread_cond_wait(&cond, &lock);
+	if(collections == gen) {
+		pthread_mutex_unlock(&lock);
+		work();
+		pthread_mutex_lock(&lock);
+	}
+	while(collections == gen) pthread_cond_wait(&cond, &lock);
+	parked--;
+	pthread_cond_broadcast(&cond);
+}
+
+void Heap::collect(Task *task) {
+	pthread_mutex_lock(&lock);
+	// the threads of the last collection are still leaving
+	while(parked != 0 && !stopping) pthread_cond_wait(&cond, &lock);
+	if(stopping) {
+		waitCollection(task);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = 1;
+	__sync_synchronize();
+	stopped.add(task);
+	while(parked != running - 1) pthread_cond_wait(&cond, &lock);
+	// all stopped
+	for(int i=0; i<threads.getSize(); i++) resetAlloc(threads[i]);
+	addRoots();
+	nworkers = parked + 1;
+	nextRoot = 0;
+	nextRegion = 0;
+	marked = 0;
+	swept = 0;
+	nfree = 0;
+	collecting = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	work();
+	while(swept != nworkers) sched_yield();
+	pthread_mutex_lock(&lock);
+	finish();
+	collecting = false;
+	stopped.clear();
+	collections++;
+	stopping = 0;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+//------------------------------------------------------
+// collection
+
+void Heap::addRoots() {
+	ArrayBuilder<Task *> tasks;
+	ctx->sche->getTasks(&tasks);
+	for(int i=0; i<threads.getSize(); i++) {
+		if(threads[i]->curtask != NULL) tasks.add(threads[i]->curtask);
+	}
+	for(int i=0; i<stopped.getSize(); i++) tasks.add(stopped[i]);
+	roots.clear();
+	for(int i=0; i<tasks.getSize(); i++) {
+		HeapRange r = { tasks[i]->stack, tasks[i]->stack + TASK_STACKSIZE };
+		roots.add(r);
+	}
+	ctx->addRoots(&roots);
+}
+
+void Heap::markRange(Value *begin, Value *end, ArrayBuilder<Cell *> *stack) {
+	for(Value *v = begin; v < end; v++) {
+		if(!isCell(v->i)) continue;
+		stack->add(v->cell);
+		while(stack->getSize() != 0) {
+			int n = stack->getSize() - 1;
+			int64_t c = (int64_t)(*stack)[n];
+			stack->truncate(n);
+			if(!isCell(c)) continue;
+			uint64_t off = (uint64_t)c - (uint64_t)base;
+			Region *r = getRegion(off / REGION_SIZE);
+			int i = (int)((off & (REGION_SIZE - 1)) / sizeof(Cell));
+			uint64_t bit = (uint64_t)1 << (i & 63);
+			if(r->marks[i >> 6] & bit) continue;
+			if(__sync_fetch_and_or(&r->marks[i >> 6], bit) & bit) continue;
+			stack->add(((Cell *)c)->cdr.cell);
+			stack->add(((Cell *)c)->car.cell);
+		}
+	}
+}
+
+// the free cells are linked in address order
+void Heap::sweep(Region *r) {
+	Cell *cells = (Cell *)r;
+	Cell *free = NULL;
+	int64_t n = 0;
+	for(int w=REGION_CELLS/64 - 1; w >= 0; w--) {
+		uint64_t m = r->marks[w];
+		r->marks[w] = 0;
+		if(m == ~(uint64_t)0) continue;
+		for(int b=63; b >= 0; b--) {
+			int i = w * 64 + b;
+			if(i < REGION_FIRST) break;
+			if(!((m >> b) & 1)) {
+				cells[i].car.cell = free;
+				cells[i].cdr.i = 0;
+				free = &cells[i];
+				n++;
+			}
+		}
+	}
+	r->free = free;
+	r->nfree = n;
+	ATOMIC_ADD(nfree, n);
+}
+
+// on every thread in the collection
+void Heap::work() {
+	ArrayBuilder<Cell *> stack(1024);
+	int nroots = roots.getSize();
+	for(int i; (i = ATOMIC_ADD(nextRoot, 1)) < nroots; ) {
+		markRange(roots[i].begin, roots[i].end, &stack);
+	}
+	ATOMIC_ADD(marked, 1);
+	while(marked != nworkers) sched_yield();
+	int64_t n = nregions;
+	for(int64_t i; (i = ATOMIC_ADD(nextRegion, 1)) < n; ) {
+		sweep(getRegion(i));
+	}
+	ATOMIC_ADD(swept, 1);
+}
+
+// the next collection comes after the live cells double
+void Heap::finish() {
+	avail = NULL;
+	for(int64_t i=nregions - 1; i >= 0; i--) {
+		Region *r = getRegion(i);
+		if(r->nfree >= REGION_REUSE) {
+			r->next = avail;
+			avail = r;
+		}
+	}
+	int64_t size = nregions * REGION_SIZE;
+	int64_t live = (nregions * (REGION_CELLS - REGION_FIRST) - nfree) * (int64_t)sizeof(Cell);
+	limit = live * 2 > HEAP_MINLIMIT ? live * 2 : HEAP_MINLIMIT;
+	if(avail == NULL && limit <= size) limit = size + REGION_SIZE;
+	if(limit > HEAP_MAX) limit = HEAP_MAX;
+}
+
+//------------------------------------------------------
+// allocation
+
+// the lock is held. NULL when the heap is at its limit
+Region *Heap::takeRegion() {
+	Region *r = avail;
+	if(r != NULL) {
+		avail = r->next;
+		return r;
+	}
+	if((nregions + 1) * REGION_SIZE > limit) return NULL;
+	r = getRegion(nregions);
+	r->free = NULL;
+	r->nfree = 0;
+	nregions++;
+	return r;
+}
+
+// the thread is in vmrun, running task
+Cell *Heap::allocSlow(WorkerThread *wth, Task *task) {
+	HeapAlloc *a = &wth->alloc;
+	bool collected = false;
+	while(true) {
+		pthread_mutex_lock(&lock);
+		Region *r = takeRegion();
+		bool full = r == NULL && collected && (nregions + 1) * REGION_SIZE > HEAP_MAX;
+		pthread_mutex_unlock(&lock);
+		if(r != NULL) {
+			if(r->free != NULL) {
+				// swept
+				a->free = r->free;
+				a->top = a->end = NULL;
+				r->free = NULL;
+				r->nfree = 0;
+			} else {
+				a->free = NULL;
+				a->top = (Cell *)r + REGION_FIRST;
+				a->end = (Cell *)r + REGION_CELLS;
+			}
+			return allocCell(a);
+		}
+		if(full) {
+			fprintf(stderr, "cons heap exhausted (%lld bytes)\n", (long long)HEAP_MAX);
+			exit(1);
+		}
+		collect(task);
+		collected = true;
+	}
+}
+
+//------------------------------------------------------
+// (1 2 (3 4)), an element that is not a cell is an int
+void Heap::print(OutBuf *o, int64_t v) {
+	if(!isCell(v)) {
+		outInt(o, v);
+		return;
+	}
+	outPutc(o, '(');
+	while(true) {
+		Cell *c = (Cell *)v;
+		print(o, c->car.i);
+		v = c->cdr.i;
+		if(v == 0) break;
+		if(!isCell(v)) {
+			outPuts(o, " . ");
+			outInt(o, v);
+			break;
+		}
+		outPutc(o, ' ');
+	}
+	outPutc(o, ')');
+}
+
@@ -0,0 +1,327 @@
+#include "lisp.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//------------------------------------------------------
+// file layout, in int64 words
+//   header    IMG_xxx below
+//   symbols   nsyms byte offsets of the null terminated names
+//   funcs     form name argc rtype effect reopt codeLength srcLength
+//             args[argc] code[codeLength] srccode[srcLength]
+//   names
+// opcodes are instruction indices, CALL/SPAWN and LOAD_GLOBAL operands
+// are symbol indices
+
+#define IMAGE_MAGIC 0x32435053494cLL /* "LISPC2" */
+
+enum {
+	IMG_MAGIC,
+	IMG_SRCHASH,
+	IMG_INSCOUNT,
+	IMG_INLINECOUNT,
+	IMG_NSYMS,
+	IMG_NFUNCS,
+	IMG_SYMOFF,
+	IMG_FUNCOFF,
+	IMG_SIZE,
+	IMG_HEADER,
+};
+
+#define FUNC_HEADER 8
+
+static uint64_t srcHash(const char *src, size_t len) {
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	for(size_t i=0; i<len; i++) {
+		h = (h ^ (unsigned char)src[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+bool isDefunForm(Cons *cons, const char *defunAtom) {
+	if(cons->type != CONS_CAR || cons->car == NULL || cons->car->type != CONS_STR) return false;
+	Cons *name = cons->car->cdr;
+	return cons->car->str == defunAtom &&
+		name != NULL && name->type == CONS_STR &&
+		name->cdr != NULL && name->cdr->type == CONS_CAR;
+}
+
+//------------------------------------------------------
+Image::Image(const char *src, size_t len, Context *ctx) {
+	data = NULL;
+	size = 0;
+	srchash = srcHash(src, len);
+	inlinecount = ctx->inlinecount;
+	byform = NULL;
+	nforms = 0;
+}
+
+Image::~Image() {
+	if(data != NULL) munmap((void *)data, size);
+	delete [] byform;
+}
+
+const char *Image::getSym(int64_t n) {
+	if(n < 0 || n >= data[IMG_NSYMS]) return NULL;
+	int64_t off = data[data[IMG_SYMOFF] + n];
+	if(off < 0 || (size_t)off >= size) return NULL;
+	const char *s = (const char *)data + off;
+	return memchr(s, '\0', size - off) != NULL ? s : NULL;
+}
+
+// map the file and index the func records, false if it does not match
+bool Image::load(const char *fname) {
+	int fd = open(fname, O_RDONLY);
+	if(fd == -1) return false;
+	struct stat st;
+	if(fstat(fd, &st) == -1 || (size_t)st.st_size < IMG_HEADER * sizeof(int64_t)) {
+		close(fd);
+		return false;
+	}
+	size = st.st_size;
+	void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) return false;
+	data = (const int64_t *)p;
+	int64_t nwords = size / sizeof(int64_t);
+	bool ok = data[IMG_MAGIC] == IMAGE_MAGIC &&
+		(uint64_t)data[IMG_SRCHASH] == srchash &&
+		data[IMG_INSCOUNT] == INS_COUNT &&
+		data[IMG_INLINECOUNT] == inlinecount &&
+		data[IMG_SIZE] == (int64_t)size &&
+		data[IMG_NSYMS] >= 0 && data[IMG_NFUNCS] >= 0 &&
+		data[IMG_SYMOFF] >= IMG_HEADER && data[IMG_SYMOFF] + data[IMG_NSYMS] <= nwords &&
+		data[IMG_FUNCOFF] >= IMG_HEADER && data[IMG_FUNCOFF] <= nwords;
+	// walk the records once
+	ArrayBuilder<const int64_t *> fs;
+	int64_t off = ok ? data[IMG_FUNCOFF] : 0;
+	for(int64_t i=0; ok && i<data[IMG_NFUNCS]; i++) {
+		const int64_t *f = data + off;
+		if(off + FUNC_HEADER > nwords || f[0] < 0 || f[2] < 0 || f[6] <= 0 || f[7] <= 0 ||
+				f[4] < EFF_PURE || f[4] > EFF_WRITE) {
+			ok = false;
+			break;
+		}
+		off += FUNC_HEADER + f[2] + f[6] + f[7];
+		if(off > nwords) {
+			ok = false;
+			break;
+		}
+		fs.add(f);
+		if(f[0] >= nforms) nforms = f[0] + 1;
+	}
+	if(!ok) {
+		munmap(p, size);
+		data = NULL;
+		nforms = 0;
+		return false;
+	}
+	byform = new const int64_t *[nforms];
+	for(int i=0; i<nforms; i++) byform[i] = NULL;
+	for(int i=0, j=fs.getSize(); i<j; i++) {
+		byform[fs[i][0]] = fs[i];
+	}
+	return true;
+}
+
+// copy the code, resolving the symbols and building the run code
+// in the same pass
+bool Image::relocate(Context *ctx, Func *func, const int64_t *src, int len, Code *code, Code *runcode) {
+	int pc = 0;
+	while(pc < len) {
+		int64_t op = src[pc];
+		if(op < 0 || op >= INS_COUNT) return false;
+		int n = getOpSize(op);
+		if(pc + n > len) return false;
+		for(int i=0; i<n; i++) code[pc + i].i = src[pc + i];
+		if(op == INS_CALL || op == INS_SPAWN) {
+			const char *name = getSym(src[pc + 1]);
+			if(name == NULL) return false;
+			const char *atom = ctx->symtab->intern(name);
+			Func *f = atom == func->name ? func : ctx->getFunc(atom);
+			if(f == NULL || (f != func && f->code == NULL)) return false;
+			code[pc + 1].func = f;
+		} else if(op == INS_LOAD_GLOBAL) {
+			const char *name = getSym(src[pc + 2]);
+			if(name == NULL) return false;
+			Variable *v = ctx->getVar(ctx->symtab->intern(name));
+			if(v == NULL) return false;
+			code[pc + 2].var = v;
+		} else if(op == INS_STORE_GLOBAL || op == INS_DEFUN || op == INS_FCALL ||
+				op == INS_SCOPE || op == INS_MEMO) {
+			return false;
+		}
+		if(runcode != NULL) {
+			for(int i=0; i<n; i++) runcode[pc + i] = code[pc + i];
+#ifdef USING_THCODE
+			runcode[pc].ptr = ctx->getDTLabel(op);
+#endif
+		}
+		pc += n;
+		if(op == INS_END) break;
+	}
+	return pc == len && code[len - 1].i == INS_END;
+}
+
+// the function of a defun form, NULL if it must be compiled
+Func *Image::loadFunc(Context *ctx, int form) {
+	if(data == NULL || form >= nforms || byform[form] == NULL) return NULL;
+	const int64_t *f = byform[form];
+	int argc = f[2];
+	int len = f[6], srclen = f[7];
+	const char *name = getSym(f[1]);
+	if(name == NULL) return NULL;
+	for(int i=0; i<argc; i++) {
+		if(getSym(f[FUNC_HEADER + i]) == NULL) return NULL;
+	}
+	Func *func = newUserFunc(ctx, ctx->symtab->intern(name), argc);
+	for(int i=0; i<argc; i++) {
+		func->args[i] = ctx->symtab->intern(getSym(f[FUNC_HEADER + i]));
+	}
+	func->rtype = (ValueType)f[3];
+	func->effect = (Effect)f[4];
+	func->reopt = f[5] != 0;
+	func->code = new Code[len];
+	func->codeLength = len;
+	func->srccode = new Code[srclen];
+	func->srcLength = srclen;
+	func->runcode = new Code[len];
+	func->runLength = len;
+	const int64_t *code = f + FUNC_HEADER + argc;
+	if(!relocate(ctx, func, code, len, func->code, func->runcode) ||
+			!relocate(ctx, func, code + len, srclen, func->srccode, NULL)) {
+		delete [] func->code;
+		delete [] func->srccode;
+		delete [] func->runcode;
+		if(argc != 0) delete [] func->args;
+		delete func;
+		return NULL;
+	}
+	ctx->putFunc(func);
+#ifdef USING_PROFILE
+	ctx->prof->addFunc(func);
+#endif
+	if(ctx->sampler != NULL) ctx->sampler->addCode(func);
+	return func;
+}
+
+//------------------------------------------------------
+void Image::record(int form, Func *func) {
+	ImageFunc r;
+	r.form = form;
+	r.func = func;
+	recs.add(r);
+}
+
+static bool isSavable(Code *code, int len) {
+	for(int pc=0; pc<len; pc += getOpSize(code[pc].i)) {
+		int op = code[pc].i;
+		// a native function is bound again by its defforeign form, the
+		// branches of a scope are compiled with the function and a memo
+		// cache is made by defun-memo
+		if(op == INS_STORE_GLOBAL || op == INS_DEFUN || op == INS_FCALL ||
+				op == INS_SCOPE || op == INS_MEMO) return false;
+		if((op == INS_CALL || op == INS_SPAWN) && code[pc + 1].func->code == NULL) return false;
+		if(op == INS_END) break;
+	}
+	return true;
+}
+
+class ImageWriter {
+private:
+	ArrayBuilder<int64_t> words;
+	ArrayBuilder<const char *> syms;
+	AtomMap<int> symidx; /* index + 1 */
+public:
+	ImageWriter() : words(1024) {}
+	int sym(const char *atom) {
+		int n = symidx.get(atom);
+		if(n == 0) {
+			syms.add(atom);
+			n = syms.getSize();
+			symidx.put(atom, n);
+		}
+		return n - 1;
+	}
+	void add(int64_t w) { words.add(w); }
+	void set(int n, int64_t w) { words[n] = w; }
+	int size() { return words.getSize(); }
+	void addCode(Code *code, int len) {
+		for(int pc=0; pc<len; ) {
+			int op = code[pc].i;
+			int n = getOpSize(op);
+			for(int i=0; i<n; i++) {
+				if(i == 1 && (op == INS_CALL || op == INS_SPAWN)) {
+					add(sym(code[pc + 1].func->name));
+				} else if(i == 2 && op == INS_LOAD_GLOBAL) {
+					add(sym(code[pc + 2].var->name));
+				} else {
+					add(code[pc + i].i);
+				}
+			}
+			pc += n;
+		}
+	}
+	bool write(const char *fname);
+};
+
+bool ImageWriter::write(const char *fname) {
+	// symbol offsets, then the names
+	int symoff = size();
+	int64_t off = (symoff + syms.getSize()) * sizeof(int64_t);
+	for(int i=0, j=syms.getSize(); i<j; i++) {
+		add(off);
+		off += strlen(syms[i]) + 1;
+	}
+	set(IMG_NSYMS, syms.getSize());
+	set(IMG_SYMOFF, symoff);
+	set(IMG_SIZE, off);
+	// write to a temporary and rename, so a reader never sees half a file
+	int len = strlen(fname);
+	char *tmp = new char[len + 16];
+	snprintf(tmp, len + 16, "%s.%d", fname, (int)getpid());
+	FILE *fp = fopen(tmp, "wb");
+	bool res = fp != NULL;
+	if(res) {
+		res = fwrite(words.getPtr(), sizeof(int64_t), size(), fp) == (size_t)size();
+		for(int i=0, j=syms.getSize(); res && i<j; i++) {
+			res = fwrite(syms[i], 1, strlen(syms[i]) + 1, fp) == strlen(syms[i]) + 1;
+		}
+		res = fclose(fp) == 0 && res;
+		if(res) res = rename(tmp, fname) == 0;
+		if(!res) unlink(tmp);
+	}
+	delete [] tmp;
+	return res;
+}
+
+bool Image::save(const char *fname) {
+	ImageWriter w;
+	for(int i=0; i<IMG_HEADER; i++) w.add(0);
+	w.set(IMG_MAGIC, IMAGE_MAGIC);
+	w.set(IMG_SRCHASH, srchash);
+	w.set(IMG_INSCOUNT, INS_COUNT);
+	w.set(IMG_INLINECOUNT, inlinecount);
+	w.set(IMG_FUNCOFF, IMG_HEADER);
+	int nfuncs = 0;
+	for(int i=0, j=recs.getSize(); i<j; i++) {
+		Func *f = recs[i].func;
+		if(!isSavable(f->code, f->codeLength) || !isSavable(f->srccode, f->srcLength)) continue;
+		w.add(recs[i].form);
+		w.add(w.sym(f->name));
+		w.add(f->argc);
+		w.add(f->rtype);
+		w.add(f->effect);
+		w.add(f->reopt);
+		w.add(f->codeLength);
+		w.add(f->srcLength);
+		for(int k=0; k<(int)f->argc; k++) w.add(w.sym(f->args[k]));
+		w.addCode(f->code, f->codeLength);
+		w.addCode(f->srccode, f->srcLength);
+		nfuncs++;
+	}
+	w.set(IMG_NFUNCS, nfuncs);
+	return w.write(fname);
+}
+
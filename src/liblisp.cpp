@@ -0,0 +1,119 @@
+#include "lisp.h"
+#include "liblisp.h"
+
+//------------------------------------------------------
+// embedding API, see liblisp.h
+
+struct lisp_ctx {
+	Context *ctx;
+};
+
+struct lisp_caller {
+	Context *ctx;
+	WorkerThread wth; /* not in the pool, for vmrun */
+	Task *task;
+};
+
+static Func *toFunc(lisp_func *f) {
+	return (Func *)f;
+}
+
+// the lisp_value and Value unions have the same layout
+static Value *toArgs(const lisp_value *args) {
+	return (Value *)args;
+}
+
+lisp_ctx *lisp_new(int workers) {
+	if(workers < 0 || workers >= 20) return NULL;
+	lisp_ctx *lc = new lisp_ctx();
+	lc->ctx = new Context();
+	if(workers != 0) lc->ctx->workers = workers;
+	lc->ctx->sche->initWorkers();
+	return lc;
+}
+
+void lisp_free(lisp_ctx *lc) {
+	delete lc->ctx;
+	delete lc;
+}
+
+int lisp_load(lisp_ctx *lc, const char *src, size_t len) {
+	return compileAndRun(lc->ctx, src, len, NULL) ? 0 : -1;
+}
+
+lisp_func *lisp_func_get(lisp_ctx *lc, const char *name) {
+	Context *ctx = lc->ctx;
+	Func *func = ctx->getFunc(ctx->symtab->intern(name));
+	// a function being defined by another thread has no run code yet
+	return func != NULL && func->runcode != NULL ? (lisp_func *)func : NULL;
+}
+
+int lisp_func_argc(lisp_func *f) {
+	return (int)toFunc(f)->argc;
+}
+
+//------------------------------------------------------
+int lisp_call(lisp_ctx *lc, lisp_func *f, const lisp_value *args, lisp_value *ret) {
+	if(f == NULL) return -1;
+	Value v;
+	lc->ctx->sche->runWait(toFunc(f), toArgs(args), NULL, &v);
+	ret->i = v.i;
+	return 0;
+}
+
+lisp_caller *lisp_caller_new(lisp_ctx *lc) {
+	lisp_caller *c = new lisp_caller();
+	c->ctx = lc->ctx;
+	c->wth.ctx = lc->ctx;
+	c->wth.sche = lc->ctx->sche;
+	c->wth.id = -1;
+	c->wth.curtask = NULL;
+	c->wth.samples = NULL;
+	initOutBuf(&c->wth.out);
+#ifdef USING_PROFILE
+	c->wth.stat = lc->ctx->prof->newStat();
+#endif
+	lc->ctx->heap->addThread(&c->wth);
+	c->task = new Task();
+	return c;
+}
+
+void lisp_caller_free(lisp_caller *c) {
+	c->ctx->heap->removeThread(&c->wth);
+	delete [] c->wth.out.buf;
+	delete c->task;
+	delete c;
+}
+
+// runs on this thread until the task ends, or a JOIN requeues it to
+// the pool and a worker finishes it
+static void runHere(lisp_caller *c, Func *func, Value *args) {
+	Scheduler *sche = c->ctx->sche;
+	Task *task = c->task;
+	sche->initTask(task, func, args);
+	c->wth.curtask = task;
+	c->ctx->heap->enter();
+	vmrun(c->ctx, &c->wth, task);
+	c->ctx->heap->leave();
+	c->wth.curtask = NULL;
+	sche->waitTask(task);
+}
+
+int lisp_call_here(lisp_caller *c, lisp_func *f, const lisp_value *args, lisp_value *ret) {
+	if(f == NULL) return -1;
+	runHere(c, toFunc(f), toArgs(args));
+	ret->i = c->task->stack[0].i;
+	return 0;
+}
+
+int lisp_call_batch(lisp_caller *c, lisp_func *f, const lisp_value *args, size_t n, lisp_value *rets) {
+	if(f == NULL) return -1;
+	Func *func = toFunc(f);
+	size_t argc = func->argc;
+	for(size_t i=0; i<n; i++) {
+		runHere(c, func, toArgs(args + i * argc));
+		rets[i].i = c->task->stack[0].i;
+	}
+	return 0;
+}
+
@@ -1,97 +1,25 @@
 #include "lisp.h"
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <new>
 
 //------------------------------------------------------
-void cons_free(Cons *cons) {
-	if(cons->type == CONS_CAR && cons->car != NULL) {
-		cons_free(cons->car);
-	} else if(cons->type == CONS_STR) {
-		delete [] cons->str;
-	}
-	if(cons->cdr != NULL) {
-		cons_free(cons->cdr);
-	}
-	delete cons;
-}
-
-void cons_print(Cons *cons, FILE *fp) {
-	bool b = false;
-	for(; cons != NULL; cons = cons->cdr) {
-		if(b) printf(" ");
-		b = true;
-		switch(cons->type) {
-		case CONS_INT: printf("%d", cons->i); break;
-		case CONS_STR: printf("%s", cons->str); break;
-		case CONS_FLOAT: printf("%lf", cons->f); break;
-		case CONS_CAR:
-			fprintf(fp, "(");
-			cons_print(cons->car, fp);
-			fprintf(fp, ")");
-			break;
-		}
-	}
-}
-
-void cons_println(Cons *cons, FILE *fp) {
-	cons_print(cons, fp);
-	fprintf(fp, "\n");
-}
-
-//------------------------------------------------------
-static void runCons(Context *ctx, Cons *cons) {
-	Func *func = new Func();
-	func->name = "__script";
-	func->argc = 0;
-	try {
-		CodeBuilder cb(ctx, func, true, true);
-		ValueType ty = codegen(cons, &cb, 0);
-		if(ty == VT_INT) {
-			cb.createPrintInt(0);
-		} else if(ty == VT_BOOLEAN) {
-			cb.createPrintBoolean(0);
-		}
-		cb.createRet(0);
-		func->code = cb.getCode();
-#ifdef USING_THCODE
-		func->thcode = func->code;
-#endif
-		Scheduler *sche = ctx->sche;
-		Task *task = sche->newTask(func, NULL);
-		assert(task != NULL);
-		sche->enqueueWaitFor(task);
-		sche->deleteTask(task);
-		delete [] func->code;
-	} catch(char *str) {
-	}
-	delete func;
-}
-
-//------------------------------------------------------
-static void compileAndRun(Context *ctx, Reader *r) {
-	Tokenizer tk(r);
-	Cons *res;
-	while(parseCons(&tk, &res)) {
-		if(res != NULL) {
-			res->cdr = NULL;
-			//cons_println(res);
-			runCons(ctx, res);
-			cons_free(res);
-		}
-	}
+// counts the allocations for -time-phases
+void *operator new(size_t n) {
+	phaseAllocs++;
+	phaseAllocBytes += n;
+	void *p = malloc(n != 0 ? n : 1);
+	if(p == NULL) throw std::bad_alloc();
+	return p;
 }
 
 //------------------------------------------------------
 #define HISTFILE "history"
 
-class CharReader : public Reader {
-private:
-	const char *in;
-public:
-	CharReader(const char *in) { this->in = in; }
-	int read() { return *in != '\0' ? *in++ : EOF; }
-};
-
 static void runInteractive(Context *ctx) {
 	// init readline
 	read_history(HISTFILE);
@@ -102,8 +30,7 @@ static void runInteractive(Context *ctx) {
 			if(in != NULL) free(in);
 			break;
 		}
-		CharReader r(in);
-		compileAndRun(ctx, &r);
+		compileAndRun(ctx, in, strlen(in), NULL);
 		if(strlen(in) > 0) {
 			add_history(in);
 			write_history(HISTFILE);
@@ -113,32 +40,78 @@ static void runInteractive(Context *ctx) {
 }
 
 //------------------------------------------------------
-class FileReader : public Reader {
-private:
-	FILE *fp;
-public:
-	FileReader(FILE *fp) { this->fp = fp; }
-	int read() { return fgetc(fp); }
-};
+// the file is mapped and tokenized in place
+static void runFile(Context *ctx, const char *filename, const char *src, size_t len, bool cache) {
+	if(!cache) {
+		compileAndRun(ctx, src, len, NULL);
+		return;
+	}
+	// compiled defuns are kept in file.lispc
+	int n = strlen(filename);
+	char *imgname = new char[n + 2];
+	memcpy(imgname, filename, n);
+	imgname[n] = 'c';
+	imgname[n + 1] = '\0';
+	Image img(src, len, ctx);
+	bool loaded = img.load(imgname);
+	compileAndRun(ctx, src, len, &img);
+	if(!loaded && !img.save(imgname)) {
+		fprintf(stderr, "warning: cannot write %s\n", imgname);
+	}
+	delete [] imgname;
+}
 
-static void runFromFile(Context *ctx, const char *filename) {
-	FILE *fp = fopen(filename, "r");
-	if(fp == NULL) {
+static void runFromFile(Context *ctx, const char *filename, bool cache) {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if(fd == -1 || fstat(fd, &st) == -1) {
 		fprintf(stderr, "file open error: %s\n", filename);
+		if(fd != -1) close(fd);
 		return;
 	}
-	FileReader fr(fp);
-	compileAndRun(ctx, &fr);
-	fclose(fp);
+	size_t len = st.st_size;
+	void *p = S_ISREG(st.st_mode) && len > 0 ?
+		mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if(p != MAP_FAILED) {
+		madvise(p, len, MADV_SEQUENTIAL);
+		runFile(ctx, filename, (const char *)p, len, cache);
+		munmap(p, len);
+	} else {
+		// pipe or empty file
+		ArrayBuilder<char> buf(4096);
+		char tmp[4096];
+		ssize_t n;
+		while((n = read(fd, tmp, sizeof(tmp))) > 0) {
+			for(ssize_t i=0; i<n; i++) buf.add(tmp[i]);
+		}
+		runFile(ctx, filename, buf.getPtr(), buf.getSize(), cache);
+	}
+	close(fd);
 }
 
 //------------------------------------------------------
 int main(int argc, char **argv) {
 	Context *ctx = new Context();
 	const char *fname = NULL;
+	bool cache = false;
+	bool sample = false;
+	const char *sampleout = NULL;
+	int sampleus = 1000;
+	bool timephases = false;
+	const char *sockpath = NULL;
+#ifdef USING_PROFILE
+	const char *profout = NULL;
+	bool report = false;
+#endif
 	for(int i=1; i<argc; i++) {
 		if(strcmp(argv[i], "-i") == 0) {
 			ctx->flagShowIR = true;
+		} else if(strcmp(argv[i], "-batch") == 0) {
+			ctx->flagBatch = true;
+		} else if(strcmp(argv[i], "-ordered-output") == 0) {
+			ctx->flagOrderedOutput = true;
+		} else if(strcmp(argv[i], "-cache") == 0) {
+			cache = true;
 		} else if(strcmp(argv[i], "-inline") == 0) {
 			i++;
 			ctx->inlinecount = atoi(argv[i]);
@@ -151,16 +124,67 @@ int main(int argc, char **argv) {
 				fprintf(stderr, "error\n");
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-prof-use") == 0) {
+			i++;
+			if(!ctx->prof->load(argv[i])) exit(1);
+		} else if(strcmp(argv[i], "-profile") == 0) {
+#ifdef USING_PROFILE
+			report = true;
+#else
+			fprintf(stderr, "-profile needs the instrumented build (make lisp-prof)\n");
+			exit(1);
+#endif
+		} else if(strcmp(argv[i], "-prof-out") == 0) {
+			i++;
+#ifdef USING_PROFILE
+			profout = argv[i];
+#else
+			fprintf(stderr, "-prof-out needs the instrumented build (make lisp-prof)\n");
+			exit(1);
+#endif
+		} else if(strcmp(argv[i], "-server") == 0) {
+			i++;
+			sockpath = argv[i];
+		} else if(strcmp(argv[i], "-time-phases") == 0) {
+			timephases = true;
+		} else if(strcmp(argv[i], "-sample") == 0) {
+			sample = true;
+		} else if(strcmp(argv[i], "-sample-out") == 0) {
+			i++;
+			sampleout = argv[i];
+		} else if(strcmp(argv[i], "-sample-us") == 0) {
+			i++;
+			sampleus = atoi(argv[i]);
+			if(sampleus < 10) {
+				fprintf(stderr, "error\n");
+				exit(1);
+			}
 		} else {
 			fname = argv[i];
 		}
 	}
+	if(sample || sampleout != NULL) ctx->sampler = new Sampler(sampleus);
+	if(timephases) ctx->phases = new PhaseTimer();
 	ctx->sche->initWorkers();
-	if(fname != NULL) {
-		runFromFile(ctx, fname);
+	if(sockpath != NULL) {
+		// the file is loaded before serving
+		if(fname != NULL) runFromFile(ctx, fname, cache);
+		runServer(ctx, sockpath);
+	} else if(fname != NULL) {
+		runFromFile(ctx, fname, cache);
 	} else {
 		runInteractive(ctx);
 	}
+#ifdef USING_PROFILE
+	if(profout != NULL) ctx->prof->save(profout);
+	if(report) ctx->prof->printReport(ctx, stderr);
+#endif
+	if(ctx->sampler != NULL) {
+		ctx->sampler->stop();
+		if(sample) ctx->sampler->printReport(ctx, stderr);
+		if(sampleout != NULL) ctx->sampler->writeStacks(sampleout);
+	}
+	if(ctx->phases != NULL) ctx->phases->printReport(stderr);
 	delete ctx;
 	return 0;
 }
@@ -0,0 +1,92 @@
+#include "lisp.h"
+
+//------------------------------------------------------
+// memo cache, see memo.h
+
+#define STATE(s) ((int)((s) & 3))
+#define LOCK(s)  ((((s) >> 2) + 1) << 2 | MS_LOCKED)
+#define RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+Memo *newMemo(int argc) {
+	Memo *m = new Memo();
+	m->argc = argc;
+	m->entries = new MemoEntry[MEMO_SIZE];
+	memset(m->entries, 0, sizeof(MemoEntry) * MEMO_SIZE);
+	return m;
+}
+
+void freeMemo(Memo *m) {
+	delete [] m->entries;
+	delete m;
+}
+
+MemoResult memoLookup(Memo *m, const Value *args, Task *task, int64_t *value, MemoEntry **claim) {
+	int argc = m->argc;
+	uint64_t h = memoHash(args, argc);
+retry:
+	MemoEntry *free = NULL, *victim = NULL, *full = NULL;
+	uint64_t fseq = 0, vseq = 0, useq = 0;
+	for(int i=0; i<MEMO_PROBE; i++) {
+		MemoEntry *e = &m->entries[(h + i) & (MEMO_SIZE - 1)];
+		uint64_t s = e->seq;
+		// a claim writes only the key
+		while(STATE(s) == MS_LOCKED) s = e->seq;
+		if(STATE(s) == MS_EMPTY) {
+			if(free == NULL) { free = e; fseq = s; }
+			continue;
+		}
+		MEMO_ACQUIRE();
+		bool same = memoSameKey(e, args, argc);
+		int64_t v = e->value;
+		MEMO_ACQUIRE();
+		if(e->seq != s) goto retry;
+		if(same) {
+			if(STATE(s) == MS_PENDING) return MEMO_WAIT;
+			if(!e->used) e->used = 1;
+			*value = v;
+			return MEMO_HIT;
+		}
+		if(STATE(s) == MS_FULL) {
+			if(full == NULL) { full = e; useq = s; }
+			if(e->used) e->used = 0;
+			else if(victim == NULL) { victim = e; vseq = s; }
+		}
+	}
+	MemoEntry *e = free;
+	uint64_t s = fseq;
+	if(e == NULL) { e = victim; s = vseq; }
+	if(e == NULL) { e = full; s = useq; }
+	if(e == NULL) {
+		// all pending, computed without the cache
+		*claim = NULL;
+		return MEMO_MISS;
+	}
+	if(!CAS(e->seq, s, LOCK(s))) goto retry;
+	for(int i=0; i<argc; i++) e->key[i] = args[i].i;
+	e->used = 0;
+	e->nextClaim = task->claims;
+	task->claims = e;
+	RELEASE();
+	e->seq = (e->seq & ~(uint64_t)3) | MS_PENDING;
+	*claim = e;
+	return MEMO_MISS;
+}
+
+// e is the innermost claim of the task
+void memoStore(MemoEntry *e, int64_t value, Task *task) {
+	e->value = value;
+	task->claims = e->nextClaim;
+	RELEASE();
+	e->seq = (e->seq & ~(uint64_t)3) | MS_FULL;
+}
+
+// the task is cancelled, its keys are left to the waiters
+void memoRelease(Task *task) {
+	for(MemoEntry *e = task->claims; e != NULL; ) {
+		MemoEntry *next = e->nextClaim;
+		e->seq = (e->seq & ~(uint64_t)3) | MS_EMPTY;
+		e = next;
+	}
+	task->claims = NULL;
+}
+
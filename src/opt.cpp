@@ -9,69 +9,125 @@ struct Label {
 	int lb;
 	Code *pc;
 	int layer;
+	int next;
 };
 
-#define PUSH_LABEL(_l, _pc, _la) { \
-		Label l; l.lb=(_l); l.pc=(_pc); l.layer=(_la); \
-		la.add(l); \
+// pending jump labels, hashed by target pc and layer
+class LabelTable {
+private:
+	Arena *arena;
+	ArrayBuilder<Label> ls;
+	int *head;
+	int mask;
+
+	int *newHead() {
+		int *h = (int *)arena->alloc(sizeof(int) * (mask + 1));
+		for(int i=0; i<=mask; i++) h[i] = -1;
+		return h;
 	}
 
-static bool isjmplabel(ArrayBuilder<Label> *ab, Code *pc, int layer) {
-	for(int i=0, j=ab->getSize(); i<j; i++) {
-		Label l = (*ab)[i];
-		if(pc == l.pc && layer == l.layer) return true;
+	int hash(Code *pc, int layer) {
+		uint64_t h = ((uint64_t)(uintptr_t)pc >> 3) * 0x9e3779b97f4a7c15ULL + layer;
+		return (int)(h >> 32) & mask;
 	}
-	return false;
+	void rehash() {
+		mask = mask * 2 + 1;
+		head = newHead();
+		for(int i=0, j=ls.getSize(); i<j; i++) {
+			if(ls[i].pc == NULL) continue;
+			int h = hash(ls[i].pc, ls[i].layer);
+			ls[i].next = head[h];
+			head[h] = i;
+		}
+	}
+public:
+	LabelTable(Arena *arena) : arena(arena), ls(arena) {
+		mask = 63;
+		head = newHead();
+	}
+	void add(int lb, Code *pc, int layer) {
+		Label l;
+		l.lb = lb;
+		l.pc = pc;
+		l.layer = layer;
+		int h = hash(pc, layer);
+		l.next = head[h];
+		head[h] = ls.getSize();
+		ls.add(l);
+		if(ls.getSize() > mask) rehash();
+	}
+	bool has(Code *pc, int layer) {
+		for(int i = head[hash(pc, layer)]; i != -1; i = ls[i].next) {
+			if(ls[i].pc == pc && ls[i].layer == layer) return true;
+		}
+		return false;
+	}
+	// set all labels jumping to pc, and forget them
+	void setLabels(CodeBuilder *cb, Code *pc, int layer) {
+		for(int i = head[hash(pc, layer)]; i != -1; i = ls[i].next) {
+			if(ls[i].pc == pc && ls[i].layer == layer) {
+				cb->setLabel(ls[i].lb);
+				ls[i].pc = NULL;
+			}
+		}
+	}
+};
+
+#define PUSH_LABEL(_l, _pc, _la) la.add(_l, _pc, _la)
+
+static bool isjmplabel(LabelTable *lt, Code *pc, int layer) {
+	return lt->has(pc, layer);
 }
 
-static bool isReg2Op(int i) {
+bool isReg2Op(int i) {
 	switch(i) {
 	case INS_IADD: 
 	case INS_ISUB: 
 	case INS_IMUL: 
 	case INS_IDIV: 
 	case INS_IMOD: 
+	case INS_ISHL:
+	case INS_ISAR:
+	case INS_ISHR:
+	case INS_IAND:
+	case INS_IOR:
+	case INS_IXOR:
 		return true;
 	}
 	return false;
 }
 
-static bool isReg2COp(int i) {
+bool isReg2COp(int i) {
 	switch(i) {
 	case INS_IADDC: 
 	case INS_ISUBC: 
 	case INS_IMULC: 
 	case INS_IDIVC: 
 	case INS_IMODC: 
+	case INS_ISHLC:
+	case INS_ISARC:
+	case INS_ISHRC:
+	case INS_IANDC:
+	case INS_IORC:
+	case INS_IXORC:
 		return true;
 	}
 	return false;
 }
 
-static int applyOpC(int i, int x, int y) {
-	switch(i) {
-	case INS_IADDC: return x + y;
-	case INS_ISUBC: return x - y;
-	case INS_IMULC: return x * y;
-	case INS_IDIVC: return x / y;
-	case INS_IMODC: return x % y;
-	case INS_IJMPLTC: return x < y;
-	case INS_IJMPLEC: return x <= y;
-	case INS_IJMPGTC: return x > y;
-	case INS_IJMPGEC: return x >= y;
-	case INS_IJMPEQC: return x == y;
-	case INS_IJMPNEC: return x != y;
-	}
-	abort();
-}
-	
-static int toConstOp(int i) {
+int toConstOp(int i) {
 	switch(i) {
 	case INS_IADD: return INS_IADDC;
 	case INS_ISUB: return INS_ISUBC;
 	case INS_IMUL: return INS_IMULC;
 	case INS_IDIV: return INS_IDIVC;
 	case INS_IMOD: return INS_IMODC;
+	case INS_ISHL: return INS_ISHLC;
+	case INS_ISAR: return INS_ISARC;
+	case INS_ISHR: return INS_ISHRC;
+	case INS_IAND: return INS_IANDC;
+	case INS_IOR:  return INS_IORC;
+	case INS_IXOR: return INS_IXORC;
 	case INS_IJMPLT: return INS_IJMPLTC;
 	case INS_IJMPLE: return INS_IJMPLEC;
 	case INS_IJMPGT: return INS_IJMPGTC;
@@ -82,7 +138,7 @@ static int toConstOp(int i) {
 	abort();
 }
 
-static bool isCondJmpOp(int i) {
+bool isCondJmpOp(int i) {
 	switch(i) {
 	case INS_IJMPLT: 
 	case INS_IJMPLE: 
@@ -95,7 +151,7 @@ static bool isCondJmpOp(int i) {
 	return false;
 }
 
-static int toRevCondJmpOp(int i) {
+int toRevCondJmpOp(int i) {
 	switch(i) {
 	case INS_IJMPLT: return INS_IJMPGE;
 	case INS_IJMPLE: return INS_IJMPGT;
@@ -103,11 +159,29 @@ static int toRevCondJmpOp(int i) {
 	case INS_IJMPGE: return INS_IJMPLT;
 	case INS_IJMPEQ: return INS_IJMPNE;
 	case INS_IJMPNE: return INS_IJMPEQ;
+	case INS_IJMPLTC: return INS_IJMPGEC;
+	case INS_IJMPLEC: return INS_IJMPGTC;
+	case INS_IJMPGTC: return INS_IJMPLEC;
+	case INS_IJMPGEC: return INS_IJMPLTC;
+	case INS_IJMPEQC: return INS_IJMPNEC;
+	case INS_IJMPNEC: return INS_IJMPEQC;
+	default: abort();
+	}
+}
+
+int toSwapCondJmpOp(int i) {
+	switch(i) {
+	case INS_IJMPLT: return INS_IJMPGT;
+	case INS_IJMPLE: return INS_IJMPGE;
+	case INS_IJMPGT: return INS_IJMPLT;
+	case INS_IJMPGE: return INS_IJMPLE;
+	case INS_IJMPEQ: return INS_IJMPEQ;
+	case INS_IJMPNE: return INS_IJMPNE;
 	default: abort();
 	}
 }
 
-static bool isCondJmpCOp(int i) {
+bool isCondJmpCOp(int i) {
 	switch(i) {
 	case INS_IJMPLTC: 
 	case INS_IJMPLEC: 
@@ -120,7 +194,7 @@ static bool isCondJmpCOp(int i) {
 	return false;
 }
 
-static int getOpSize(int i) {
+int getOpSize(int i) {
 	switch(i) {
 		// int ins
 	case INS_RETC:
@@ -132,6 +206,14 @@ static int getOpSize(int i) {
 	case INS_IMULC:
 	case INS_IDIVC:
 	case INS_IMODC:
+	case INS_ISHLC:
+	case INS_ISARC:
+	case INS_ISHRC:
+	case INS_IANDC:
+	case INS_IORC:
+	case INS_IXORC:
+	case INS_IDIVP2:
+	case INS_IMODP2:
 		// reg2ins
 	case INS_MOV:
 	case INS_IADD:
@@ -139,15 +221,33 @@ static int getOpSize(int i) {
 	case INS_IMUL:
 	case INS_IDIV:
 	case INS_IMOD:
+	case INS_ISHL:
+	case INS_ISAR:
+	case INS_ISHR:
+	case INS_IAND:
+	case INS_IOR:
+	case INS_IXOR:
 		return 3;
 
+		// magic division
+	case INS_IDIVMC:
+	case INS_IMODMC:
+		return 5;
+
 		// regins
 	case INS_INEG:
 	case INS_RET:
 	case INS_JOIN:
+	case INS_SCOPE:
+	case INS_CONS:
+	case INS_CAR:
+	case INS_CDR:
 	case INS_IPRINT:
 	case INS_BPRINT:
+	case INS_LPRINT:
 		return 2;
+	case INS_RACE:
+		return 4;
 
 		// jmp
 	case INS_IJMPLT:
@@ -177,6 +277,16 @@ static int getOpSize(int i) {
 	case INS_CALL:
 	case INS_SPAWN:
 		return 3;
+// native call [foreign] r1
+	case INS_FCALL:
+		return 3;
+// memo [memo] r1
+	case INS_MEMO:
+	case INS_MEMOSET:
+		return 3;
+// hash table op r1 kind
+	case INS_HASH:
+		return 3;
 	case INS_DEFUN:
 		return 2;
 	case INS_END:
@@ -186,22 +296,92 @@ static int getOpSize(int i) {
 	}
 }
 
-static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
-	CodeBuilder cb(ctx, func, false, showir);
+//------------------------------------------------------
+// strength reduction
+
+static int log2Exact(uint64_t k) {
+	if(k == 0 || (k & (k - 1)) != 0) return -1;
+	return __builtin_ctzll(k);
+}
+
+/* magic number and shift of signed division by d (|d| >= 2, not a power of 2),
+ * Hacker's Delight 10-1 */
+static void divMagic(int64_t d, int64_t *magic, int *shift) {
+	const uint64_t two63 = (uint64_t)1 << 63;
+	uint64_t ad = d < 0 ? 0 - (uint64_t)d : (uint64_t)d;
+	uint64_t t = two63 + ((uint64_t)d >> 63);
+	uint64_t anc = t - 1 - t % ad;
+	int p = 63;
+	uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+	uint64_t q2 = two63 / ad,  r2 = two63 - q2 * ad;
+	uint64_t delta;
+	do {
+		p++;
+		q1 *= 2; r1 *= 2;
+		if(r1 >= anc) { q1++; r1 -= anc; }
+		q2 *= 2; r2 *= 2;
+		if(r2 >= ad) { q2++; r2 -= ad; }
+		delta = ad - r2;
+	} while(q1 < delta || (q1 == delta && r1 == 0));
+	int64_t m = (int64_t)(q2 + 1);
+	*magic = d < 0 ? -m : m;
+	*shift = p - 64;
+}
+
+// [r] op= k for IMULC, IDIVC, IMODC
+static void createReducedOp(CodeBuilder *cb, int op, int r, int64_t k) {
+	uint64_t ak = k < 0 ? 0 - (uint64_t)k : (uint64_t)k;
+	int n = log2Exact(ak);
+	if(op == INS_IMULC) {
+		if(n >= 0) {
+			if(n > 0) cb->createRegIntIns(INS_ISHLC, r, n);
+			if(k < 0) cb->createINeg(r);
+		} else {
+			cb->createRegIntIns(op, r, k);
+		}
+		return;
+	}
+	if(k == 0 || n == 63) {
+		// division by zero or INT64_MIN
+		cb->createRegIntIns(op, r, k);
+	} else if(n == 0) {
+		if(op == INS_IDIVC) {
+			if(k < 0) cb->createINeg(r);
+		} else {
+			cb->createIConst(r, 0);
+		}
+	} else if(n > 0) {
+		// x % -2^n == x % 2^n
+		cb->createRegIntIns(op == INS_IDIVC ? INS_IDIVP2 : INS_IMODP2, r, n);
+		if(op == INS_IDIVC && k < 0) cb->createINeg(r);
+	} else {
+		int64_t m;
+		int s;
+		divMagic(k, &m, &s);
+		if(k > 0 && m < 0) s |= MAGIC_ADD;
+		if(k < 0 && m > 0) s |= MAGIC_SUB;
+		cb->createMagicIns(op == INS_IDIVC ? INS_IDIVMC : INS_IMODMC, r, k, m, s);
+	}
+}
+
+static void createOpC(CodeBuilder *cb, int op, int r, int64_t k) {
+	if(op == INS_IMULC || op == INS_IDIVC || op == INS_IMODC) {
+		createReducedOp(cb, op, r, k);
+	} else {
+		cb->createRegIntIns(op, r, k);
+	}
+}
+
+static void opt_inline(Context *ctx, Func *func, const bool *inl, bool showir, Arena *arena) {
+	CodeBuilder cb(ctx, func, false, showir, arena);
 	Code *pc = func->code;
-	Frame *frame = new Frame[inlinecnt + 1];
+	Frame *frame = new Frame[2];
 	Frame *fp = frame;
-	ArrayBuilder<Label> la;
+	LabelTable la(arena);
 	int sp = 0;
 	int layer = 0;
 	L_BEGIN:
-	for(int i=0, j=la.getSize(); i<j; i++) {
-		Label l = la[i];
-		if(pc == l.pc && layer == l.layer) {
-			cb.setLabel(l.lb);
-			la[i].pc = NULL;
-		}
-	}
+	la.setLabels(&cb, pc, layer);
 	// unused inst
 	if((pc[0].i == INS_ICONST || pc[0].i == INS_MOV || isReg2Op(pc[0].i) || isReg2COp(pc[0].i)) &&
 			!isjmplabel(&la, pc+3, layer) && (pc[3].i == INS_RET || pc[3].i == INS_RETC) &&
@@ -211,61 +391,10 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 	}
 	switch(pc->i) {
 	case INS_ICONST: {
+		// copy forwarding and constant folding are left to opt_ssa.
+		// the slot written here may still be live, so only the
+		// patterns ending in ret are safe
 		if(!isjmplabel(&la, pc+3, layer)) {
-			if(pc[3].i == INS_MOV && (pc[1].i == pc[5].i)) {
-				cb.createIConst(pc[4].i + sp, pc[2].i);
-				pc += 3 + 3;
-				break;
-			}
-			if(isReg2Op(pc[3].i) && (pc[1].i == pc[5].i)) {
-				// const a x && op b a -> opC b x
-				cb.createRegIntIns(toConstOp(pc[3].i), pc[4].i+sp, pc[2].i);
-				pc += 3 + 3;
-				break;
-			}
-			if((pc[3].i == INS_IADD || pc[3].i == INS_IMUL) && (pc[1].i == pc[4].i)) {
-				// const a x && op a b -> mov a b && opC a x
-				cb.createMov(pc[4].i + sp, pc[5].i + sp);
-				cb.createRegIntIns(toConstOp(pc[3].i), pc[4].i+sp, pc[2].i);
-				pc += 3 + 3;
-				break;
-			}
-			if(isReg2COp(pc[3].i) && (pc[1].i == pc[4].i)) {
-				// const a x && opC a y -> const a (x op y)
-				cb.createIConst(pc[1].i+sp, applyOpC(pc[3].i, pc[2].i, pc[5].i));
-				pc += 3 + 3;
-				break;
-			}
-			if(pc[3].i == INS_INEG && (pc[1].i == pc[4].i)) {
-				// const a x && neg a -> const a -x
-				cb.createIConst(pc[1].i + sp, -pc[2].i);
-				pc += 3 + 2;
-				break;
-			}
-			if(isCondJmpOp(pc[3].i) && pc[1].i == pc[6].i) {
-				// const a x && jmpxx b a -> jmpxxC b x
-				int n = cb.createCondOpC(toConstOp(pc[3].i), pc[5].i+sp, pc[2].i);
-				PUSH_LABEL(n, pc + 3 + pc[4].i, layer);
-				pc += 3 + 4;
-				break;
-			}
-			if(isCondJmpOp(pc[3].i) && pc[1].i == pc[5].i) {
-				// const a x && jmpxx a b -> jmp[!xx]C b x
-				int op = toConstOp(toRevCondJmpOp(pc[3].i));
-				int n = cb.createCondOpC(op, pc[6].i+sp, pc[2].i);
-				PUSH_LABEL(n, pc + 3 + pc[4].i, layer);
-				pc += 3 + 4;
-				break;
-			}
-			if(isCondJmpCOp(pc[3].i) && pc[1].i == pc[5].i) {
-				// const a x && jmpxxC a y
-				if(applyOpC(pc[3].i, pc[2].i, pc[6].i)) {
-					int n = cb.createJmp();
-					PUSH_LABEL(n, pc + 3 + pc[4].i, layer);
-				}
-				pc += 3 + 4;
-				break;
-			}
 			if(pc[3].i == INS_RET && (pc[1].i == pc[4].i) && layer == 0) {
 				// const a x && ret a -> retc x
 				cb.createRetC(pc[2].i);
@@ -279,48 +408,16 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 	}
 	case INS_MOV: {
 		if(!isjmplabel(&la, pc+3, layer)) {
-			if(pc[3].i == INS_MOV && pc[1].i == pc[5].i) {
-				// mov b a && mov c b -> mov c a
-				cb.createMov(pc[4].i + sp, pc[2].i + sp);
-				pc += 3 + 3;
-				break;
-			}
-			if(isReg2Op(pc[3].i) && (pc[1].i == pc[5].i)) {
-				// mov b a && op c b -> op c a
-				cb.createReg2Ins(pc[3].i, pc[4].i+sp, pc[2].i);
-				pc += 3 + 3;
-				break;
-			}
 			if(pc[3].i == INS_RET && pc[1].i == pc[4].i && layer == 0) {
 				// mov b a && ret b -> ret a
 				cb.createRet(pc[2].i + sp);
 				pc += 3 + 2;
 				break;
 			}
-			if(isCondJmpOp(pc[3].i) && pc[1].i == pc[6].i) {
-				// mov b a && jmpxx c b -> jmpxx c a
-				int n = cb.createCondOp(pc[3].i, pc[5].i+sp, pc[2].i+sp);
-				PUSH_LABEL(n, pc + 3 + pc[4].i, layer);
-				pc += 3 + 4;
-				break;
-			}
-			if(isCondJmpOp(pc[3].i) && pc[1].i == pc[5].i) {
-				// mov b a && jmpxx b c -> jmpxx a c
-				int n = cb.createCondOp(pc[3].i, pc[2].i+sp, pc[6].i+sp);
-				PUSH_LABEL(n, pc + 3 + pc[4].i, layer);
-				pc += 3 + 4;
-				break;
-			}
-			if(isCondJmpCOp(pc[3].i) && pc[1].i == pc[5].i) {
-				// mov b a && jmpxxC b n -> jmpxxC a n
-				int n = cb.createCondOpC(pc[3].i, pc[2].i+sp, pc[6].i);
-				PUSH_LABEL(n, pc + 3 + pc[4].i, layer);
-				pc += 3 + 4;
-				break;
-			}
-			if(isReg2COp(pc[3].i) && pc[6].i == INS_RET && pc[1].i == pc[4].i && pc[4].i == pc[7].i && !isjmplabel(&la, pc+6, layer)) {
+			// pc+3 is checked above
+			if(isReg2COp(pc[3].i) && pc[6].i == INS_RET && pc[1].i == pc[4].i && pc[4].i == pc[7].i && !isjmplabel(&la, pc+6, layer) && layer == 0) {
 				// mov b a && opC b x && ret b -> opC a x && ret a
-				cb.createRegIntIns(pc[3].i, pc[2].i + sp, pc[5].i);
+				createOpC(&cb, pc[3].i, pc[2].i + sp, pc[5].i);
 				cb.createRet(pc[2].i + sp);
 				pc += 3 + 3 + 2;
 				break;
@@ -335,25 +432,52 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 	case INS_IMUL: 
 	case INS_IDIV: 
 	case INS_IMOD:
+	case INS_ISHL:
+	case INS_ISAR:
+	case INS_ISHR:
+	case INS_IAND:
+	case INS_IOR:
+	case INS_IXOR:
 		cb.createReg2Ins(pc[0].i, pc[1].i + sp, pc[2].i + sp);
 		pc += 3;
 		break;
+	case INS_ISHLC:
+	case INS_ISARC:
+	case INS_ISHRC:
+	case INS_IANDC:
+	case INS_IORC:
+	case INS_IXORC:
+	case INS_IDIVP2:
+	case INS_IMODP2:
+		cb.createRegIntIns(pc[0].i, pc[1].i + sp, pc[2].i);
+		pc += 3;
+		break;
+	case INS_IDIVMC:
+	case INS_IMODMC:
+		cb.createMagicIns(pc[0].i, pc[1].i + sp, pc[2].i, pc[3].i, pc[4].i);
+		pc += 5;
+		break;
 	case INS_IADDC:
 	case INS_ISUBC:
 	case INS_IMULC:
 	case INS_IDIVC:
 	case INS_IMODC:
-		if(pc[0].i == INS_IADDC && pc[3].i == INS_IADDC && pc[1].i == pc[4].i) {
+		// the second inst must not be a jump target
+		if(pc[0].i == INS_IADDC && pc[3].i == INS_IADDC && pc[1].i == pc[4].i &&
+				!isjmplabel(&la, pc+3, layer)) {
 			// iaddc a x && iaddc a y -> iaddc a (x+y)
 			cb.createRegIntIns(pc[0].i, pc[1].i + sp, pc[2].i + pc[5].i);
 			pc += 3 + 3;
 			break;
 		}
-		if((pc[0].i == INS_IMULC && pc[3].i == INS_IMULC && pc[1].i == pc[4].i) ||
-				(pc[0].i == INS_IDIVC && pc[3].i == INS_IDIVC && pc[1].i == pc[4].i)) {
+		int64_t xy;
+		if(((pc[0].i == INS_IMULC && pc[3].i == INS_IMULC) ||
+				(pc[0].i == INS_IDIVC && pc[3].i == INS_IDIVC)) && pc[1].i == pc[4].i &&
+				!isjmplabel(&la, pc+3, layer) &&
+				!__builtin_mul_overflow(pc[2].i, pc[5].i, &xy)) {
 			// imulc a x && imulc a y -> imulc a (x*y)
-			// idivc a x && idivc a y -> idivc a (x*y)
-			cb.createRegIntIns(pc[0].i, pc[1].i + sp, pc[2].i * pc[5].i);
+			// idivc a x && idivc a y -> idivc a (x*y), x*y does not overflow
+			cb.createRegIntIns(pc[0].i, pc[1].i + sp, xy);
 			pc += 3 + 3;
 			break;
 		}
@@ -369,7 +493,7 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 		} else if(pc[0].i == INS_IMULC && pc[2].i == 0) {
 			cb.createIConst(pc[1].i + sp, 0);
 		} else {
-			cb.createRegIntIns(pc[0].i, pc[1].i + sp, pc[2].i);
+			createOpC(&cb, pc[0].i, pc[1].i + sp, pc[2].i);
 		}
 		pc += 3;
 		break;
@@ -434,7 +558,7 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 	case INS_LOAD_GLOBAL:  cb.createLoadGlobal (pc[1].i + sp, pc[2].var); pc += 3; break;
 	case INS_STORE_GLOBAL: cb.createStoreGlobal(pc[1].i + sp, pc[2].var); pc += 3; break;
 	case INS_CALL:  {
-		if(layer < inlinecnt) {
+		if(layer == 0 && inl != NULL && inl[pc - func->code]) {
 			// inline
 			fp->pc = pc + 3;
 			fp->sp = sp;
@@ -450,6 +574,10 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 		break;
 	}
 	case INS_SPAWN: cb.createSpawn(pc[1].func, pc[2].i + sp); pc += 3; break;
+	case INS_FCALL: cb.createForeignIns(INS_FCALL, pc[1].ffi, pc[2].i + sp); pc += 3; break;
+	case INS_MEMO:
+	case INS_MEMOSET: cb.createMemoIns(pc[0].i, pc[1].memo, pc[2].i + sp); pc += 3; break;
+	case INS_HASH: cb.createRegIntIns(INS_HASH, pc[1].i + sp, pc[2].i); pc += 3; break;
 	case INS_RET: {
 		if(layer > 0) {
 			cb.createMov(sp-2, sp + pc[1].i);
@@ -488,8 +616,14 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 		break;
 	}
 	case INS_JOIN: cb.createJoin(pc[1].i + sp); pc += 2; break;
+	case INS_SCOPE: cb.createScope(pc[1].i + sp); pc += 2; break;
+	case INS_RACE: cb.createRace(pc[1].i + sp, pc[2].i, pc[3].i); pc += 4; break;
 	case INS_IPRINT: cb.createPrintInt(pc[1].i + sp); pc += 2; break;
 	case INS_BPRINT: cb.createPrintBoolean(pc[1].i + sp); pc += 2; break;
+	case INS_LPRINT: cb.createPrintList(pc[1].i + sp); pc += 2; break;
+	case INS_CONS:
+	case INS_CAR:
+	case INS_CDR: cb.createRegIns(pc[0].i, pc[1].i + sp); pc += 2; break;
 	case INS_DEFUN: cb.createConsIns(pc[0].i, pc[1].cons); pc += 2; break;
 	case INS_END: {
 		if(layer == 0) {
@@ -514,17 +648,12 @@ static void opt_inline(Context *ctx, Func *func, int inlinecnt, bool showir) {
 	func->codeLength = cb.getCodeLength();
 }
 
-#ifdef USING_THCODE
-static void opt_thcode(Context *ctx, Func *func) {
-	CodeBuilder cb(ctx, func, true, false);
-	Code *pc = func->code;
-
-	L_BEGIN:
+// copy one instruction, jump offsets unchanged
+static void copyIns(CodeBuilder *cb, Code *pc) {
 	switch(pc->i) {
 		// int ins
 	case INS_RETC:
-		cb.createIntIns(pc[0].i, pc[1].i);
-		pc += 2;
+		cb->createIntIns(pc[0].i, pc[1].i);
 		break;
 
 		// reg int ins
@@ -534,8 +663,21 @@ static void opt_thcode(Context *ctx, Func *func) {
 	case INS_IMULC:
 	case INS_IDIVC:
 	case INS_IMODC:
-		cb.createRegIntIns(pc[0].i, pc[1].i, pc[2].i);
-		pc += 3;
+	case INS_ISHLC:
+	case INS_ISARC:
+	case INS_ISHRC:
+	case INS_IANDC:
+	case INS_IORC:
+	case INS_IXORC:
+	case INS_IDIVP2:
+	case INS_IMODP2:
+		cb->createRegIntIns(pc[0].i, pc[1].i, pc[2].i);
+		break;
+
+		// magic division
+	case INS_IDIVMC:
+	case INS_IMODMC:
+		cb->createMagicIns(pc[0].i, pc[1].i, pc[2].i, pc[3].i, pc[4].i);
 		break;
 
 		// reg2ins
@@ -545,18 +687,30 @@ static void opt_thcode(Context *ctx, Func *func) {
 	case INS_IMUL:
 	case INS_IDIV:
 	case INS_IMOD:
-		cb.createReg2Ins(pc[0].i, pc[1].i, pc[2].i);
-		pc += 3;
+	case INS_ISHL:
+	case INS_ISAR:
+	case INS_ISHR:
+	case INS_IAND:
+	case INS_IOR:
+	case INS_IXOR:
+		cb->createReg2Ins(pc[0].i, pc[1].i, pc[2].i);
 		break;
 
 		// regins
 	case INS_INEG:
 	case INS_RET:
 	case INS_JOIN:
+	case INS_SCOPE:
+	case INS_CONS:
+	case INS_CAR:
+	case INS_CDR:
 	case INS_IPRINT:
 	case INS_BPRINT:
-		cb.createRegIns(pc[0].i, pc[1].i);
-		pc += 2;
+	case INS_LPRINT:
+		cb->createRegIns(pc[0].i, pc[1].i);
+		break;
+	case INS_RACE:
+		cb->createRace(pc[1].i, pc[2].i, pc[3].i);
 		break;
 
 // jmp pc+[r1] if [r1] < [r2]
@@ -566,8 +720,7 @@ static void opt_thcode(Context *ctx, Func *func) {
 	case INS_IJMPGE:
 	case INS_IJMPEQ:
 	case INS_IJMPNE:
-		cb.createCondOp(pc[0].i, pc[2].i, pc[3].i, pc[1].i);
-		pc += 4;
+		cb->createCondOp(pc[0].i, pc[2].i, pc[3].i, pc[1].i);
 		break;
 
 // jmp pc+[r1] if [r1] < v2
@@ -577,62 +730,426 @@ static void opt_thcode(Context *ctx, Func *func) {
 	case INS_IJMPGEC:
 	case INS_IJMPEQC:
 	case INS_IJMPNEC:
-		cb.createCondOpC(pc[0].i, pc[2].i, pc[3].i, pc[1].i);
-		pc += 4;
+		cb->createCondOpC(pc[0].i, pc[2].i, pc[3].i, pc[1].i);
 		break;
 
 // jmp pc+[r1]
 	case INS_JMP:
-		cb.createJmp(pc[1].i);
-		pc += 2;
+		cb->createJmp(pc[1].i);
 		break;
 
 // global variable [var] [r1]
 	case INS_LOAD_GLOBAL:
 	case INS_STORE_GLOBAL:
-		cb.createVarIns(pc[0].i, pc[1].i, pc[2].var);
-		pc += 3;
+		cb->createVarIns(pc[0].i, pc[1].i, pc[2].var);
 		break;
 // call [func], shift, rix
 	case INS_CALL:
 	case INS_SPAWN:
-		cb.createFuncIns(pc[0].i, pc[1].func, pc[2].i);
-		pc += 3;
+		cb->createFuncIns(pc[0].i, pc[1].func, pc[2].i);
+		break;
+	case INS_FCALL:
+		cb->createForeignIns(pc[0].i, pc[1].ffi, pc[2].i);
+		break;
+	case INS_MEMO:
+	case INS_MEMOSET:
+		cb->createMemoIns(pc[0].i, pc[1].memo, pc[2].i);
+		break;
+	case INS_HASH:
+		cb->createRegIntIns(pc[0].i, pc[1].i, pc[2].i);
 		break;
 // defun [cons]
 	case INS_DEFUN:
-		cb.createConsIns(pc[0].i, pc[1].cons);
-		pc += 2;
+		cb->createConsIns(pc[0].i, pc[1].cons);
 		break;
 	case INS_END:
-		cb.createEnd();
-		goto L_FINAL;
+		cb->createEnd();
+		break;
 	default:
 		abort();
 	}
-	goto L_BEGIN;
-	L_FINAL:
-	func->thcode = cb.getCode();
-	func->codeLength = cb.getCodeLength();
 }
-#endif
 
-#define CODESIZE_BORDER 400
+// the code the vm runs, threaded code in the default build. func->code
+// is kept for inlining and reoptimization. a new run code is published
+// whole, calls that read func->runcode get the old or the new one
+static void opt_runcode(Context *ctx, Func *func, Code *code, Arena *arena) {
+	CodeBuilder cb(ctx, func, true, false, arena);
+	for(Code *pc = code; ; pc += getOpSize(pc->i)) {
+		copyIns(&cb, pc);
+		if(pc->i == INS_END) break;
+	}
+	func->runLength = cb.getCodeLength();
+	__atomic_store_n(&func->runcode, cb.getCode(), __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------
+// profile-guided block layout
 
-void codeopt(Context *ctx, Func *func) {
-	for(int i=0; i<2; i++) {
-		opt_inline(ctx, func, 0, false);
+struct LayoutBlock {
+	int start;
+	int last;    /* pc of the last instruction */
+	int taken;   /* jump target block or -1 */
+	int fall;    /* fall through block or -1 */
+	int64_t wtaken;
+	int64_t wfall;
+	bool placed;
+};
+
+static bool isJmpIns(int op) {
+	return op == INS_JMP || isCondJmpOp(op) || isCondJmpCOp(op);
+}
+
+// emit a jump to block t, or remember it until t is placed
+static void layoutJmp(CodeBuilder *cb, Code *c, int op, int t, const int *bpos,
+		ArrayBuilder<int> *plabel, ArrayBuilder<int> *pblock) {
+	int off = bpos[t] >= 0 ? bpos[t] - cb->getCodeLength() : 0;
+	int lb;
+	if(op == INS_JMP) {
+		lb = cb->createJmp(off);
+	} else if(isCondJmpOp(op)) {
+		lb = cb->createCondOp(op, c[2].i, c[3].i, off);
+	} else {
+		lb = cb->createCondOpC(op, c[2].i, c[3].i, off);
+	}
+	if(bpos[t] < 0) {
+		plabel->add(lb);
+		pblock->add(t);
 	}
+}
+
+// reorder the blocks so that the hotter side of each conditional branch
+// falls through. counts has the taken and not taken count of each
+// conditional branch, in code order. the result has backward jumps,
+// which the other passes do not expect, so it is only run
+static Code *opt_layout(Context *ctx, Func *func, const int64_t *counts, bool showir,
+		Arena *arena) {
+	Code *code = func->code;
+	int len = func->codeLength;
+	int *bid = new(arena) int[len + 1];
+	for(int i=0; i<=len; i++) bid[i] = -1;
+	bid[0] = 0;
+	int endpc = 0;
+	for(int pc=0; code[pc].i != INS_END; pc += getOpSize(code[pc].i)) {
+		int op = code[pc].i;
+		int next = pc + getOpSize(op);
+		if(isJmpIns(op)) {
+			bid[pc + code[pc+1].i] = 0;
+			bid[next] = 0;
+		} else if(op == INS_RET || op == INS_RETC) {
+			bid[next] = 0;
+		}
+		endpc = next;
+	}
+	bid[endpc] = 0;
+	int nb = 0;
+	for(int pc=0; pc<=endpc; pc += getOpSize(code[pc].i)) {
+		if(bid[pc] == 0) bid[pc] = nb++;
+		else bid[pc] = -1;
+		if(pc == endpc) break;
+	}
+
+	// the block with END is the last one
+	LayoutBlock *blocks = new(arena) LayoutBlock[nb];
+	int nbr = 0;
+	for(int pc=0, b=-1; pc<=endpc; pc += getOpSize(code[pc].i)) {
+		if(bid[pc] != -1) {
+			b = bid[pc];
+			blocks[b].start = pc;
+			blocks[b].taken = -1;
+			blocks[b].fall = -1;
+			blocks[b].wtaken = 0;
+			blocks[b].wfall = 0;
+			blocks[b].placed = false;
+		}
+		LayoutBlock *bl = &blocks[b];
+		bl->last = pc;
+		int op = code[pc].i;
+		if(op == INS_END) break;
+		int next = pc + getOpSize(op);
+		if(isJmpIns(op)) {
+			bl->taken = bid[pc + code[pc+1].i];
+			if(op != INS_JMP) {
+				bl->fall = bid[next];
+				bl->wtaken = counts[nbr * 2];
+				bl->wfall = counts[nbr * 2 + 1];
+				nbr++;
+			}
+		} else if(op != INS_RET && op != INS_RETC && bid[next] != -1) {
+			bl->fall = bid[next];
+		}
+	}
+
+	// follow the hotter successor, restart from the first unplaced block
+	int *order = new(arena) int[nb];
+	int n = 0;
+	int endb = nb - 1;
+	int scan = 0;
+	for(int cur = 0; cur != -1; ) {
+		LayoutBlock *bl = &blocks[cur];
+		bl->placed = true;
+		order[n++] = cur;
+		int s1 = bl->fall, s2 = bl->taken;
+		if(s1 == -1 || bl->wtaken > bl->wfall) {
+			s1 = bl->taken;
+			s2 = bl->fall;
+		}
+		cur = -1;
+		if(s1 != -1 && s1 != endb && !blocks[s1].placed) {
+			cur = s1;
+		} else if(s2 != -1 && s2 != endb && !blocks[s2].placed) {
+			cur = s2;
+		} else {
+			while(scan < endb && blocks[scan].placed) scan++;
+			if(scan < endb) cur = scan;
+		}
+	}
+	order[n++] = endb;
+
+	CodeBuilder cb(ctx, func, false, showir, arena);
+	int *bpos = new(arena) int[nb];
+	for(int b=0; b<nb; b++) bpos[b] = -1;
+	ArrayBuilder<int> plabel(arena), pblock(arena);
+	for(int i=0; i<n; i++) {
+		int b = order[i];
+		int next = i + 1 < n ? order[i + 1] : -1;
+		LayoutBlock *bl = &blocks[b];
+		bpos[b] = cb.getCodeLength();
+		for(int j=0; j<plabel.getSize(); j++) {
+			if(pblock[j] == b) cb.setLabel(plabel[j]);
+		}
+		for(int pc=bl->start; pc<bl->last; pc += getOpSize(code[pc].i)) {
+			copyIns(&cb, code + pc);
+		}
+		Code *c = code + bl->last;
+		int op = c->i;
+		if(!isJmpIns(op)) {
+			copyIns(&cb, c);
+			if(bl->fall != -1 && bl->fall != next) {
+				layoutJmp(&cb, c, INS_JMP, bl->fall, bpos, &plabel, &pblock);
+			}
+		} else if(op == INS_JMP) {
+			if(bl->taken != next) {
+				layoutJmp(&cb, c, INS_JMP, bl->taken, bpos, &plabel, &pblock);
+			}
+		} else {
+			int t = bl->taken, f = bl->fall;
+			if(t == next && f != next) {
+				op = toRevCondJmpOp(op);
+				t = bl->fall;
+				f = bl->taken;
+			}
+			layoutJmp(&cb, c, op, t, bpos, &plabel, &pblock);
+			if(f != next) {
+				layoutJmp(&cb, c, INS_JMP, f, bpos, &plabel, &pblock);
+			}
+		}
+	}
+	return cb.getCode();
+}
+
+//------------------------------------------------------
+// inline cost model
+
+#define INLINE_BUDGET   400 /* code size of a function */
+#define INLINE_MAXSIZE  160 /* code size of a callee */
+#define INLINE_TINY     10  /* always inlined, about the size of a call */
+#define FREQ_ENTRY      256 /* static frequency of the function entry */
+#define FREQ_COLD       (FREQ_ENTRY / 16)
+
+struct CallSite {
+	int pc;
+	int score;
+	int size;
+};
+
+static bool isHot(Func *f) {
+	return f->callcount >= REOPT_CALLCOUNT;
+}
+
+// scan the code once, estimating each call site's frequency (each
+// conditional branch halves it) and counting the constant arguments
+static void findCallSites(Func *func, ArrayBuilder<CallSite> *sites) {
+	Code *code = func->code;
+	int len = func->codeLength;
+	int *in = new int[len + 1];
+	bool *target = new bool[len + 1];
+	for(int i=0; i<=len; i++) {
+		in[i] = 0;
+		target[i] = false;
+	}
+	for(int pc=0; code[pc].i != INS_END; pc += getOpSize(code[pc].i)) {
+		int op = code[pc].i;
+		if(op == INS_JMP || isCondJmpOp(op) || isCondJmpCOp(op)) {
+			target[pc + code[pc+1].i] = true;
+		}
+	}
+	ArrayBuilder<int> consts;
+	int cur = FREQ_ENTRY;
+	for(int pc=0; code[pc].i != INS_END; pc += getOpSize(code[pc].i)) {
+		Code *c = code + pc;
+		int op = c[0].i;
+		cur += in[pc];
+		if(target[pc]) consts.clear();
+		if(op == INS_JMP || isCondJmpOp(op) || isCondJmpCOp(op)) {
+			int t = c[1].i > 0 ? pc + c[1].i : -1;
+			int f = op == INS_JMP ? cur : cur / 2;
+			if(t != -1) in[t] += f;
+			cur -= f;
+			consts.clear();
+			continue;
+		}
+		if(op == INS_RET || op == INS_RETC) {
+			cur = 0;
+			continue;
+		}
+		if(op == INS_SCOPE || op == INS_RACE) {
+			consts.clear();
+			continue;
+		}
+		if(op == INS_CALL || op == INS_SPAWN) {
+			Func *callee = c[1].func;
+			int shift = c[2].i;
+			// a memo function returns from its MEMO, it is not inlined
+			if(op == INS_CALL && callee->memo == NULL && callee->code != NULL &&
+					callee->codeLength <= INLINE_MAXSIZE) {
+				int nconst = 0;
+				for(int i=0, j=consts.getSize(); i<j; i++) {
+					if(consts[i] >= shift && consts[i] < shift + (int)callee->argc) nconst++;
+				}
+				CallSite cs;
+				cs.pc = pc;
+				cs.size = callee->codeLength;
+				cs.score = cur;
+				if(callee == func) cs.score *= 2;
+				if(isHot(callee)) cs.score *= 2;
+				cs.score += nconst * FREQ_ENTRY / 4;
+				// callcount is of all the calls of the callee, not of this
+				// site, and misses the calls inlined into the code that ran,
+				// so a cold site is told by the static frequency only
+				if(cs.size <= INLINE_TINY || cs.score >= FREQ_COLD) {
+					sites->add(cs);
+				}
+			}
+			consts.clear();
+			continue;
+		}
+		if(op == INS_ICONST) {
+			consts.add(c[1].i);
+		} else if(op == INS_FCALL || op == INS_MEMO || op == INS_MEMOSET) {
+			for(int i=0, j=consts.getSize(); i<j; i++) {
+				if(consts[i] == c[2].i) consts[i] = -1;
+			}
+		} else if(op != INS_IPRINT && op != INS_BPRINT && op != INS_LPRINT && op != INS_STORE_GLOBAL &&
+				op != INS_DEFUN && getOpSize(op) >= 2) {
+			// instruction writes [r1]
+			for(int i=0, j=consts.getSize(); i<j; i++) {
+				if(consts[i] == c[1].i) consts[i] = -1;
+			}
+		}
+	}
+	delete [] in;
+	delete [] target;
+}
+
+static int cmpCallSite(const void *a, const void *b) {
+	const CallSite *x = (const CallSite *)a, *y = (const CallSite *)b;
+	if(x->score != y->score) return y->score - x->score;
+	return x->pc - y->pc;
+}
+
+// choose call sites by score until the code size budget is spent
+static bool selectInline(Func *func, bool *inl) {
+	ArrayBuilder<CallSite> sites;
+	findCallSites(func, &sites);
+	for(int i=0; i<func->codeLength; i++) inl[i] = false;
+	int n = sites.getSize();
+	CallSite *cs = sites.toArray();
+	qsort(cs, n, sizeof(CallSite), cmpCallSite);
+	int size = func->codeLength;
+	bool res = false;
+	for(int i=0; i<n; i++) {
+		if(cs[i].size > INLINE_TINY && size + cs[i].size > INLINE_BUDGET) continue;
+		size += cs[i].size;
+		inl[cs[i].pc] = true;
+		res = true;
+	}
+	delete [] cs;
+	return res;
+}
+
+//------------------------------------------------------
+#define OPT_MAXPASS 8
+
+// repeat opt_ssa until the code stops changing
+static void opt_fixpoint(Context *ctx, Func *func, Arena *arena) {
+	for(int i=0; i<OPT_MAXPASS; i++) {
+		if(!opt_ssa(ctx, func, false, arena)) break;
+	}
+}
+
+void codeopt(Context *ctx, Func *func) {
+	Arena arena; // buffers of the passes
+	PhaseTimer *pt = ctx->phases;
+	PhaseClock clk;
+	if(pt != NULL) pt->start(&clk, func->codeLength);
+	opt_fixpoint(ctx, func, &arena);
+	if(pt != NULL) pt->end(&clk, func->name, PHASE_FIXPOINT, func->codeLength);
+	if(pt != NULL) pt->start(&clk, func->codeLength);
 	for(int i=0; i<ctx->inlinecount; i++) {
-		opt_inline(ctx, func, 1, false);
-		if(func->codeLength >= CODESIZE_BORDER) break;
+		bool *inl = new(&arena) bool[func->codeLength];
+		bool b = selectInline(func, inl);
+		if(b) opt_inline(ctx, func, inl, false, &arena);
+		if(!b) break;
+		opt_fixpoint(ctx, func, &arena);
 	}
-	for(int i=0; i<4; i++) {
-		opt_inline(ctx, func, 0, false);
+	if(pt != NULL) pt->end(&clk, func->name, PHASE_INLINE, func->codeLength);
+	// strength reduction of the constant multiply, divide and mod
+	if(pt != NULL) pt->start(&clk, func->codeLength);
+	const int64_t *counts = ctx->prof->getBranchCounts(func);
+	opt_inline(ctx, func, NULL, counts == NULL, &arena);
+	if(pt != NULL) pt->end(&clk, func->name, PHASE_STRENGTH, func->codeLength);
+	Code *code = func->code;
+	if(counts != NULL) {
+		if(pt != NULL) pt->start(&clk, func->codeLength);
+		code = opt_layout(ctx, func, counts, true, &arena);
+		if(pt != NULL) pt->end(&clk, func->name, PHASE_LAYOUT, func->codeLength);
 	}
-	opt_inline(ctx, func, 0, true);
-#ifdef USING_THCODE
-	opt_thcode(ctx, func);
+	if(pt != NULL) pt->start(&clk, func->codeLength);
+	opt_runcode(ctx, func, code, &arena);
+	if(pt != NULL) pt->end(&clk, func->name, PHASE_RUNCODE, func->runLength);
+	if(code != func->code) delete [] code;
+#ifdef USING_PROFILE
+	// the counts of a laid out code would not match func->code
+	if(counts == NULL) ctx->prof->addFunc(func);
+#endif
+	if(ctx->sampler != NULL) ctx->sampler->addCode(func);
+}
+
+// ready to run without optimizing, it is optimized when it gets hot
+// if it has srccode
+void codeunopt(Context *ctx, Func *func) {
+	Arena arena;
+	opt_runcode(ctx, func, func->code, &arena);
+#ifdef USING_PROFILE
+	ctx->prof->addFunc(func);
 #endif
+	if(ctx->sampler != NULL) ctx->sampler->addCode(func);
 }
 
+// reoptimize from the unoptimized code, using the call counts
+// collected while running. only the compiler reads func->code, the old
+// run code may be running and is retired, see Context::reoptFuncs
+void recodeopt(Context *ctx, Func *func) {
+#ifdef USING_PROFILE
+	ctx->prof->removeFunc(func);
+#endif
+	if(ctx->sampler != NULL) ctx->sampler->removeCode(func);
+	ctx->retired.add(func->runcode);
+	delete [] func->code;
+	func->code = new Code[func->srcLength];
+	memcpy(func->code, func->srccode, sizeof(Code) * func->srcLength);
+	func->codeLength = func->srcLength;
+	func->reopt = true;
+	codeopt(ctx, func);
+}
@@ -0,0 +1,89 @@
+#include "lisp.h"
+
+//------------------------------------------------------
+// print buffers, see output.h
+
+void outGrow(OutBuf *o, int64_t n) {
+	int64_t cap = o->cap != 0 ? o->cap : OUT_MINCAP;
+	while(cap < o->len + n) cap *= 2;
+	char *buf = new char[cap];
+	if(o->len != 0) memcpy(buf, o->buf, o->len);
+	delete [] o->buf;
+	o->buf = buf;
+	o->cap = cap;
+}
+
+void outWrite(OutBuf *o, FILE *fp) {
+	fwrite(o->buf, 1, o->len, fp);
+	o->len = 0;
+}
+
+void freeOutBuf(OutBuf *o) {
+	delete [] o->buf;
+	delete o;
+}
+
+//------------------------------------------------------
+// ordered output
+
+// the child has ended
+void outJoin(Task *task, Task *child) {
+	OutBuf *o = child->out;
+	if(o == NULL) return;
+	child->out = NULL;
+	if(o->len == 0) {
+		freeOutBuf(o);
+		return;
+	}
+	OutPiece *piece = new OutPiece();
+	piece->pos = child->outpos;
+	piece->seq = child->outseq;
+	piece->out = o;
+	// the children are mostly joined in the order they were spawned
+	OutPiece **p = &task->pieces;
+	while(*p != NULL && ((*p)->pos < piece->pos ||
+				((*p)->pos == piece->pos && (*p)->seq < piece->seq))) {
+		p = &(*p)->next;
+	}
+	piece->next = *p;
+	*p = piece;
+}
+
+static void outAppend(OutBuf *o, const char *s, int64_t n) {
+	if(n == 0) return;
+	memcpy(outReserve(o, n), s, n);
+	o->len += n;
+}
+
+// the pieces are merged into the task's output
+void outEnd(Task *task) {
+	if(task->pieces == NULL) return;
+	OutBuf *own = task->out;
+	if((own == NULL || own->len == 0) && task->pieces->next == NULL) {
+		// only a child printed
+		if(own != NULL) freeOutBuf(own);
+		task->out = task->pieces->out;
+		delete task->pieces;
+		task->pieces = NULL;
+		return;
+	}
+	const char *s = own != NULL ? own->buf : NULL;
+	OutBuf *o = new OutBuf();
+	initOutBuf(o);
+	int64_t at = 0;
+	for(OutPiece *p = task->pieces; p != NULL; ) {
+		OutPiece *next = p->next;
+		outAppend(o, s + at, p->pos - at);
+		at = p->pos;
+		outAppend(o, p->out->buf, p->out->len);
+		freeOutBuf(p->out);
+		delete p;
+		p = next;
+	}
+	if(own != NULL) {
+		outAppend(o, s + at, own->len - at);
+		freeOutBuf(own);
+	}
+	task->out = o;
+	task->pieces = NULL;
+}
@@ -1,79 +1,109 @@
 #include "lisp.h"
 
 //------------------------------------------------------
-static bool isSpace(char ch) {
-	return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+// character classes
+
+enum {
+	CC_SPACE = 1,
+	CC_DELIM = 2, /* ends a symbol: space, paren */
+	CC_UPPER = 4,
+};
+
+static unsigned char cclass[256];
+
+static bool initCharClass() {
+	const char *sp = " \n\r\t";
+	for(int i=0; sp[i] != '\0'; i++) cclass[(unsigned char)sp[i]] = CC_SPACE | CC_DELIM;
+	cclass['('] = CC_DELIM;
+	cclass[')'] = CC_DELIM;
+	for(int c='A'; c<='Z'; c++) cclass[c] = CC_UPPER;
+	return true;
 }
 
+static bool cclassInit = initCharClass();
+
 static bool isNumber(char ch) {
 	return ch >= '0' && ch <= '9';
 }
 
-static int toLower(char ch) {
-	if(ch >= 'A' && ch <= 'Z') return ch - 'A' + 'a';
-	return ch;
-}
-
 //------------------------------------------------------
-Tokenizer::Tokenizer(Reader *r) {
-	this->reader = r;
-	this->linenum = 0;
-	this->nextch = ' ';
-}
-
-void Tokenizer::nextChar() {
-	this->nextch = reader->read();
-	if(nextch == '\n') {
-		linenum++;
-		linebuf.clear();
-	} else if(nextch != EOF) {
-		linebuf.add(nextch);
-	}
+Tokenizer::Tokenizer(const char *src, size_t len, SymbolTable *symtab) {
+	this->begin = src;
+	this->cur = src;
+	this->end = src + len;
+	this->symtab = symtab;
+	this->token = src;
+	this->tokenlen = 0;
 }
 
 TokenType Tokenizer::nextToken() {
-	while(isSpace(nextch)) nextChar();
-	tokenbuf.clear();
-	if(nextch == '(' || nextch == ')') {
-		tokenbuf.add(nextch);
-		TokenType tt = nextch == '(' ? TT_OPEN : TT_CLOSE;
-		nextChar();
-		return tt;
-	} else if(nextch == EOF) {
+	const char *p = cur;
+	while(p < end && (cclass[(unsigned char)*p] & CC_SPACE)) p++;
+	token = p;
+	if(p == end) {
+		cur = p;
+		tokenlen = 0;
 		return TT_EOF;
-	} else {
-		while(!(isSpace(nextch) || nextch == ')' || nextch == '(' || nextch == EOF)) {
-			tokenbuf.add(toLower(nextch));
-			nextChar();
-		}
-		tokenbuf.add('\0');
-		// is integer ?
-		int i = 0, num = 0;
-		bool isint = false;
-		if(tokenbuf.getSize() > 1 && (tokenbuf[0] == '+' || tokenbuf[0] == '-')) i++;
-		for(; i<tokenbuf.getSize()-1; i++) {
-			if(isNumber(tokenbuf[i])) {
-				num = num * 10 + (tokenbuf[i] - '0');
-				isint = true;
-			} else {
-				isint = false;
-				break;
-			}
-		}
-		if(isint) {
-			if(tokenbuf[0] == '-') num = -num;
-			this->ival = num;
-			return TT_INT;
+	}
+	if(*p == '(' || *p == ')') {
+		cur = p + 1;
+		tokenlen = 1;
+		return *p == '(' ? TT_OPEN : TT_CLOSE;
+	}
+	while(p < end && !(cclass[(unsigned char)*p] & CC_DELIM)) p++;
+	cur = p;
+	tokenlen = p - token;
+	// is integer ?
+	int i = 0, num = 0;
+	bool isint = false;
+	if(tokenlen > 1 && (token[0] == '+' || token[0] == '-')) i++;
+	for(; i<tokenlen; i++) {
+		if(isNumber(token[i])) {
+			num = num * 10 + (token[i] - '0');
+			isint = true;
+		} else {
+			isint = false;
+			break;
 		}
-		return TT_STR;
 	}
+	if(isint) {
+		if(token[0] == '-') num = -num;
+		this->ival = num;
+		return TT_INT;
+	}
+	return TT_STR;
 }
 
+const char *Tokenizer::sval() {
+	int i = 0;
+	// a "..." string keeps its case, it cannot hold spaces or parens
+	if(token[0] == '"') return symtab->intern(token, tokenlen);
+	while(i < tokenlen && !(cclass[(unsigned char)token[i]] & CC_UPPER)) i++;
+	if(i == tokenlen) return symtab->intern(token, tokenlen);
+	// symbols are case insensitive
+	char *s = new char[tokenlen];
+	for(i=0; i<tokenlen; i++) {
+		char ch = token[i];
+		s[i] = (cclass[(unsigned char)ch] & CC_UPPER) ? ch - 'A' + 'a' : ch;
+	}
+	const char *atom = symtab->intern(s, tokenlen);
+	delete [] s;
+	return atom;
+}
+
+// the line is found only when an error is printed
 void Tokenizer::printErrorMsg(const char *msg) {
+	int linenum = 0;
+	const char *line = begin;
+	for(const char *p = begin; (p = (const char *)memchr(p, '\n', token - p)) != NULL; p++) {
+		linenum++;
+		line = p + 1;
+	}
+	const char *lend = (const char *)memchr(token, '\n', end - token);
+	if(lend == NULL) lend = end;
 	fprintf(stderr, "parse error(line=%d): %s\n", linenum, msg);
-	linebuf.add('\0');
-	fprintf(stderr, "%s\n", linebuf.getPtr());
-	for(int i=0, j=linebuf.getSize(); i<j; i++) {
+	fprintf(stderr, "%.*s\n", (int)(lend - line), line);
+	for(const char *p = line; p < token; p++) {
 		fprintf(stderr, " ");
 	}
 	fprintf(stderr, "^\n");
@@ -81,32 +111,32 @@ void Tokenizer::printErrorMsg(const char *msg) {
 
 //------------------------------------------------------
 
-bool parseCons(Tokenizer *tk, Cons **res) {
+// cells are allocated from arena and released with it
+bool parseCons(Tokenizer *tk, Arena *arena, Cons **res) {
 	TokenType tt = tk->nextToken();
 	if(tt == TT_OPEN) {
-		Cons *cons = new Cons(CONS_CAR);
+		Cons *cons = new(arena) Cons(CONS_CAR);
 		Cons **c = &cons->car;
-		while(parseCons(tk, c)) {
+		while(parseCons(tk, arena, c)) {
 			if(*c == NULL) {
 				*res = cons;
 				return true;
 			}
 			c = &((*c)->cdr);
 		}
-		cons_free(cons);
 		return false;
 	} else if(tt == TT_CLOSE) {
 		*res = NULL;
 	} else if(tt == TT_INT) {
-		Cons *c = new Cons(CONS_INT);
+		Cons *c = new(arena) Cons(CONS_INT);
 		c->i = tk->ival;
 		*res = c;
 	} else if(tt == TT_FLOAT) {
-		Cons *c = new Cons(CONS_FLOAT);
+		Cons *c = new(arena) Cons(CONS_FLOAT);
 		c->f = tk->fval;
 		*res = c;
 	} else if(tt == TT_STR) {
-		Cons *c = new Cons(CONS_STR);
+		Cons *c = new(arena) Cons(CONS_STR);
 		c->str = tk->sval();
 		*res = c;
 	} else if(tt == TT_EOF) {
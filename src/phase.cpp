@@ -0,0 +1,131 @@
+#include "lisp.h"
+#include <time.h>
+
+__thread int64_t phaseAllocs;
+__thread int64_t phaseAllocBytes;
+
+//------------------------------------------------------
+static const char *phaseNames[PHASE_COUNT] = {
+	"parse", "load", "codegen", "fixpoint", "inline",
+	"strength", "layout", "runcode", "run",
+};
+
+static int64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+PhaseTimer::PhaseTimer() {
+	pthread_mutex_init(&lock, NULL);
+}
+
+PhaseTimer::~PhaseTimer() {
+	pthread_mutex_destroy(&lock);
+}
+
+void PhaseTimer::start(PhaseClock *c, int len) {
+	c->allocs = phaseAllocs;
+	c->bytes = phaseAllocBytes;
+	c->len = len;
+	c->ns = nowNs();
+}
+
+// len is the code length after the phase, -1 if none
+void PhaseTimer::end(PhaseClock *c, const char *name, Phase phase, int len) {
+	PhaseRow r;
+	r.ns = nowNs() - c->ns;
+	r.allocs = phaseAllocs - c->allocs;
+	r.bytes = phaseAllocBytes - c->bytes;
+	r.name = name;
+	r.phase = phase;
+	r.before = c->len;
+	r.after = len;
+	pthread_mutex_lock(&lock);
+	r.seq = rows.getSize();
+	rows.add(r);
+	pthread_mutex_unlock(&lock);
+}
+
+// the defun name, or "#n head" for the n-th top-level form
+const char *PhaseTimer::formName(Cons *cons, const char *defunAtom, int n) {
+	if(isDefunForm(cons, defunAtom)) return cons->car->cdr->str;
+	const char *head = cons->type == CONS_CAR && cons->car != NULL &&
+		cons->car->type == CONS_STR ? cons->car->str : "";
+	pthread_mutex_lock(&lock);
+	char *s = new(&labels) char[strlen(head) + 16];
+	pthread_mutex_unlock(&lock);
+	sprintf(s, "#%d %s", n, head);
+	return s;
+}
+
+//------------------------------------------------------
+// report, the rows of each form together in the order they were added
+
+static int cmpRow(const void *a, const void *b) {
+	const PhaseRow *x = (const PhaseRow *)a, *y = (const PhaseRow *)b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq ? 1 : 0;
+}
+
+static void printLen(FILE *fp, int before, int after) {
+	if(after < 0) {
+		fprintf(fp, "\n");
+		return;
+	}
+	if(before < 0) {
+		fprintf(fp, " %7s -> %6d\n", "", after);
+	} else if(before != 0 && after != before) {
+		fprintf(fp, " %7d -> %6d  x%.2f\n", before, after, (double)after / before);
+	} else {
+		fprintf(fp, " %7d -> %6d\n", before, after);
+	}
+}
+
+void PhaseTimer::printReport(FILE *fp) {
+	pthread_mutex_lock(&lock);
+	int n = rows.getSize();
+	// seq becomes the group of the name, then the position in it
+	AtomMap<int> group; /* first row + 1 */
+	for(int i=0; i<n; i++) {
+		int g = group.get(rows[i].name);
+		if(g == 0) group.put(rows[i].name, g = i + 1);
+		rows[i].seq = (int64_t)(g - 1) * n + i;
+	}
+	PhaseRow *r = rows.getPtr();
+	qsort(r, n, sizeof(PhaseRow), cmpRow);
+	PhaseRow total[PHASE_COUNT];
+	int count[PHASE_COUNT];
+	memset(total, 0, sizeof(total));
+	memset(count, 0, sizeof(count));
+	fprintf(fp, "---- phases ----\n");
+	fprintf(fp, "%-20s %-9s %10s %8s %10s %7s    %6s\n",
+			"form", "phase", "ms", "allocs", "bytes", "len", "len");
+	for(int i=0; i<n; i++) {
+		const char *name = i == 0 || r[i].name != r[i-1].name ? r[i].name : "";
+		fprintf(fp, "%-20s %-9s %10.3f %8lld %10lld", name, phaseNames[r[i].phase],
+				r[i].ns / 1e6, (long long)r[i].allocs, (long long)r[i].bytes);
+		printLen(fp, r[i].before, r[i].after);
+		PhaseRow *t = &total[r[i].phase];
+		count[r[i].phase]++;
+		t->ns += r[i].ns;
+		t->allocs += r[i].allocs;
+		t->bytes += r[i].bytes;
+		if(r[i].before > 0) t->before += r[i].before;
+		if(r[i].after > 0) t->after += r[i].after;
+	}
+	fprintf(fp, "---- phase totals ----\n");
+	fprintf(fp, "%-9s %6s %10s %8s %10s %7s    %6s\n",
+			"phase", "count", "ms", "allocs", "bytes", "len", "len");
+	int64_t ns = 0;
+	for(int p=0; p<PHASE_COUNT; p++) {
+		PhaseRow *t = &total[p];
+		if(count[p] == 0) continue;
+		ns += t->ns;
+		fprintf(fp, "%-9s %6d %10.3f %8lld %10lld", phaseNames[p], count[p],
+				t->ns / 1e6, (long long)t->allocs, (long long)t->bytes);
+		printLen(fp, t->before != 0 ? t->before : -1, t->after != 0 ? t->after : -1);
+	}
+	fprintf(fp, "%-9s %6s %10.3f\n", "total", "", ns / 1e6);
+	pthread_mutex_unlock(&lock);
+}
+
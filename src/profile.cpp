@@ -0,0 +1,297 @@
+#include "lisp.h"
+
+//------------------------------------------------------
+// branch profile
+// the counts are taken from the final code of a function, which
+// opt_layout leaves as it is, so a profile matches only the same code.
+// a laid out function runs other code and is not counted
+
+static int countBranches(Func *func) {
+	int n = 0;
+	for(Code *pc = func->code; pc->i != INS_END; pc += getOpSize(pc->i)) {
+		if(isCondJmpOp(pc->i) || isCondJmpCOp(pc->i)) n++;
+	}
+	return n;
+}
+
+Profile::Profile() {
+#ifdef USING_PROFILE
+	pthread_mutex_init(&lock, NULL);
+#endif
+}
+
+static void freeBranchProfiles(ArrayBuilder<BranchProfile> *a) {
+	for(int i=0, j=a->getSize(); i<j; i++) {
+		delete [] (*a)[i].name;
+		delete [] (*a)[i].counts;
+	}
+}
+
+Profile::~Profile() {
+	freeBranchProfiles(&profs);
+#ifdef USING_PROFILE
+	freeBranchProfiles(&retired);
+	for(int i=0, j=stats.getSize(); i<j; i++) {
+		delete [] stats[i]->funcs;
+		delete stats[i];
+	}
+	pthread_mutex_destroy(&lock);
+#endif
+}
+
+// format: name codeLength nbranch taken0 nottaken0 taken1 ...
+bool Profile::load(const char *fname) {
+	FILE *fp = fopen(fname, "r");
+	if(fp == NULL) {
+		fprintf(stderr, "file open error: %s\n", fname);
+		return false;
+	}
+	char name[256];
+	BranchProfile bp;
+	while(fscanf(fp, "%255s %d %d", name, &bp.codeLength, &bp.nbranch) == 3) {
+		if(bp.nbranch < 0) break;
+		bp.counts = new int64_t[bp.nbranch * 2];
+		bool ok = true;
+		for(int i=0; i<bp.nbranch * 2; i++) {
+			long long n;
+			if(fscanf(fp, "%lld", &n) != 1) { ok = false; break; }
+			bp.counts[i] = n;
+		}
+		if(!ok) {
+			delete [] bp.counts;
+			break;
+		}
+		char *s = new char[strlen(name) + 1];
+		strcpy(s, name);
+		bp.name = s;
+		profs.add(bp);
+	}
+	bool res = feof(fp);
+	if(!res) fprintf(stderr, "profile format error: %s\n", fname);
+	fclose(fp);
+	return res;
+}
+
+const int64_t *Profile::getBranchCounts(Func *func) {
+	int n = -1;
+	for(int i=0, j=profs.getSize(); i<j; i++) {
+		BranchProfile *bp = &profs[i];
+		if(bp->codeLength != func->codeLength || strcmp(bp->name, func->name) != 0) continue;
+		if(n == -1) n = countBranches(func);
+		if(bp->nbranch != n) continue;
+		for(int k=0; k<n*2; k++) {
+			if(bp->counts[k] != 0) return bp->counts;
+		}
+	}
+	return NULL;
+}
+
+#ifdef USING_PROFILE
+//------------------------------------------------------
+// instrumented build
+
+void Profile::addFunc(Func *func) {
+	func->brcount = new int64_t[func->codeLength * 2];
+	memset(func->brcount, 0, sizeof(int64_t) * func->codeLength * 2);
+	pthread_mutex_lock(&lock);
+	funcs.add(func);
+	int i = funcs.getSize() - 1;
+	for(; i > 0 && funcs[i-1]->runcode > func->runcode; i--) {
+		funcs[i] = funcs[i-1];
+	}
+	funcs[i] = func;
+	pthread_mutex_unlock(&lock);
+}
+
+static BranchProfile toBranchProfile(Func *func) {
+	BranchProfile bp;
+	char *s = new char[strlen(func->name) + 1];
+	strcpy(s, func->name);
+	bp.name = s;
+	bp.codeLength = func->codeLength;
+	bp.nbranch = countBranches(func);
+	bp.counts = new int64_t[bp.nbranch * 2];
+	int k = 0;
+	for(int pc=0; func->code[pc].i != INS_END; pc += getOpSize(func->code[pc].i)) {
+		int op = func->code[pc].i;
+		if(isCondJmpOp(op) || isCondJmpCOp(op)) {
+			bp.counts[k++] = func->brcount[pc * 2];
+			bp.counts[k++] = func->brcount[pc * 2 + 1];
+		}
+	}
+	return bp;
+}
+
+static void writeBranchProfile(FILE *fp, BranchProfile *bp) {
+	fprintf(fp, "%s %d %d", bp->name, bp->codeLength, bp->nbranch);
+	for(int k=0; k<bp->nbranch * 2; k++) {
+		fprintf(fp, " %lld", (long long)bp->counts[k]);
+	}
+	fprintf(fp, "\n");
+}
+
+// the counts of a replaced code are kept until save
+void Profile::removeFunc(Func *func) {
+	if(func->brcount == NULL) return;
+	pthread_mutex_lock(&lock);
+	int n = funcs.getSize();
+	for(int i=0; i<n; i++) {
+		if(funcs[i] == func) {
+			for(; i<n-1; i++) funcs[i] = funcs[i+1];
+			funcs.truncate(n - 1);
+			break;
+		}
+	}
+	retired.add(toBranchProfile(func));
+	pthread_mutex_unlock(&lock);
+	delete [] func->brcount;
+	func->brcount = NULL;
+}
+
+bool Profile::countBranch(Code *pc, bool taken) {
+	pthread_mutex_lock(&lock);
+	int lo = 0, hi = funcs.getSize();
+	while(hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		if(funcs[mid]->runcode <= pc) lo = mid; else hi = mid;
+	}
+	if(lo < hi) {
+		Func *f = funcs[lo];
+		int off = pc - f->runcode;
+		if(off >= 0 && off < f->runLength) {
+			f->brcount[off * 2 + (taken ? 0 : 1)]++;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return taken;
+}
+
+bool Profile::save(const char *fname) {
+	FILE *fp = fopen(fname, "w");
+	if(fp == NULL) {
+		fprintf(stderr, "file open error: %s\n", fname);
+		return false;
+	}
+	for(int i=0, j=retired.getSize(); i<j; i++) {
+		writeBranchProfile(fp, &retired[i]);
+	}
+	for(int i=0, j=funcs.getSize(); i<j; i++) {
+		BranchProfile bp = toBranchProfile(funcs[i]);
+		writeBranchProfile(fp, &bp);
+		delete [] bp.name;
+		delete [] bp.counts;
+	}
+	fclose(fp);
+	return true;
+}
+
+//------------------------------------------------------
+// execution counters
+
+int Profile::newFuncId(const char *name) {
+	pthread_mutex_lock(&lock);
+	int id = funcnames.getSize();
+	funcnames.add(name);
+	pthread_mutex_unlock(&lock);
+	return id;
+}
+
+VMStat *Profile::newStat() {
+	VMStat *s = new VMStat();
+	memset(s->opcount, 0, sizeof(s->opcount));
+	s->funcs = NULL;
+	s->nfuncs = 0;
+	pthread_mutex_lock(&lock);
+	stats.add(s);
+	pthread_mutex_unlock(&lock);
+	return s;
+}
+
+// only the owner worker calls this
+void VMStat::grow(int id) {
+	int n = nfuncs == 0 ? 64 : nfuncs;
+	while(n <= id) n *= 2;
+	FuncStat *f = new FuncStat[n];
+	memset(f, 0, sizeof(FuncStat) * n);
+	if(funcs != NULL) memcpy(f, funcs, sizeof(FuncStat) * nfuncs);
+	delete [] funcs;
+	funcs = f;
+	nfuncs = n;
+}
+
+struct ReportLine {
+	const char *name;
+	int64_t count;
+	FuncStat fs;
+};
+
+static int cmpReportLine(const void *a, const void *b) {
+	const ReportLine *x = (const ReportLine *)a, *y = (const ReportLine *)b;
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+#define REPORT_FUNC_MAX 40
+
+// call when the workers are idle
+void Profile::printReport(Context *ctx, FILE *fp) {
+	int64_t total = 0;
+	ReportLine *ops = new ReportLine[INS_COUNT];
+	for(int op=0; op<INS_COUNT; op++) {
+		ops[op].name = ctx->getInstName(op);
+		ops[op].count = 0;
+		for(int i=0, j=stats.getSize(); i<j; i++) ops[op].count += stats[i]->opcount[op];
+		total += ops[op].count;
+	}
+	qsort(ops, INS_COUNT, sizeof(ReportLine), cmpReportLine);
+	double pct = total != 0 ? 100.0 / total : 0;
+	fprintf(fp, "---- profile: %lld instructions ----\n", (long long)total);
+	fprintf(fp, "%-16s %14s %6s\n", "opcode", "count", "%");
+	for(int op=0; op<INS_COUNT && ops[op].count != 0; op++) {
+		fprintf(fp, "%-16s %14lld %6.2f\n", ops[op].name, (long long)ops[op].count,
+				pct * ops[op].count);
+	}
+	delete [] ops;
+
+	// redefined functions and the top-level forms are added by name
+	int n = funcnames.getSize();
+	ReportLine *funcs = new ReportLine[n];
+	AtomMap<int> index; /* line + 1 */
+	int nlines = 0;
+	for(int id=0; id<n; id++) {
+		FuncStat fs;
+		memset(&fs, 0, sizeof(fs));
+		for(int i=0, j=stats.getSize(); i<j; i++) {
+			if(id >= stats[i]->nfuncs) continue;
+			FuncStat *s = &stats[i]->funcs[id];
+			fs.calls += s->calls;
+			fs.spawns += s->spawns;
+			fs.self += s->self;
+			fs.total += s->total;
+		}
+		if(fs.self == 0 && fs.calls == 0 && fs.spawns == 0) continue;
+		int k = index.get(funcnames[id]) - 1;
+		if(k == -1) {
+			k = nlines++;
+			index.put(funcnames[id], k + 1);
+			funcs[k].name = funcnames[id];
+			memset(&funcs[k].fs, 0, sizeof(FuncStat));
+		}
+		funcs[k].fs.calls += fs.calls;
+		funcs[k].fs.spawns += fs.spawns;
+		funcs[k].fs.self += fs.self;
+		funcs[k].fs.total += fs.total;
+		funcs[k].count = funcs[k].fs.self;
+	}
+	qsort(funcs, nlines, sizeof(ReportLine), cmpReportLine);
+	fprintf(fp, "%-16s %12s %12s %14s %6s %14s %6s\n", "function", "calls", "spawns",
+			"self", "%", "total", "%");
+	for(int i=0; i<nlines && i<REPORT_FUNC_MAX; i++) {
+		FuncStat *fs = &funcs[i].fs;
+		fprintf(fp, "%-16s %12lld %12lld %14lld %6.2f %14lld %6.2f\n", funcs[i].name,
+				(long long)fs->calls, (long long)fs->spawns,
+				(long long)fs->self, pct * fs->self,
+				(long long)fs->total, pct * fs->total);
+	}
+	delete [] funcs;
+}
+#endif
@@ -0,0 +1,390 @@
+#include "lisp.h"
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define EPOCH_MAX INT64_MAX
+
+// read by the signal handler
+static volatile int64_t sampleEpoch;
+static __thread WorkerThread *sampleWth;
+
+//------------------------------------------------------
+// signal handler, async signal safe
+
+// callee saved registers first, the vm keeps pc and sp in them
+static int getRegs(void *uc, uintptr_t *regs) {
+	int n = 0;
+#if defined(__x86_64__)
+	static const int order[] = {
+		REG_RBX, REG_RBP, REG_R12, REG_R13, REG_R14, REG_R15,
+		REG_R8, REG_R9, REG_R10, REG_R11, REG_RDI, REG_RSI,
+		REG_RDX, REG_RAX, REG_RCX,
+	};
+	greg_t *g = ((ucontext_t *)uc)->uc_mcontext.gregs;
+	for(int i=0; i<(int)(sizeof(order) / sizeof(order[0])); i++) {
+		regs[n++] = (uintptr_t)g[order[i]];
+	}
+#elif defined(__aarch64__)
+	uint64_t *g = (uint64_t *)((ucontext_t *)uc)->uc_mcontext.regs;
+	for(int i=19; i<=28; i++) regs[n++] = g[i];
+	for(int i=0; i<6; i++) regs[n++] = g[i];
+#endif
+	return n;
+}
+
+// v links down to the bottom of the task stack
+static bool isFrame(Value *bottom, Value *v) {
+	for(int n=0; v != bottom; n++) {
+		Value *prev = v[-2].sp;
+		if(prev < bottom || prev >= v || n > TASK_STACKSIZE / 2) return false;
+		v = prev;
+	}
+	return true;
+}
+
+static void takeSample(StackSample *s, Task *t, void *uc) {
+	s->epoch = sampleEpoch;
+	s->task = t;
+	s->nregs = 0;
+	s->depth = 0;
+	s->truncated = false;
+	if(t == NULL) return;
+	uintptr_t regs[SAMPLE_REGS];
+	int n = getRegs(uc, regs);
+	Value *bottom = t->stack + 2;
+	Value *top = t->stack + TASK_STACKSIZE;
+	Value *sp = NULL;
+	for(int i=0; i<n; i++) {
+		Value *v = (Value *)regs[i];
+		if(v >= bottom && v < top) {
+			if((regs[i] - (uintptr_t)bottom) % sizeof(Value) == 0 &&
+					v > sp && isFrame(bottom, v)) sp = v;
+		} else if(regs[i] >= 4096 && regs[i] % sizeof(Code) == 0) {
+			s->regs[s->nregs++] = regs[i];
+		}
+	}
+	for(; sp != NULL && sp != bottom; sp = sp[-2].sp) {
+		if(s->depth == SAMPLE_DEPTH) {
+			s->truncated = true;
+			break;
+		}
+		s->retpc[s->depth++] = sp[-1].pc;
+	}
+}
+
+static void sampleHandler(int, siginfo_t *, void *uc) {
+	WorkerThread *wth = sampleWth;
+	if(wth == NULL || wth->samples == NULL) return;
+	SampleBuf *b = wth->samples;
+	if(!b->running) return;
+	if(b->count == SAMPLE_MAX) {
+		// keep every other sample and sample half as often
+		for(int i=0; i<SAMPLE_MAX / 2; i++) b->samples[i] = b->samples[i * 2];
+		b->count = SAMPLE_MAX / 2;
+		b->interval *= 2;
+		struct itimerspec its;
+		its.it_value.tv_sec = its.it_interval.tv_sec = b->interval / 1000000000;
+		its.it_value.tv_nsec = its.it_interval.tv_nsec = b->interval % 1000000000;
+		timer_settime(b->timer, 0, &its, NULL);
+	}
+	takeSample(&b->samples[b->count], wth->curtask, uc);
+	b->count++;
+}
+
+//------------------------------------------------------
+Sampler::Sampler(int interval_us) {
+	interval = (int64_t)interval_us * 1000;
+	pthread_mutex_init(&lock, NULL);
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sampleHandler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+}
+
+Sampler::~Sampler() {
+	stop();
+	for(int i=0, j=bufs.getSize(); i<j; i++) {
+		delete [] bufs[i]->samples;
+		delete bufs[i];
+	}
+	for(int i=0, j=ranges.getSize(); i<j; i++) {
+		if(ranges[i].saved != NULL) delete [] ranges[i].saved;
+	}
+	pthread_mutex_destroy(&lock);
+}
+
+void Sampler::addCode(Func *func) {
+	CodeRange r;
+	r.begin = func->runcode;
+	r.end = r.begin + func->runLength;
+	r.name = func->name;
+	r.saved = NULL;
+	pthread_mutex_lock(&lock);
+	r.from = ++sampleEpoch;
+	r.to = EPOCH_MAX;
+	ranges.add(r);
+	pthread_mutex_unlock(&lock);
+}
+
+// the range is kept for the samples taken before
+void Sampler::removeCode(Func *func) {
+	Code *code = func->runcode;
+	pthread_mutex_lock(&lock);
+	sampleEpoch++;
+	for(int i=ranges.getSize()-1; i>=0; i--) {
+		CodeRange *r = &ranges[i];
+		if(r->begin == code && r->to == EPOCH_MAX) {
+			r->to = sampleEpoch;
+			r->saved = new Code[r->end - r->begin];
+			memcpy(r->saved, code, sizeof(Code) * (r->end - r->begin));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// called by each worker when it starts
+void Sampler::startThread(WorkerThread *wth) {
+	SampleBuf *b = new SampleBuf();
+	b->samples = new StackSample[SAMPLE_MAX];
+	b->count = 0;
+	b->interval = interval;
+	b->running = true;
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+	if(timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &b->timer) == -1) {
+		fprintf(stderr, "timer_create failed, worker %d is not sampled\n", wth->id);
+		delete [] b->samples;
+		delete b;
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	bufs.add(b);
+	pthread_mutex_unlock(&lock);
+	sampleWth = wth;
+	wth->samples = b;
+	struct itimerspec its;
+	its.it_value.tv_sec = its.it_interval.tv_sec = interval / 1000000000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = interval % 1000000000;
+	timer_settime(b->timer, 0, &its, NULL);
+}
+
+// stop the timers before reading the samples
+void Sampler::stop() {
+	pthread_mutex_lock(&lock);
+	for(int i=0, j=bufs.getSize(); i<j; i++) {
+		if(!bufs[i]->running) continue;
+		timer_delete(bufs[i]->timer);
+		bufs[i]->running = false;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+//------------------------------------------------------
+// report
+
+static int cmpRange(const void *a, const void *b) {
+	const CodeRange *x = (const CodeRange *)a, *y = (const CodeRange *)b;
+	return x->begin < y->begin ? -1 : x->begin > y->begin ? 1 : 0;
+}
+
+// ranges are sorted by begin
+CodeRange *Sampler::lookup(uintptr_t addr, int64_t epoch) {
+	Code *pc = (Code *)addr;
+	int lo = 0, hi = ranges.getSize();
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(ranges[mid].begin <= pc) lo = mid + 1; else hi = mid;
+	}
+	// freed code may be reused by a later function
+	for(int i=lo-1; i>=0 && i>=lo-64; i--) {
+		CodeRange *r = &ranges[i];
+		if(pc < r->end && epoch >= r->from && epoch < r->to &&
+				(addr - (uintptr_t)r->begin) % sizeof(Code) == 0) return r;
+	}
+	return NULL;
+}
+
+// the first pc candidate in a live code range
+const char *Sampler::leafName(StackSample *s, CodeRange **range, int *offset) {
+	*range = NULL;
+	if(s->task == NULL) return "[scheduler]";
+	for(int i=0; i<s->nregs; i++) {
+		CodeRange *r = lookup(s->regs[i], s->epoch);
+		if(r != NULL) {
+			*range = r;
+			*offset = (Code *)s->regs[i] - r->begin;
+			return r->name;
+		}
+	}
+	return "[vm]";
+}
+
+struct SampleLine {
+	const char *name;
+	CodeRange *range; /* of the pc */
+	int offset;
+	int64_t self;
+	int64_t total;
+	StackSample *last; /* counted in total */
+};
+
+static int cmpSampleLine(const void *a, const void *b) {
+	const SampleLine *x = (const SampleLine *)a, *y = (const SampleLine *)b;
+	return x->self < y->self ? 1 : x->self > y->self ? -1 : 0;
+}
+
+static const char *opName(Context *ctx, CodeRange *r, int offset) {
+	if(r == NULL) return "-";
+	Code *pc = (r->saved != NULL ? r->saved : r->begin) + offset;
+#ifdef USING_THCODE
+	for(int op=0; op<INS_COUNT; op++) {
+		if(ctx->jmptable[op] == pc->ptr) return ctx->getInstName(op);
+	}
+	return "-";
+#else
+	return pc->i >= 0 && pc->i < INS_COUNT ? ctx->getInstName(pc->i) : "-";
+#endif
+}
+
+// name of the frame d of s, -1 is the leaf
+const char *Sampler::frameName(StackSample *s, int d) {
+	if(d == -1) {
+		CodeRange *r;
+		int offset;
+		return leafName(s, &r, &offset);
+	}
+	CodeRange *r = lookup((uintptr_t)s->retpc[d], s->epoch);
+	return r != NULL ? r->name : "[vm]";
+}
+
+void Sampler::prepare() {
+	stop();
+	qsort(ranges.getPtr(), ranges.getSize(), sizeof(CodeRange), cmpRange);
+}
+
+#define REPORT_LINE_MAX 30
+
+// flat profile by function and by pc
+void Sampler::printReport(Context *ctx, FILE *fp) {
+	prepare();
+	int64_t nsamples = 0;
+	int64_t nresolved = 0;
+	int64_t maxinterval = 0;
+	ArrayBuilder<SampleLine> funcs;
+	ArrayBuilder<SampleLine> pcs;
+	AtomMap<int> funcidx; /* line + 1 */
+	for(int k=0, m=bufs.getSize(); k<m; k++) {
+		SampleBuf *b = bufs[k];
+		if(b->interval > maxinterval) maxinterval = b->interval;
+		nsamples += b->count;
+		for(int i=0; i<b->count; i++) {
+			StackSample *s = &b->samples[i];
+			for(int d=-1; d<s->depth; d++) {
+				const char *fn = frameName(s, d);
+				int n = funcidx.get(fn) - 1;
+				if(n == -1) {
+					SampleLine l = { fn, NULL, 0, 0, 0, NULL };
+					funcs.add(l);
+					n = funcs.getSize() - 1;
+					funcidx.put(fn, n + 1);
+				}
+				if(d == -1) funcs[n].self++;
+				// recursive frames count once
+				if(funcs[n].last != s) {
+					funcs[n].last = s;
+					funcs[n].total++;
+				}
+			}
+			CodeRange *leaf;
+			int offset = 0;
+			const char *name = leafName(s, &leaf, &offset);
+			if(leaf == NULL) continue;
+			nresolved++;
+			int j = pcs.getSize() - 1;
+			for(; j>=0; j--) {
+				if(pcs[j].range == leaf && pcs[j].offset == offset) break;
+			}
+			if(j < 0) {
+				SampleLine l = { name, leaf, offset, 0, 0, NULL };
+				pcs.add(l);
+				j = pcs.getSize() - 1;
+			}
+			pcs[j].self++;
+		}
+	}
+	double pct = nsamples != 0 ? 100.0 / nsamples : 0;
+	fprintf(fp, "---- samples: %lld (%.1f%% in code), interval %lld us ----\n",
+			(long long)nsamples, pct * nresolved, (long long)(maxinterval / 1000));
+	qsort(funcs.getPtr(), funcs.getSize(), sizeof(SampleLine), cmpSampleLine);
+	fprintf(fp, "%-16s %10s %6s %10s %6s\n", "function", "self", "%", "total", "%");
+	for(int i=0; i<funcs.getSize() && i<REPORT_LINE_MAX; i++) {
+		SampleLine *l = &funcs[i];
+		fprintf(fp, "%-16s %10lld %6.2f %10lld %6.2f\n", l->name, (long long)l->self,
+				pct * l->self, (long long)l->total, pct * l->total);
+	}
+	qsort(pcs.getPtr(), pcs.getSize(), sizeof(SampleLine), cmpSampleLine);
+	fprintf(fp, "%-16s %6s %-12s %10s %6s\n", "function", "pc", "op", "self", "%");
+	for(int i=0; i<pcs.getSize() && i<REPORT_LINE_MAX; i++) {
+		SampleLine *l = &pcs[i];
+		fprintf(fp, "%-16s %6d %-12s %10lld %6.2f\n", l->name, l->offset,
+				opName(ctx, l->range, l->offset), (long long)l->self, pct * l->self);
+	}
+}
+
+//------------------------------------------------------
+// collapsed stacks, root first: "main;fib;fib 12"
+
+static int cmpStr(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+bool Sampler::writeStacks(const char *fname) {
+	FILE *fp = fopen(fname, "w");
+	if(fp == NULL) {
+		fprintf(stderr, "cannot open %s\n", fname);
+		return false;
+	}
+	prepare();
+	ArrayBuilder<char *> lines(1024);
+	for(int k=0, m=bufs.getSize(); k<m; k++) {
+		SampleBuf *b = bufs[k];
+		for(int i=0; i<b->count; i++) {
+			StackSample *s = &b->samples[i];
+			size_t len = 0;
+			const char *names[SAMPLE_DEPTH + 1];
+			int n = 0;
+			for(int d=s->depth-1; d>=-1; d--) {
+				names[n] = frameName(s, d);
+				len += strlen(names[n++]) + 1;
+			}
+			char *line = new char[len + 8];
+			char *p = line;
+			if(s->truncated) p += sprintf(p, "...;");
+			for(int j=0; j<n; j++) {
+				p += sprintf(p, j == 0 ? "%s" : ";%s", names[j]);
+			}
+			lines.add(line);
+		}
+	}
+	qsort(lines.getPtr(), lines.getSize(), sizeof(char *), cmpStr);
+	for(int i=0, j=lines.getSize(); i<j; ) {
+		int n = i + 1;
+		while(n < j && strcmp(lines[i], lines[n]) == 0) n++;
+		fprintf(fp, "%s %d\n", lines[i], n - i);
+		i = n;
+	}
+	for(int i=0, j=lines.getSize(); i<j; i++) delete [] lines[i];
+	fclose(fp);
+	return true;
+}
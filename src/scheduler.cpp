@@ -5,9 +5,14 @@ static void *WorkerThread_main(void *arg) {
 	Scheduler *sche = wth->sche;
 	Context *ctx = sche->getCtx();
 	Task *task;
+	if(ctx->sampler != NULL) ctx->sampler->startThread(wth);
 	while((task = sche->dequeue()) != NULL) {
-		assert(task->stat == TASK_RUN);
+		assert(task->stat != TASK_END);
+		wth->curtask = task;
+		ctx->heap->enter();
 		vmrun(ctx, wth, task);
+		ctx->heap->leave();
+		wth->curtask = NULL;
 	}
 	return NULL;
 }
@@ -19,9 +24,10 @@ Scheduler::Scheduler(Context *ctx) {
 	this->taskDeqIndex = 0;
 	this->dead_flag = false;
 	this->waitCount = 0;
+	this->live = 0;
 	pthread_mutex_init(&tl_lock, NULL);
 	pthread_cond_init(&tl_cond, NULL);
-	pthread_cond_init(&tl_maincond, NULL);
+	pthread_cond_init(&tl_donecond, NULL);
 }
 
 Scheduler::~Scheduler() {
@@ -33,6 +39,7 @@ Scheduler::~Scheduler() {
 		WorkerThread *wth = &wthpool[i];
 		pthread_join(wth->pth, NULL);
 		pthread_detach(wth->pth);
+		delete [] wth->out.buf;
 	}
 	delete [] wthpool;
 	delete [] taskpool;
@@ -52,6 +59,7 @@ void Scheduler::initWorkers() {
 	freelist = &taskpool[0];
 	for(int i=0; i<TASK_MAX; i++) {
 		taskpool[i].next = &taskpool[i+1];
+		taskpool[i].stat = TASK_FREE;
 	}
 	taskpool[TASK_MAX - 1].next = NULL;
 	// init endcode
@@ -67,13 +75,37 @@ void Scheduler::initWorkers() {
 		wth->ctx = ctx;
 		wth->sche = this;
 		wth->id = i;
+		wth->curtask = NULL;
+		wth->samples = NULL;
+		initOutBuf(&wth->out);
+#ifdef USING_PROFILE
+		wth->stat = ctx->prof->newStat();
+#endif
+		ctx->heap->addThread(wth);
 		pthread_create(&wth->pth, NULL, WorkerThread_main, wth);
 	}
 }
 
 //------------------------------------------------------
+// the pool tasks always fit in the queue. the root tasks of the threads
+// outside the pool (lisp_call, callers, forms) are not bounded, the
+// queue doubles when they fill it. called with tl_lock
+void Scheduler::growQueue() {
+	int size = queuemask + 1;
+	Task **q = new Task *[size * 2];
+	for(int i=0; i<size; i++) {
+		q[i] = taskq[(taskDeqIndex + i) & queuemask];
+	}
+	delete [] taskq;
+	taskq = q;
+	queuemask = size * 2 - 1;
+	taskDeqIndex = 0;
+	taskEnqIndex = size;
+}
+
 void Scheduler::enqueue(Task *task) {
 	pthread_mutex_lock(&tl_lock);
+	if(taskEnqIndex - taskDeqIndex > queuemask) growQueue();
 	int n = taskEnqIndex++;
 	taskq[n & queuemask] = task;
 	if(waitCount != 0) {
@@ -89,9 +121,6 @@ Task *Scheduler::dequeue() {
 		while(taskEnqIndex == taskDeqIndex) {
 			if(dead_flag) goto L_FINAL;
 			waitCount++;
-			if(waitCount == ctx->workers) {
-				pthread_cond_signal(&tl_maincond);
-			}
 			pthread_cond_wait(&tl_cond, &tl_lock); /* wait task enqueue */
 			waitCount--;
 		}
@@ -104,41 +133,86 @@ L_FINAL:
 }
 	
 //------------------------------------------------------
-void Scheduler::enqueueWaitFor(Task *task) {
-	//enqueue(task);
-	pthread_mutex_lock(&tl_lock);
-	// FIXME: COPIPE from euqueue
-	int n = taskEnqIndex++;
-	taskq[n & queuemask] = task;
-	pthread_cond_signal(&tl_cond);
-	pthread_cond_wait(&tl_maincond, &tl_lock);
-	pthread_mutex_unlock(&tl_lock);
+// runs a root task from a thread outside the pool and waits for it.
+// several threads may run one at a time. out: where the task and its
+// spawns print, ctx->out if NULL
+void Scheduler::runWait(Func *func, Value *args, FILE *out, Value *ret) {
+	// the pool may be used up by spawns and other callers
+	Task *task = newTask(func, args);
+	bool pooled = task != NULL;
+	if(!pooled) {
+		task = new Task();
+		initTask(task, func, args);
+	}
+	if(out != NULL) task->outfp = out;
+	enqueue(task);
+	waitTask(task);
+	if(ret != NULL) *ret = task->stack[0];
+	if(pooled) deleteTask(task);
+	else delete task;
 }
 
 //------------------------------------------------------
+// also for tasks outside the pool
+void Scheduler::initTask(Task *task, Func *func, Value *args) {
+	ATOMIC_ADD(live, 1); // before runcode is read
+	task->pc = func->runcode;
+	task->sp = task->stack + 2;
+	task->sp[-1].pc = &endcode;
+	task->stat = TASK_RUN;
+	task->token = NULL;
+	task->child = NULL;
+	task->claims = NULL;
+	task->outfp = ctx->out;
+	task->out = NULL;
+	task->pieces = NULL;
+	task->outpos = -1;
+	task->nspawn = 0;
+#ifdef USING_PROFILE
+	task->icount = 0;
+	task->pdepth = 1;
+	task->pframes[0].func = func;
+	task->pframes[0].start = 0;
+	task->pframes[0].outer = true;
+#endif
+	memcpy(task->sp, args, func->argc * sizeof(Value));
+}
+
 Task *Scheduler::newTask(Func *func, Value *args) {
 	Task *oldtop = freelist;
 	if(oldtop != NULL) {
 		Task *newtop = oldtop->next;
 		if(CAS(freelist, oldtop, newtop)) {
-			// init
-			Task *task = oldtop;
-#ifdef USING_THCODE
-			task->pc = func->thcode;
-#else
-			task->pc = func->code;
-#endif
-			task->sp = task->stack + 2;
-			task->sp[-1].pc = &endcode;
-			task->stat = TASK_RUN;
-			memcpy(task->sp, args, func->argc * sizeof(Value));
-			return task;
+			initTask(oldtop, func, args);
+			return oldtop;
 		}
 	}
 	return NULL;
 }
 
+// for a root task started outside the pool. END sets TASK_END with a
+// CAS, or calls endTask if the waiter got there first
+void Scheduler::waitTask(Task *task) {
+	// pairs with the CAS in END, the result is visible after it
+	if(__atomic_load_n(&task->stat, __ATOMIC_ACQUIRE) == TASK_END) return;
+	pthread_mutex_lock(&tl_lock);
+	if(CAS(task->stat, TASK_RUN, TASK_WAIT)) {
+		while(task->stat != TASK_END) {
+			pthread_cond_wait(&tl_donecond, &tl_lock);
+		}
+	}
+	pthread_mutex_unlock(&tl_lock);
+}
+
+void Scheduler::endTask(Task *task) {
+	pthread_mutex_lock(&tl_lock);
+	task->stat = TASK_END;
+	pthread_cond_broadcast(&tl_donecond);
+	pthread_mutex_unlock(&tl_lock);
+}
+
 void Scheduler::deleteTask(Task *task) {
+	task->stat = TASK_FREE;
 	while(true) {
 		Task *oldtop = freelist;
 		task->next = oldtop;
@@ -146,3 +220,16 @@ void Scheduler::deleteTask(Task *task) {
 	}
 }
 
+// the pool tasks in use and the queued ones, for the cons heap. the
+// threads running tasks are stopped
+void Scheduler::getTasks(ArrayBuilder<Task *> *tasks) {
+	int n = ctx->workers * 2;
+	for(int i=0; i<n; i++) {
+		if(taskpool[i].stat != TASK_FREE) tasks->add(&taskpool[i]);
+	}
+	pthread_mutex_lock(&tl_lock);
+	for(int i=taskDeqIndex; i!=taskEnqIndex; i++) {
+		tasks->add(taskq[i & queuemask]);
+	}
+	pthread_mutex_unlock(&tl_lock);
+}
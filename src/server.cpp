@@ -0,0 +1,184 @@
+#include "lisp.h"
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//------------------------------------------------------
+// evaluation server (-server path): one context and worker pool for
+// every connection. a client writes top-level forms, the server
+// evaluates each complete form and writes its output followed by an
+// empty line, or "error" and an empty line. definitions are shared by
+// all clients. forms are read and parsed on the client thread, and the
+// forms of different clients run at the same time. only their codegen,
+// the defuns and the reoptimization wait for each other, see runCons
+
+struct Client {
+	Context *ctx;
+	int fd;
+	FILE *out;
+	pthread_t pth;
+};
+
+static pthread_mutex_t clientLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clientCond = PTHREAD_COND_INITIALIZER;
+static ArrayBuilder<Client *> *clients;
+static volatile sig_atomic_t stopServer;
+
+static void onStop(int) {
+	stopServer = 1;
+}
+
+static bool isSpace(char ch) {
+	return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+}
+
+// end of the first top-level form in s[*begin, len), 0 if incomplete.
+// an atom at the end is complete only at eof
+static size_t formEnd(const char *s, size_t len, size_t *begin, bool eof) {
+	size_t i = *begin;
+	while(i < len && isSpace(s[i])) i++;
+	*begin = i;
+	if(i == len) return 0;
+	if(s[i] == ')') return i + 1;
+	if(s[i] == '(') {
+		int depth = 0;
+		for(; i < len; i++) {
+			if(s[i] == '(') depth++;
+			else if(s[i] == ')' && --depth == 0) return i + 1;
+		}
+		return 0;
+	}
+	while(i < len && !isSpace(s[i]) && s[i] != '(' && s[i] != ')') i++;
+	return i < len || eof ? i : 0;
+}
+
+static void evalForm(Client *c, const char *src, size_t len, Arena *arena) {
+	Context *ctx = c->ctx;
+	Tokenizer tk(src, len, ctx->symtab);
+	Cons *res = NULL;
+	bool ok = true;
+	if(parseCons(&tk, arena, &res) && res != NULL) {
+		res->cdr = NULL;
+		ok = runCons(ctx, res, arena, NULL, c->out);
+	}
+	if(!ok) fprintf(c->out, "error\n");
+	fprintf(c->out, "\n");
+	fflush(c->out);
+	arena->reset();
+}
+
+static void *clientMain(void *arg) {
+	Client *c = (Client *)arg;
+	Arena arena; // per form
+	size_t cap = 4096;
+	char *buf = new char[cap];
+	size_t len = 0;
+	bool eof = false;
+	while(!eof) {
+		if(len == cap) {
+			char *nbuf = new char[cap * 2];
+			memcpy(nbuf, buf, len);
+			delete [] buf;
+			buf = nbuf;
+			cap *= 2;
+		}
+		ssize_t n = read(c->fd, buf + len, cap - len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) eof = true;
+		else len += n;
+		// evaluate the complete forms, keep the rest
+		size_t begin = 0, end;
+		while((end = formEnd(buf, len, &begin, eof)) != 0) {
+			evalForm(c, buf + begin, end - begin, &arena);
+			begin = end;
+		}
+		memmove(buf, buf + begin, len - begin);
+		len -= begin;
+	}
+	delete [] buf;
+	fclose(c->out);
+	close(c->fd);
+	pthread_mutex_lock(&clientLock);
+	for(int i=0, j=clients->getSize(); i<j; i++) {
+		if((*clients)[i] == c) {
+			(*clients)[i] = (*clients)[j - 1];
+			clients->truncate(j - 1);
+			break;
+		}
+	}
+	pthread_cond_signal(&clientCond);
+	pthread_mutex_unlock(&clientLock);
+	delete c;
+	return NULL;
+}
+
+//------------------------------------------------------
+// returns on SIGINT or SIGTERM after the clients are closed
+void runServer(Context *ctx, const char *path) {
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return;
+	}
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(lfd, 128) == -1) {
+		fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+		if(lfd != -1) close(lfd);
+		return;
+	}
+	// accept is interrupted by the stop signals
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onStop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	clients = new ArrayBuilder<Client *>();
+	while(!stopServer) {
+		int fd = accept(lfd, NULL, NULL);
+		if(fd == -1) {
+			if(errno != EINTR && errno != ECONNABORTED) {
+				fprintf(stderr, "accept: %s\n", strerror(errno));
+				break;
+			}
+			continue;
+		}
+		int ofd = dup(fd);
+		FILE *out = ofd != -1 ? fdopen(ofd, "w") : NULL;
+		if(out == NULL) {
+			if(ofd != -1) close(ofd);
+			close(fd);
+			continue;
+		}
+		Client *c = new Client();
+		c->ctx = ctx;
+		c->fd = fd;
+		c->out = out;
+		pthread_mutex_lock(&clientLock);
+		clients->add(c);
+		pthread_create(&c->pth, NULL, clientMain, c);
+		pthread_detach(c->pth);
+		pthread_mutex_unlock(&clientLock);
+	}
+	close(lfd);
+	unlink(path);
+	// the clients see eof after the form they are running
+	pthread_mutex_lock(&clientLock);
+	for(int i=0, j=clients->getSize(); i<j; i++) {
+		shutdown((*clients)[i]->fd, SHUT_RD);
+	}
+	while(clients->getSize() != 0) {
+		pthread_cond_wait(&clientCond, &clientLock);
+	}
+	pthread_mutex_unlock(&clientLock);
+	delete clients;
+}
+
@@ -0,0 +1,1492 @@
+#include "lisp.h"
+
+//------------------------------------------------------
+// ssa form
+//   The bytecode is split into basic blocks and every frame slot is
+//   renamed into ssa values (phi nodes at merge points). Sparse conditional
+//   constant propagation, value numbering and dead code elimination work on
+//   the values; lowering keeps the original slot assignment and rewrites
+//   each instruction using whichever slot already holds the value it needs.
+
+#define NOVAL (-1)
+
+enum SValueKind {
+	SV_CONST,
+	SV_ARG,
+	SV_OPAQUE, // call result, global load, join, ...
+	SV_OP,
+	SV_PHI,
+};
+
+enum Lattice {
+	LAT_TOP,
+	LAT_CONST,
+	LAT_BOTTOM,
+};
+
+struct SValue {
+	SValueKind kind;
+	int op;       // reg2 form (INS_IADD, ...) or INS_INEG
+	int lhs, rhs;
+	int64_t k;
+	int block;    // phi
+	int *args;    // phi operands, one per pred
+	int home;     // slot of first definition
+	int fwd;
+	Lattice lat;
+	int64_t latk;
+};
+
+struct SInst {
+	int op;
+	int a, b;
+	int64_t k;
+	Code ptr;
+	int target;   // inst index, block index after lowering
+	int def;      // first value defined by this inst
+};
+
+struct SBlock {
+	int begin, end;
+	int succ[2];  // fallthrough, jump target
+	bool exec[2];
+	bool reach;
+	bool visited;
+	int *in;
+	int *out;
+	int lfall;
+};
+
+//------------------------------------------------------
+static int toRegOp(int i) {
+	switch(i) {
+	case INS_IADDC: return INS_IADD;
+	case INS_ISUBC: return INS_ISUB;
+	case INS_IMULC: return INS_IMUL;
+	case INS_IDIVC: return INS_IDIV;
+	case INS_IMODC: return INS_IMOD;
+	case INS_ISHLC: return INS_ISHL;
+	case INS_ISARC: return INS_ISAR;
+	case INS_ISHRC: return INS_ISHR;
+	case INS_IANDC: return INS_IAND;
+	case INS_IORC:  return INS_IOR;
+	case INS_IXORC: return INS_IXOR;
+	case INS_IJMPLTC: return INS_IJMPLT;
+	case INS_IJMPLEC: return INS_IJMPLE;
+	case INS_IJMPGTC: return INS_IJMPGT;
+	case INS_IJMPGEC: return INS_IJMPGE;
+	case INS_IJMPEQC: return INS_IJMPEQ;
+	case INS_IJMPNEC: return INS_IJMPNE;
+	}
+	abort();
+}
+
+static bool isCommutative(int i) {
+	return i == INS_IADD || i == INS_IMUL ||
+		i == INS_IAND || i == INS_IOR || i == INS_IXOR;
+}
+
+static bool evalOp(int i, int64_t x, int64_t y, int64_t *res) {
+	switch(i) {
+	case INS_IADD: *res = (int64_t)((uint64_t)x + (uint64_t)y); return true;
+	case INS_ISUB: *res = (int64_t)((uint64_t)x - (uint64_t)y); return true;
+	case INS_IMUL: *res = (int64_t)((uint64_t)x * (uint64_t)y); return true;
+	case INS_INEG: *res = (int64_t)(0 - (uint64_t)x); return true;
+	case INS_ISHL: *res = (int64_t)((uint64_t)x << (y & 63)); return true;
+	case INS_ISAR: *res = x >> (y & 63); return true;
+	case INS_ISHR: *res = (int64_t)((uint64_t)x >> (y & 63)); return true;
+	case INS_IAND: *res = x & y; return true;
+	case INS_IOR:  *res = x | y; return true;
+	case INS_IXOR: *res = x ^ y; return true;
+	case INS_IDIV:
+	case INS_IMOD:
+		if(y == 0 || (x == INT64_MIN && y == -1)) return false;
+		*res = i == INS_IDIV ? x / y : x % y;
+		return true;
+	}
+	return false;
+}
+
+static bool evalCond(int i, int64_t x, int64_t y) {
+	switch(i) {
+	case INS_IJMPLT: return x < y;
+	case INS_IJMPLE: return x <= y;
+	case INS_IJMPGT: return x > y;
+	case INS_IJMPGE: return x >= y;
+	case INS_IJMPEQ: return x == y;
+	case INS_IJMPNE: return x != y;
+	}
+	abort();
+}
+
+/* result of cond when both operands are the same value */
+static bool evalCondSame(int i) {
+	return i == INS_IJMPLE || i == INS_IJMPGE || i == INS_IJMPEQ;
+}
+
+static bool isPureOp(int i) {
+	return i == INS_ICONST || i == INS_MOV || i == INS_INEG ||
+		i == INS_LOAD_GLOBAL || isReg2Op(i) || isReg2COp(i);
+}
+
+//------------------------------------------------------
+class SSAFunc {
+private:
+	Context *ctx;
+	Func *func;
+	int nslots;
+	int nwords;
+	ArrayBuilder<SInst> insts;
+	int nblocks;
+	SBlock *blocks;
+	int *blockOf;
+	int *order;   // reverse postorder of reachable blocks
+	int norder;
+	int *predStart;
+	int *predList;
+	ArrayBuilder<SValue> vals;
+	int *tab;     // hash table for consts and value numbering
+	int tabCapa;
+	int tabSize;
+	ArrayBuilder<SInst> *lcode;
+
+	int find(int v);
+	int newValue(SValueKind kind, int home);
+	int constVal(int64_t k);
+	int newOp(int op, int lhs, int rhs, int home);
+	int lookupOp(int v);
+	void tabInsert(int v);
+	void tabClear();
+	bool sameKey(int v, int w);
+	unsigned keyHash(int v);
+	int npreds(int b) { return predStart[b + 1] - predStart[b]; }
+	int pred(int b, int i) { return predList[predStart[b] + i]; }
+	bool isEdgeExec(int p, int b);
+	void transfer(SInst *in, int *cur);
+	void latOf(int v, Lattice *lat, int64_t *k);
+	bool setLat(int v, Lattice lat, int64_t k);
+	bool simplifyPhis(bool execOnly);
+	int simplifyOp(int v);
+	int holder(int *cur, int v, int prefer);
+	void addInst(int b, int op, int a, int bb, int64_t k, Code ptr, int target);
+	void setSlot(int b, int *cur, int d, int v, int prefer);
+	bool emitBinary(int b, int *cur, int op, int d, int r);
+	void lowerOp(int b, int *cur, SInst *in);
+	void lowerCond(int b, int *cur, SInst *in, int blk);
+	int threadTarget(int t);
+	bool dce();
+
+public:
+	SSAFunc(Context *ctx, Func *func);
+	~SSAFunc();
+	bool decode();
+	bool buildBlocks();
+	void buildSSA();
+	void sccp();
+	void gvn();
+	void lower();
+	bool emit(bool showir, Arena *arena);
+};
+
+SSAFunc::SSAFunc(Context *ctx, Func *func) : insts(64), vals(128) {
+	this->ctx = ctx;
+	this->func = func;
+	nslots = 0;
+	nblocks = 0;
+	blocks = NULL;
+	blockOf = NULL;
+	order = NULL;
+	predStart = NULL;
+	predList = NULL;
+	tabCapa = 64;
+	tabSize = 0;
+	tab = new int[tabCapa];
+	tabClear();
+	lcode = NULL;
+}
+
+SSAFunc::~SSAFunc() {
+	for(int i=0; i<nblocks; i++) {
+		delete [] blocks[i].in;
+		delete [] blocks[i].out;
+	}
+	for(int i=0, j=vals.getSize(); i<j; i++) {
+		if(vals[i].kind == SV_PHI) delete [] vals[i].args;
+	}
+	delete [] blocks;
+	delete [] blockOf;
+	delete [] order;
+	delete [] predStart;
+	delete [] predList;
+	delete [] tab;
+	delete [] lcode;
+}
+
+//------------------------------------------------------
+// values
+
+int SSAFunc::find(int v) {
+	int r = v;
+	while(vals[r].fwd != r) r = vals[r].fwd;
+	while(vals[v].fwd != r) {
+		int n = vals[v].fwd;
+		vals[v].fwd = r;
+		v = n;
+	}
+	return r;
+}
+
+int SSAFunc::newValue(SValueKind kind, int home) {
+	SValue v;
+	memset(&v, 0, sizeof(v));
+	v.kind = kind;
+	v.op = -1;
+	v.lhs = NOVAL;
+	v.rhs = NOVAL;
+	v.block = -1;
+	v.home = home;
+	v.fwd = vals.getSize();
+	v.lat = kind == SV_ARG || kind == SV_OPAQUE ? LAT_BOTTOM : LAT_TOP;
+	vals.add(v);
+	return v.fwd;
+}
+
+unsigned SSAFunc::keyHash(int v) {
+	SValue &x = vals[v];
+	uint64_t h = x.kind == SV_CONST ? (uint64_t)x.k :
+		(((uint64_t)x.op * 31 + (uint64_t)x.lhs) * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)x.rhs;
+	h *= 0xff51afd7ed558ccdULL;
+	return (unsigned)(h >> 32);
+}
+
+bool SSAFunc::sameKey(int v, int w) {
+	SValue &x = vals[v], &y = vals[w];
+	if(x.kind != y.kind) return false;
+	if(x.kind == SV_CONST) return x.k == y.k;
+	return x.op == y.op && x.lhs == y.lhs && x.rhs == y.rhs;
+}
+
+void SSAFunc::tabClear() {
+	for(int i=0; i<tabCapa; i++) tab[i] = NOVAL;
+	tabSize = 0;
+}
+
+int SSAFunc::lookupOp(int v) {
+	for(unsigned i = keyHash(v) & (tabCapa - 1); tab[i] != NOVAL; i = (i + 1) & (tabCapa - 1)) {
+		if(sameKey(tab[i], v)) return tab[i];
+	}
+	return NOVAL;
+}
+
+void SSAFunc::tabInsert(int v) {
+	if((tabSize + 1) * 2 > tabCapa) {
+		int *old = tab;
+		int oldCapa = tabCapa;
+		tabCapa *= 2;
+		tab = new int[tabCapa];
+		tabClear();
+		for(int i=0; i<oldCapa; i++) {
+			if(old[i] != NOVAL) tabInsert(old[i]);
+		}
+		delete [] old;
+	}
+	unsigned i = keyHash(v) & (tabCapa - 1);
+	while(tab[i] != NOVAL) i = (i + 1) & (tabCapa - 1);
+	tab[i] = v;
+	tabSize++;
+}
+
+int SSAFunc::constVal(int64_t k) {
+	int v = newValue(SV_CONST, -1);
+	vals[v].k = k;
+	vals[v].lat = LAT_CONST;
+	vals[v].latk = k;
+	int w = lookupOp(v);
+	if(w != NOVAL) {
+		vals.truncate(v);
+		return w;
+	}
+	tabInsert(v);
+	return v;
+}
+
+int SSAFunc::newOp(int op, int lhs, int rhs, int home) {
+	int v = newValue(SV_OP, home);
+	vals[v].op = op;
+	vals[v].lhs = lhs;
+	vals[v].rhs = rhs;
+	return v;
+}
+
+//------------------------------------------------------
+// decode bytecode
+
+static void addSlot(int *n, int slot) {
+	if(slot + 1 > *n) *n = slot + 1;
+}
+
+bool SSAFunc::decode() {
+	Code *code = func->code;
+	int len = func->codeLength;
+	int *instAt = new int[len + 1];
+	for(int i=0; i<=len; i++) instAt[i] = -1;
+	nslots = func->argc;
+	int pc = 0;
+	bool ok = true;
+	while(ok) {
+		SInst in;
+		memset(&in, 0, sizeof(in));
+		in.op = (int)code[pc].i;
+		in.target = -1;
+		in.def = NOVAL;
+		switch(in.op) {
+		case INS_ICONST:
+			in.a = (int)code[pc+1].i;
+			in.k = code[pc+2].i;
+			addSlot(&nslots, in.a);
+			break;
+		case INS_MOV:
+		case INS_IADD:
+		case INS_ISUB:
+		case INS_IMUL:
+		case INS_IDIV:
+		case INS_IMOD:
+		case INS_ISHL:
+		case INS_ISAR:
+		case INS_ISHR:
+		case INS_IAND:
+		case INS_IOR:
+		case INS_IXOR:
+			in.a = (int)code[pc+1].i;
+			in.b = (int)code[pc+2].i;
+			addSlot(&nslots, in.a);
+			addSlot(&nslots, in.b);
+			break;
+		case INS_IADDC:
+		case INS_ISUBC:
+		case INS_IMULC:
+		case INS_IDIVC:
+		case INS_IMODC:
+		case INS_ISHLC:
+		case INS_ISARC:
+		case INS_ISHRC:
+		case INS_IANDC:
+		case INS_IORC:
+		case INS_IXORC:
+			in.a = (int)code[pc+1].i;
+			in.k = code[pc+2].i;
+			addSlot(&nslots, in.a);
+			break;
+		// strength reduced forms are read back as division by constant
+		case INS_IDIVP2:
+		case INS_IMODP2:
+			in.op = in.op == INS_IDIVP2 ? INS_IDIVC : INS_IMODC;
+			in.a = (int)code[pc+1].i;
+			in.k = (int64_t)1 << code[pc+2].i;
+			addSlot(&nslots, in.a);
+			break;
+		case INS_IDIVMC:
+		case INS_IMODMC:
+			in.op = in.op == INS_IDIVMC ? INS_IDIVC : INS_IMODC;
+			in.a = (int)code[pc+1].i;
+			in.k = code[pc+2].i;
+			addSlot(&nslots, in.a);
+			break;
+		case INS_INEG:
+		case INS_RET:
+		case INS_CAR:
+		case INS_CDR:
+		case INS_IPRINT:
+		case INS_FPRINT:
+		case INS_BPRINT:
+		case INS_LPRINT:
+			in.a = (int)code[pc+1].i;
+			addSlot(&nslots, in.a);
+			break;
+		case INS_CONS:
+			in.a = (int)code[pc+1].i;
+			addSlot(&nslots, in.a + 1);
+			break;
+		case INS_JOIN:
+			in.a = (int)code[pc+1].i;
+			addSlot(&nslots, in.a + 1);
+			break;
+		case INS_RETC:
+			in.k = code[pc+1].i;
+			break;
+		case INS_IJMPLT:
+		case INS_IJMPLE:
+		case INS_IJMPGT:
+		case INS_IJMPGE:
+		case INS_IJMPEQ:
+		case INS_IJMPNE:
+			in.target = pc + (int)code[pc+1].i;
+			in.a = (int)code[pc+2].i;
+			in.b = (int)code[pc+3].i;
+			addSlot(&nslots, in.a);
+			addSlot(&nslots, in.b);
+			break;
+		case INS_IJMPLTC:
+		case INS_IJMPLEC:
+		case INS_IJMPGTC:
+		case INS_IJMPGEC:
+		case INS_IJMPEQC:
+		case INS_IJMPNEC:
+			in.target = pc + (int)code[pc+1].i;
+			in.a = (int)code[pc+2].i;
+			in.k = code[pc+3].i;
+			addSlot(&nslots, in.a);
+			break;
+		case INS_JMP:
+			in.target = pc + (int)code[pc+1].i;
+			break;
+		case INS_LOAD_GLOBAL:
+		case INS_STORE_GLOBAL:
+			in.a = (int)code[pc+1].i;
+			in.ptr = code[pc+2];
+			addSlot(&nslots, in.a);
+			break;
+		case INS_CALL:
+		case INS_SPAWN:
+			in.ptr = code[pc+1];
+			in.a = (int)code[pc+2].i;
+			addSlot(&nslots, in.a + (int)in.ptr.func->argc);
+			addSlot(&nslots, in.a);
+			break;
+		case INS_FCALL:
+			in.ptr = code[pc+1];
+			in.a = (int)code[pc+2].i;
+			addSlot(&nslots, in.a + in.ptr.ffi->argc);
+			addSlot(&nslots, in.a);
+			break;
+		case INS_HASH:
+			in.a = (int)code[pc+1].i;
+			in.k = code[pc+2].i;
+			addSlot(&nslots, in.a + hashArgc((int)in.k));
+			addSlot(&nslots, in.a);
+			break;
+		case INS_DEFUN:
+			in.ptr = code[pc+1];
+			break;
+		case INS_END:
+			break;
+		default:
+			ok = false;
+			break;
+		}
+		if(!ok) break;
+		instAt[pc] = insts.getSize();
+		insts.add(in);
+		if(in.op == INS_END) break;
+		pc += getOpSize((int)code[pc].i);
+		if(pc >= len) ok = false;
+	}
+	for(int i=0, j=insts.getSize(); ok && i<j; i++) {
+		SInst &in = insts[i];
+		if(in.target == -1) continue;
+		if(in.target < 0 || in.target > len || instAt[in.target] == -1) {
+			ok = false;
+		} else {
+			in.target = instAt[in.target];
+		}
+	}
+	delete [] instAt;
+	nwords = (nslots + 63) / 64;
+	return ok;
+}
+
+//------------------------------------------------------
+// basic blocks
+
+static bool isJmpOp(int op) {
+	return op == INS_JMP || isCondJmpOp(op) || isCondJmpCOp(op);
+}
+
+static bool isTermOp(int op) {
+	return op == INS_JMP || op == INS_RET || op == INS_RETC || op == INS_END;
+}
+
+bool SSAFunc::buildBlocks() {
+	int n = insts.getSize();
+	bool *leader = new bool[n + 1];
+	for(int i=0; i<=n; i++) leader[i] = false;
+	leader[0] = true;
+	for(int i=0; i<n; i++) {
+		int op = insts[i].op;
+		if(isJmpOp(op)) leader[insts[i].target] = true;
+		if(isJmpOp(op) || isTermOp(op)) leader[i + 1] = true;
+	}
+	nblocks = 0;
+	for(int i=0; i<n; i++) {
+		if(leader[i]) nblocks++;
+	}
+	blocks = new SBlock[nblocks];
+	blockOf = new int[n];
+	int b = -1;
+	for(int i=0; i<n; i++) {
+		if(leader[i]) {
+			b++;
+			blocks[b].begin = i;
+			blocks[b].in = NULL;
+			blocks[b].out = NULL;
+		}
+		blocks[b].end = i + 1;
+		blockOf[i] = b;
+	}
+	delete [] leader;
+	for(b=0; b<nblocks; b++) {
+		SBlock *bl = &blocks[b];
+		SInst &last = insts[bl->end - 1];
+		bl->succ[0] = -1;
+		bl->succ[1] = -1;
+		bl->exec[0] = false;
+		bl->exec[1] = false;
+		bl->reach = false;
+		bl->visited = false;
+		bl->lfall = -1;
+		if(isJmpOp(last.op)) bl->succ[1] = blockOf[last.target];
+		if(!isTermOp(last.op) && b + 1 < nblocks) bl->succ[0] = b + 1;
+	}
+	// reverse postorder
+	int *post = new int[nblocks];
+	int npost = 0;
+	int *stack = new int[nblocks * 3 + 1];
+	int sp = 0;
+	stack[sp++] = 0;
+	blocks[0].reach = true;
+	int *next = new int[nblocks];
+	for(b=0; b<nblocks; b++) next[b] = 0;
+	while(sp > 0) {
+		b = stack[sp - 1];
+		if(next[b] < 2) {
+			int s = blocks[b].succ[next[b]++];
+			if(s != -1 && !blocks[s].reach) {
+				blocks[s].reach = true;
+				stack[sp++] = s;
+			}
+		} else {
+			post[npost++] = b;
+			sp--;
+		}
+	}
+	order = new int[npost];
+	norder = npost;
+	for(int i=0; i<npost; i++) order[i] = post[npost - 1 - i];
+	delete [] post;
+	delete [] stack;
+	delete [] next;
+	// preds of reachable blocks
+	predStart = new int[nblocks + 1];
+	for(b=0; b<=nblocks; b++) predStart[b] = 0;
+	for(b=0; b<nblocks; b++) {
+		if(!blocks[b].reach) continue;
+		for(int i=0; i<2; i++) {
+			int s = blocks[b].succ[i];
+			if(s != -1 && !(i == 1 && s == blocks[b].succ[0])) predStart[s + 1]++;
+		}
+	}
+	for(b=0; b<nblocks; b++) predStart[b + 1] += predStart[b];
+	predList = new int[predStart[nblocks] + 1];
+	int *fill = new int[nblocks];
+	for(b=0; b<nblocks; b++) fill[b] = predStart[b];
+	for(b=0; b<nblocks; b++) {
+		if(!blocks[b].reach) continue;
+		for(int i=0; i<2; i++) {
+			int s = blocks[b].succ[i];
+			if(s != -1 && !(i == 1 && s == blocks[b].succ[0])) predList[fill[s]++] = b;
+		}
+	}
+	delete [] fill;
+	return npreds(0) == 0;
+}
+
+bool SSAFunc::isEdgeExec(int p, int b) {
+	SBlock *bl = &blocks[p];
+	return (bl->succ[0] == b && bl->exec[0]) || (bl->succ[1] == b && bl->exec[1]);
+}
+
+//------------------------------------------------------
+// ssa construction
+
+void SSAFunc::transfer(SInst *in, int *cur) {
+	int op = in->op;
+	switch(op) {
+	case INS_ICONST:
+		cur[in->a] = constVal(in->k);
+		break;
+	case INS_MOV:
+		cur[in->a] = cur[in->b];
+		break;
+	case INS_IADD:
+	case INS_ISUB:
+	case INS_IMUL:
+	case INS_IDIV:
+	case INS_IMOD:
+	case INS_ISHL:
+	case INS_ISAR:
+	case INS_ISHR:
+	case INS_IAND:
+	case INS_IOR:
+	case INS_IXOR:
+		in->def = newOp(op, cur[in->a], cur[in->b], in->a);
+		cur[in->a] = in->def;
+		break;
+	case INS_IADDC:
+	case INS_ISUBC:
+	case INS_IMULC:
+	case INS_IDIVC:
+	case INS_IMODC:
+	case INS_ISHLC:
+	case INS_ISARC:
+	case INS_ISHRC:
+	case INS_IANDC:
+	case INS_IORC:
+	case INS_IXORC:
+		if(op == INS_ISUBC && in->k != INT64_MIN) {
+			in->def = newOp(INS_IADD, cur[in->a], constVal(-in->k), in->a);
+		} else {
+			in->def = newOp(toRegOp(op), cur[in->a], constVal(in->k), in->a);
+		}
+		cur[in->a] = in->def;
+		break;
+	case INS_INEG:
+		in->def = newOp(INS_INEG, cur[in->a], NOVAL, in->a);
+		cur[in->a] = in->def;
+		break;
+	case INS_LOAD_GLOBAL:
+	case INS_JOIN:
+	case INS_FCALL:
+	case INS_HASH:
+	case INS_CONS:
+	case INS_CAR:
+	case INS_CDR:
+		in->def = newValue(SV_OPAQUE, in->a);
+		cur[in->a] = in->def;
+		break;
+	case INS_CALL:
+	case INS_SPAWN: {
+		int s = in->a - (op == INS_CALL ? 2 : 3);
+		in->def = vals.getSize();
+		for(; s<nslots; s++) {
+			cur[s] = newValue(SV_OPAQUE, s);
+		}
+		break;
+	}
+	}
+}
+
+void SSAFunc::buildSSA() {
+	int *cur = new int[nslots];
+	for(int i=0; i<norder; i++) {
+		int b = order[i];
+		SBlock *bl = &blocks[b];
+		if(b == 0) {
+			for(int s=0; s<nslots; s++) {
+				cur[s] = newValue(s < (int)func->argc ? SV_ARG : SV_OPAQUE, s);
+			}
+		} else if(npreds(b) == 1) {
+			SBlock *p = &blocks[pred(b, 0)];
+			assert(p->out != NULL);
+			memcpy(cur, p->out, sizeof(int) * nslots);
+		} else {
+			for(int s=0; s<nslots; s++) {
+				int v = newValue(SV_PHI, s);
+				vals[v].block = b;
+				vals[v].args = new int[npreds(b)];
+				cur[s] = v;
+			}
+		}
+		bl->in = new int[nslots];
+		memcpy(bl->in, cur, sizeof(int) * nslots);
+		for(int j=bl->begin; j<bl->end; j++) {
+			transfer(&insts[j], cur);
+		}
+		bl->out = new int[nslots];
+		memcpy(bl->out, cur, sizeof(int) * nslots);
+	}
+	delete [] cur;
+	for(int i=0; i<norder; i++) {
+		int b = order[i];
+		if(b == 0 || npreds(b) == 1) continue;
+		for(int s=0; s<nslots; s++) {
+			int v = blocks[b].in[s];
+			for(int j=0, n=npreds(b); j<n; j++) {
+				vals[v].args[j] = blocks[pred(b, j)].out[s];
+			}
+		}
+	}
+	simplifyPhis(false);
+}
+
+/* replace phis whose operands are all the same value (or the phi itself) */
+bool SSAFunc::simplifyPhis(bool execOnly) {
+	bool changed = false;
+	bool loop = true;
+	while(loop) {
+		loop = false;
+		for(int v=0, j=vals.getSize(); v<j; v++) {
+			if(vals[v].kind != SV_PHI || find(v) != v) continue;
+			int b = vals[v].block;
+			int same = NOVAL;
+			bool trivial = true;
+			for(int i=0, n=npreds(b); i<n; i++) {
+				if(execOnly && !isEdgeExec(pred(b, i), b)) continue;
+				int a = find(vals[v].args[i]);
+				if(a == v || a == same) continue;
+				if(same != NOVAL) {
+					trivial = false;
+					break;
+				}
+				same = a;
+			}
+			if(trivial && same != NOVAL) {
+				vals[v].fwd = same;
+				loop = true;
+				changed = true;
+			}
+		}
+	}
+	return changed;
+}
+
+//------------------------------------------------------
+// sparse conditional constant propagation
+
+void SSAFunc::latOf(int v, Lattice *lat, int64_t *k) {
+	v = find(v);
+	*lat = vals[v].lat;
+	*k = vals[v].latk;
+}
+
+bool SSAFunc::setLat(int v, Lattice lat, int64_t k) {
+	SValue &x = vals[v];
+	if(lat == LAT_CONST && x.lat == LAT_CONST && x.latk != k) lat = LAT_BOTTOM;
+	if(lat <= x.lat) return false;
+	x.lat = lat;
+	x.latk = k;
+	return true;
+}
+
+void SSAFunc::sccp() {
+	blocks[0].visited = true;
+	bool changed = true;
+	while(changed) {
+		changed = false;
+		for(int i=0; i<norder; i++) {
+			int b = order[i];
+			SBlock *bl = &blocks[b];
+			if(!bl->visited) continue;
+			// phis
+			if(b != 0 && npreds(b) > 1) {
+				for(int s=0; s<nslots; s++) {
+					int v = bl->in[s];
+					if(vals[v].kind != SV_PHI || find(v) != v) continue;
+					for(int j=0, n=npreds(b); j<n; j++) {
+						if(!isEdgeExec(pred(b, j), b)) continue;
+						Lattice l; int64_t k;
+						latOf(vals[v].args[j], &l, &k);
+						if(l != LAT_TOP) changed |= setLat(v, l, k);
+					}
+				}
+			}
+			// ops
+			for(int j=bl->begin; j<bl->end; j++) {
+				SInst &in = insts[j];
+				if(in.def == NOVAL || vals[in.def].kind != SV_OP) continue;
+				int v = in.def;
+				Lattice l1, l2 = LAT_CONST; int64_t k1, k2 = 0, r;
+				latOf(vals[v].lhs, &l1, &k1);
+				if(vals[v].rhs != NOVAL) latOf(vals[v].rhs, &l2, &k2);
+				if(l1 == LAT_TOP || l2 == LAT_TOP) continue;
+				if(l1 == LAT_CONST && l2 == LAT_CONST && evalOp(vals[v].op, k1, k2, &r)) {
+					changed |= setLat(v, LAT_CONST, r);
+				} else {
+					changed |= setLat(v, LAT_BOTTOM, 0);
+				}
+			}
+			// branch
+			SInst &last = insts[bl->end - 1];
+			bool e0 = bl->succ[0] != -1, e1 = bl->succ[1] != -1;
+			if(isCondJmpOp(last.op) || isCondJmpCOp(last.op)) {
+				int op = isCondJmpOp(last.op) ? last.op : toRegOp(last.op);
+				Lattice l1, l2; int64_t k1, k2;
+				latOf(bl->out[last.a], &l1, &k1);
+				if(isCondJmpOp(last.op)) {
+					latOf(bl->out[last.b], &l2, &k2);
+				} else {
+					l2 = LAT_CONST;
+					k2 = last.k;
+				}
+				if(isCondJmpOp(last.op) && find(bl->out[last.a]) == find(bl->out[last.b])) {
+					bool t = evalCondSame(op);
+					e0 = !t;
+					e1 = t;
+				} else if(l1 == LAT_TOP || l2 == LAT_TOP) {
+					e0 = e1 = false;
+				} else if(l1 == LAT_CONST && l2 == LAT_CONST) {
+					bool t = evalCond(op, k1, k2);
+					e0 = !t;
+					e1 = t;
+				}
+			}
+			for(int j=0; j<2; j++) {
+				int s = bl->succ[j];
+				if(s == -1 || !(j == 0 ? e0 : e1) || bl->exec[j]) continue;
+				bl->exec[j] = true;
+				blocks[s].visited = true;
+				changed = true;
+			}
+		}
+	}
+	// fold constants
+	for(int v=0, j=vals.getSize(); v<j; v++) {
+		SValue &x = vals[v];
+		if((x.kind == SV_OP || x.kind == SV_PHI) && x.fwd == v && x.lat == LAT_CONST) {
+			int64_t k = x.latk;
+			int c = constVal(k);
+			vals[v].fwd = c;
+		}
+	}
+	simplifyPhis(true);
+}
+
+//------------------------------------------------------
+// global value numbering
+
+int SSAFunc::simplifyOp(int v) {
+	SValue &x = vals[v];
+	int l = x.lhs, r = x.rhs;
+	bool lc = vals[l].kind == SV_CONST;
+	bool rc = r != NOVAL && vals[r].kind == SV_CONST;
+	int64_t lk = vals[l].k, rk = rc ? vals[r].k : 0, res;
+	if(lc && (r == NOVAL || rc) && evalOp(x.op, lk, rk, &res)) return constVal(res);
+	switch(x.op) {
+	case INS_IADD:
+		if(rc && rk == 0) return l;
+		if(rc && vals[l].kind == SV_OP && vals[l].op == INS_IADD &&
+				vals[vals[l].rhs].kind == SV_CONST) {
+			// (x + c1) + c2 -> x + (c1 + c2)
+			int64_t k = (int64_t)((uint64_t)vals[vals[l].rhs].k + (uint64_t)rk);
+			int c = constVal(k);
+			vals[v].lhs = find(vals[l].lhs);
+			vals[v].rhs = c;
+		}
+		break;
+	case INS_ISUB:
+		if(rc && rk == 0) return l;
+		if(l == r) return constVal(0);
+		break;
+	case INS_IMUL:
+		if(rc && rk == 1) return l;
+		if(rc && rk == 0) return r;
+		break;
+	case INS_IDIV:
+		if(rc && rk == 1) return l;
+		break;
+	case INS_IMOD:
+		if(rc && (rk == 1 || rk == -1)) return constVal(0);
+		break;
+	case INS_INEG:
+		if(vals[l].kind == SV_OP && vals[l].op == INS_INEG) return find(vals[l].lhs);
+		break;
+	case INS_ISHL:
+	case INS_ISAR:
+	case INS_ISHR:
+		if(rc && (rk & 63) == 0) return l;
+		break;
+	case INS_IAND:
+		if(rc && rk == -1) return l;
+		if(rc && rk == 0) return r;
+		if(l == r) return l;
+		break;
+	case INS_IOR:
+		if(rc && rk == 0) return l;
+		if(rc && rk == -1) return r;
+		if(l == r) return l;
+		break;
+	case INS_IXOR:
+		if(rc && rk == 0) return l;
+		if(l == r) return constVal(0);
+		break;
+	}
+	return v;
+}
+
+void SSAFunc::gvn() {
+	for(int iter=0; iter<8; iter++) {
+		bool changed = false;
+		tabClear();
+		for(int v=0, j=vals.getSize(); v<j; v++) {
+			if(vals[v].kind == SV_CONST && find(v) == v) tabInsert(v);
+		}
+		for(int v=0; v<vals.getSize(); v++) {
+			if(vals[v].kind != SV_OP || find(v) != v) continue;
+			vals[v].lhs = find(vals[v].lhs);
+			if(vals[v].rhs != NOVAL) vals[v].rhs = find(vals[v].rhs);
+			if(isCommutative(vals[v].op)) {
+				int l = vals[v].lhs, r = vals[v].rhs;
+				if(vals[l].kind == SV_CONST || (vals[r].kind != SV_CONST && r < l)) {
+					vals[v].lhs = r;
+					vals[v].rhs = l;
+				}
+			}
+			int s = simplifyOp(v);
+			if(s != v) {
+				vals[v].fwd = s;
+				changed = true;
+				continue;
+			}
+			int w = lookupOp(v);
+			if(w != NOVAL && w != v) {
+				vals[v].fwd = w;
+				changed = true;
+			} else if(w == NOVAL) {
+				tabInsert(v);
+			}
+		}
+		changed |= simplifyPhis(true);
+		if(!changed) break;
+	}
+}
+
+//------------------------------------------------------
+// lowering
+
+/* slot holding v, the slot it was defined in is preferred so that copies die */
+int SSAFunc::holder(int *cur, int v, int prefer) {
+	int h = vals[v].home;
+	if(h >= 0 && h < nslots && cur[h] == v) return h;
+	if(prefer >= 0 && cur[prefer] == v) return prefer;
+	for(int s=0; s<nslots; s++) {
+		if(cur[s] == v) return s;
+	}
+	return -1;
+}
+
+void SSAFunc::addInst(int b, int op, int a, int bb, int64_t k, Code ptr, int target) {
+	SInst in;
+	in.op = op;
+	in.a = a;
+	in.b = bb;
+	in.k = k;
+	in.ptr = ptr;
+	in.target = target;
+	in.def = NOVAL;
+	lcode[b].add(in);
+}
+
+static Code nullCode() {
+	Code c;
+	c.ptr = NULL;
+	return c;
+}
+
+void SSAFunc::setSlot(int b, int *cur, int d, int v, int prefer) {
+	if(cur[d] == v) return;
+	if(vals[v].kind == SV_CONST) {
+		addInst(b, INS_ICONST, d, 0, vals[v].k, nullCode(), -1);
+	} else {
+		int h = holder(cur, v, prefer);
+		assert(h != -1);
+		addInst(b, INS_MOV, d, h, 0, nullCode(), -1);
+	}
+	cur[d] = v;
+}
+
+bool SSAFunc::emitBinary(int b, int *cur, int op, int d, int r) {
+	if(vals[r].kind == SV_CONST) {
+		int64_t k = vals[r].k;
+		if(op == INS_ISUB && k != INT64_MIN) {
+			addInst(b, INS_IADDC, d, 0, -k, nullCode(), -1);
+		} else {
+			addInst(b, toConstOp(op), d, 0, k, nullCode(), -1);
+		}
+		return true;
+	}
+	int h = holder(cur, r, -1);
+	if(h == -1) return false;
+	addInst(b, op, d, h, 0, nullCode(), -1);
+	return true;
+}
+
+void SSAFunc::lowerOp(int b, int *cur, SInst *in) {
+	int d = in->a;
+	int v = find(in->def);
+	if(cur[d] == v) return;
+	SValue &x = vals[v];
+	bool done = false;
+	if(x.kind == SV_CONST || holder(cur, v, -1) != -1) {
+		setSlot(b, cur, d, v, -1);
+		return;
+	}
+	if(x.kind == SV_OP) {
+		int l = x.lhs, r = x.rhs, op = x.op;
+		if(op == INS_INEG) {
+			if(cur[d] == l) {
+				addInst(b, INS_INEG, d, 0, 0, nullCode(), -1);
+				done = true;
+			}
+		} else if(cur[d] == l) {
+			done = emitBinary(b, cur, op, d, r);
+		} else if(isCommutative(op) && cur[d] == r) {
+			done = emitBinary(b, cur, op, d, l);
+		}
+	}
+	if(!done) {
+		// original instruction, its operands are still in place
+		addInst(b, in->op, in->a, in->b, in->k, nullCode(), -1);
+	}
+	cur[d] = v;
+}
+
+void SSAFunc::lowerCond(int b, int *cur, SInst *in, int blk) {
+	SBlock *bl = &blocks[blk];
+	int target = bl->succ[1];
+	if(!bl->exec[1]) return; // never taken
+	if(!bl->exec[0]) {
+		addInst(b, INS_JMP, 0, 0, 0, nullCode(), target);
+		return;
+	}
+	int op = isCondJmpOp(in->op) ? in->op : toRegOp(in->op);
+	int l = cur[in->a];
+	int r = isCondJmpOp(in->op) ? cur[in->b] : constVal(in->k);
+	if(vals[r].kind == SV_CONST) {
+		addInst(b, toConstOp(op), holder(cur, l, in->a), 0, vals[r].k, nullCode(), target);
+	} else if(vals[l].kind == SV_CONST) {
+		addInst(b, toConstOp(toSwapCondJmpOp(op)), holder(cur, r, in->b), 0, vals[l].k, nullCode(), target);
+	} else {
+		addInst(b, op, holder(cur, l, in->a), holder(cur, r, in->b), 0, nullCode(), target);
+	}
+}
+
+void SSAFunc::lower() {
+	lcode = new ArrayBuilder<SInst>[nblocks];
+	int *cur = new int[nslots];
+	for(int b=0; b<nblocks; b++) {
+		SBlock *bl = &blocks[b];
+		if(!bl->visited) continue;
+		for(int s=0; s<nslots; s++) cur[s] = find(bl->in[s]);
+		bl->lfall = bl->exec[0] ? bl->succ[0] : -1;
+		for(int i=bl->begin; i<bl->end; i++) {
+			SInst *in = &insts[i];
+			switch(in->op) {
+			case INS_ICONST:
+				setSlot(b, cur, in->a, constVal(in->k), -1);
+				break;
+			case INS_MOV:
+				setSlot(b, cur, in->a, cur[in->b], in->b);
+				break;
+			case INS_IADD:
+			case INS_ISUB:
+			case INS_IMUL:
+			case INS_IDIV:
+			case INS_IMOD:
+			case INS_ISHL:
+			case INS_ISAR:
+			case INS_ISHR:
+			case INS_IAND:
+			case INS_IOR:
+			case INS_IXOR:
+			case INS_IADDC:
+			case INS_ISUBC:
+			case INS_IMULC:
+			case INS_IDIVC:
+			case INS_IMODC:
+			case INS_ISHLC:
+			case INS_ISARC:
+			case INS_ISHRC:
+			case INS_IANDC:
+			case INS_IORC:
+			case INS_IXORC:
+			case INS_INEG:
+				lowerOp(b, cur, in);
+				break;
+			case INS_IJMPLT:
+			case INS_IJMPLE:
+			case INS_IJMPGT:
+			case INS_IJMPGE:
+			case INS_IJMPEQ:
+			case INS_IJMPNE:
+			case INS_IJMPLTC:
+			case INS_IJMPLEC:
+			case INS_IJMPGTC:
+			case INS_IJMPGEC:
+			case INS_IJMPEQC:
+			case INS_IJMPNEC:
+				lowerCond(b, cur, in, b);
+				break;
+			case INS_JMP:
+				addInst(b, INS_JMP, 0, 0, 0, nullCode(), bl->succ[1]);
+				break;
+			case INS_RET: {
+				int v = cur[in->a];
+				if(vals[v].kind == SV_CONST) {
+					addInst(b, INS_RETC, 0, 0, vals[v].k, nullCode(), -1);
+				} else {
+					addInst(b, INS_RET, holder(cur, v, in->a), 0, 0, nullCode(), -1);
+				}
+				break;
+			}
+			case INS_STORE_GLOBAL:
+			case INS_IPRINT:
+			case INS_FPRINT:
+			case INS_BPRINT:
+			case INS_LPRINT:
+				addInst(b, in->op, holder(cur, cur[in->a], in->a), 0, 0, in->ptr, -1);
+				break;
+			case INS_LOAD_GLOBAL:
+			case INS_JOIN:
+			case INS_FCALL:
+				addInst(b, in->op, in->a, 0, 0, in->ptr, -1);
+				cur[in->a] = find(in->def);
+				break;
+			case INS_HASH:
+				addInst(b, in->op, in->a, 0, in->k, nullCode(), -1);
+				cur[in->a] = find(in->def);
+				break;
+			case INS_CONS:
+			case INS_CAR:
+			case INS_CDR:
+				addInst(b, in->op, in->a, 0, 0, nullCode(), -1);
+				cur[in->a] = find(in->def);
+				break;
+			case INS_CALL:
+			case INS_SPAWN: {
+				addInst(b, in->op, in->a, 0, 0, in->ptr, -1);
+				int s = in->a - (in->op == INS_CALL ? 2 : 3);
+				for(int v=in->def; s<nslots; s++, v++) cur[s] = find(v);
+				break;
+			}
+			default:
+				addInst(b, in->op, in->a, in->b, in->k, in->ptr, -1);
+				break;
+			}
+		}
+	}
+	delete [] cur;
+	while(dce());
+}
+
+//------------------------------------------------------
+// dead code elimination
+
+struct SlotUse {
+	int use[2];
+	int nuse;
+	int useFrom, useTo;   // [from, to) argument slots
+	int def;
+	int killFrom;         // clobbers [killFrom, nslots)
+};
+
+static void getSlotUse(SInst *in, SlotUse *u) {
+	u->nuse = 0;
+	u->useFrom = u->useTo = 0;
+	u->def = -1;
+	u->killFrom = -1;
+	int op = in->op;
+	switch(op) {
+	case INS_ICONST:
+	case INS_LOAD_GLOBAL:
+		u->def = in->a;
+		break;
+	case INS_MOV:
+		u->def = in->a;
+		u->use[u->nuse++] = in->b;
+		break;
+	case INS_JOIN:
+		u->def = in->a;
+		u->use[u->nuse++] = in->a;
+		u->use[u->nuse++] = in->a + 1;
+		break;
+	case INS_RET:
+	case INS_STORE_GLOBAL:
+	case INS_IPRINT:
+	case INS_FPRINT:
+	case INS_BPRINT:
+	case INS_LPRINT:
+		u->use[u->nuse++] = in->a;
+		break;
+	case INS_CONS:
+	case INS_CAR:
+	case INS_CDR:
+		u->def = in->a;
+		u->useFrom = in->a;
+		u->useTo = in->a + (in->op == INS_CONS ? 2 : 1);
+		break;
+	case INS_CALL:
+	case INS_SPAWN:
+		u->killFrom = in->a - (op == INS_CALL ? 2 : 3);
+		u->useFrom = in->a;
+		u->useTo = in->a + (int)in->ptr.func->argc;
+		break;
+	case INS_FCALL:
+		u->def = in->a;
+		u->useFrom = in->a;
+		u->useTo = in->a + in->ptr.ffi->argc;
+		break;
+	case INS_HASH:
+		u->def = in->a;
+		u->useFrom = in->a;
+		u->useTo = in->a + hashArgc((int)in->k);
+		break;
+	default:
+		if(isReg2Op(op) || isCondJmpOp(op)) {
+			if(isReg2Op(op)) u->def = in->a;
+			u->use[u->nuse++] = in->a;
+			u->use[u->nuse++] = in->b;
+		} else if(isReg2COp(op) || op == INS_INEG || isCondJmpCOp(op)) {
+			if(!isCondJmpCOp(op)) u->def = in->a;
+			u->use[u->nuse++] = in->a;
+		}
+		break;
+	}
+}
+
+#define BIT_GET(bs, n) (((bs)[(n) >> 6] >> ((n) & 63)) & 1)
+#define BIT_SET(bs, n) ((bs)[(n) >> 6] |= (uint64_t)1 << ((n) & 63))
+#define BIT_CLR(bs, n) ((bs)[(n) >> 6] &= ~((uint64_t)1 << ((n) & 63)))
+
+static void liveStep(SInst *in, uint64_t *live, int nslots) {
+	SlotUse u;
+	getSlotUse(in, &u);
+	if(u.def != -1) BIT_CLR(live, u.def);
+	if(u.killFrom != -1) {
+		for(int s=u.killFrom; s<nslots; s++) BIT_CLR(live, s);
+	}
+	for(int i=0; i<u.nuse; i++) BIT_SET(live, u.use[i]);
+	for(int s=u.useFrom; s<u.useTo; s++) BIT_SET(live, s);
+}
+
+bool SSAFunc::dce() {
+	uint64_t *livein = new uint64_t[nblocks * nwords];
+	uint64_t *live = new uint64_t[nwords];
+	memset(livein, 0, sizeof(uint64_t) * nblocks * nwords);
+	bool changed = true;
+	while(changed) {
+		changed = false;
+		for(int b=nblocks-1; b>=0; b--) {
+			if(!blocks[b].visited) continue;
+			memset(live, 0, sizeof(uint64_t) * nwords);
+			int n = lcode[b].getSize();
+			int fall = blocks[b].lfall;
+			if(n > 0 && isJmpOp(lcode[b][n - 1].op)) {
+				int t = lcode[b][n - 1].target;
+				for(int w=0; w<nwords; w++) live[w] |= livein[t * nwords + w];
+				if(lcode[b][n - 1].op == INS_JMP) fall = -1;
+			}
+			if(fall != -1) {
+				for(int w=0; w<nwords; w++) live[w] |= livein[fall * nwords + w];
+			}
+			for(int i=n-1; i>=0; i--) liveStep(&lcode[b][i], live, nslots);
+			if(memcmp(live, &livein[b * nwords], sizeof(uint64_t) * nwords) != 0) {
+				memcpy(&livein[b * nwords], live, sizeof(uint64_t) * nwords);
+				changed = true;
+			}
+		}
+	}
+	// remove unused definitions
+	bool removed = false;
+	for(int b=0; b<nblocks; b++) {
+		if(!blocks[b].visited) continue;
+		memset(live, 0, sizeof(uint64_t) * nwords);
+		int n = lcode[b].getSize();
+		int fall = blocks[b].lfall;
+		if(n > 0 && isJmpOp(lcode[b][n - 1].op)) {
+			int t = lcode[b][n - 1].target;
+			for(int w=0; w<nwords; w++) live[w] |= livein[t * nwords + w];
+			if(lcode[b][n - 1].op == INS_JMP) fall = -1;
+		}
+		if(fall != -1) {
+			for(int w=0; w<nwords; w++) live[w] |= livein[fall * nwords + w];
+		}
+		bool *dead = new bool[n + 1];
+		for(int i=n-1; i>=0; i--) {
+			SInst *in = &lcode[b][i];
+			dead[i] = false;
+			if(isPureOp(in->op) && !BIT_GET(live, in->a)) {
+				dead[i] = true;
+			} else if(in->op == INS_MOV && in->a == in->b) {
+				dead[i] = true;
+			} else if(in->op == INS_CALL && in->ptr.func->effect <= EFF_READ &&
+					!BIT_GET(live, in->a - 2)) {
+				// a call that writes nothing, result unused
+				dead[i] = true;
+			}
+			if(dead[i]) {
+				removed = true;
+				continue;
+			}
+			liveStep(in, live, nslots);
+		}
+		int m = 0;
+		for(int i=0; i<n; i++) {
+			if(!dead[i]) lcode[b][m++] = lcode[b][i];
+		}
+		lcode[b].truncate(m);
+		delete [] dead;
+	}
+	delete [] livein;
+	delete [] live;
+	return removed;
+}
+
+//------------------------------------------------------
+// emit
+
+int SSAFunc::threadTarget(int t) {
+	for(int i=0; i<nblocks; i++) {
+		int n = lcode[t].getSize();
+		if(n == 0 && blocks[t].lfall != -1) {
+			t = blocks[t].lfall;
+		} else if(n == 1 && lcode[t][0].op == INS_JMP) {
+			t = lcode[t][0].target;
+		} else {
+			break;
+		}
+	}
+	return t;
+}
+
+bool SSAFunc::emit(bool showir, Arena *arena) {
+	CodeBuilder cb(ctx, func, false, showir, arena);
+	int *bpos = new int[nblocks];
+	int *phead = new int[nblocks];
+	ArrayBuilder<int> plabel, pnext;
+	int *emitOrder = new int[nblocks];
+	int nemit = 0;
+	for(int b=0; b<nblocks; b++) {
+		bpos[b] = -1;
+		phead[b] = -1;
+		if(blocks[b].visited) emitOrder[nemit++] = b;
+	}
+	bool ended = false;
+	for(int i=0; i<nemit; i++) {
+		int b = emitOrder[i];
+		int next = i + 1 < nemit ? emitOrder[i + 1] : -1;
+		bpos[b] = cb.getCodeLength();
+		for(int p=phead[b]; p!=-1; p=pnext[p]) {
+			cb.setLabel(plabel[p]);
+		}
+		for(int j=0, n=lcode[b].getSize(); j<n; j++) {
+			SInst in = lcode[b][j];
+			ended = false;
+			if(isJmpOp(in.op)) {
+				int t = threadTarget(in.target);
+				if(t == next && (in.op == INS_JMP || blocks[b].lfall == next)) continue;
+				if(in.op == INS_JMP && lcode[t].getSize() == 1 &&
+						(lcode[t][0].op == INS_RET || lcode[t][0].op == INS_RETC)) {
+					in = lcode[t][0];
+				} else {
+					int off = bpos[t] >= 0 ? bpos[t] - cb.getCodeLength() : 0;
+					int lb;
+					if(in.op == INS_JMP) {
+						lb = cb.createJmp(off);
+					} else if(isCondJmpOp(in.op)) {
+						lb = cb.createCondOp(in.op, in.a, in.b, off);
+					} else {
+						lb = cb.createCondOpC(in.op, in.a, in.k, off);
+					}
+					if(bpos[t] < 0) {
+						plabel.add(lb);
+						pnext.add(phead[t]);
+						phead[t] = plabel.getSize() - 1;
+					}
+					continue;
+				}
+			}
+			switch(in.op) {
+			case INS_RETC:
+				cb.createIntIns(in.op, in.k);
+				break;
+			case INS_ICONST:
+			case INS_IADDC:
+			case INS_ISUBC:
+			case INS_IMULC:
+			case INS_IDIVC:
+			case INS_IMODC:
+			case INS_ISHLC:
+			case INS_ISARC:
+			case INS_ISHRC:
+			case INS_IANDC:
+			case INS_IORC:
+			case INS_IXORC:
+				cb.createRegIntIns(in.op, in.a, in.k);
+				break;
+			case INS_MOV:
+			case INS_IADD:
+			case INS_ISUB:
+			case INS_IMUL:
+			case INS_IDIV:
+			case INS_IMOD:
+			case INS_ISHL:
+			case INS_ISAR:
+			case INS_ISHR:
+			case INS_IAND:
+			case INS_IOR:
+			case INS_IXOR:
+				cb.createReg2Ins(in.op, in.a, in.b);
+				break;
+			case INS_INEG:
+			case INS_RET:
+			case INS_JOIN:
+			case INS_CONS:
+			case INS_CAR:
+			case INS_CDR:
+			case INS_IPRINT:
+			case INS_FPRINT:
+			case INS_BPRINT:
+			case INS_LPRINT:
+				cb.createRegIns(in.op, in.a);
+				break;
+			case INS_LOAD_GLOBAL:
+			case INS_STORE_GLOBAL:
+				cb.createVarIns(in.op, in.a, in.ptr.var);
+				break;
+			case INS_CALL:
+			case INS_SPAWN:
+				cb.createFuncIns(in.op, in.ptr.func, in.a);
+				break;
+			case INS_FCALL:
+				cb.createForeignIns(in.op, in.ptr.ffi, in.a);
+				break;
+			case INS_HASH:
+				cb.createRegIntIns(in.op, in.a, in.k);
+				break;
+			case INS_DEFUN:
+				cb.createConsIns(in.op, in.ptr.cons);
+				break;
+			case INS_END:
+				cb.createEnd();
+				ended = true;
+				break;
+			default:
+				abort();
+			}
+		}
+	}
+	if(!ended) cb.createEnd();
+	delete [] bpos;
+	delete [] phead;
+	delete [] emitOrder;
+
+	Code *code = cb.getCode();
+	int len = cb.getCodeLength();
+	bool changed = len != func->codeLength ||
+		memcmp(code, func->code, sizeof(Code) * len) != 0;
+	delete [] func->code;
+	func->code = code;
+	func->codeLength = len;
+	return changed;
+}
+
+//------------------------------------------------------
+bool opt_ssa(Context *ctx, Func *func, bool showir, Arena *arena) {
+	SSAFunc sf(ctx, func);
+	if(!sf.decode()) return false;
+	if(!sf.buildBlocks()) return false;
+	sf.buildSSA();
+	sf.sccp();
+	sf.gvn();
+	sf.lower();
+	return sf.emit(showir, arena);
+}
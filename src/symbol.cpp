@@ -0,0 +1,62 @@
+#include "lisp.h"
+
+//------------------------------------------------------
+static uint32_t strHash(const char *s, size_t len) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for(size_t i=0; i<len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+	return h;
+}
+
+SymbolTable::SymbolTable() {
+	mask = 255;
+	count = 0;
+	table = new const char *[mask + 1];
+	for(int i=0; i<=mask; i++) table[i] = NULL;
+	pthread_mutex_init(&lock, NULL);
+}
+
+SymbolTable::~SymbolTable() {
+	for(int i=0; i<=mask; i++) {
+		if(table[i] != NULL) delete [] table[i];
+	}
+	delete [] table;
+	pthread_mutex_destroy(&lock);
+}
+
+void SymbolTable::rehash() {
+	const char **old = table;
+	int n = mask + 1;
+	mask = mask * 2 + 1;
+	table = new const char *[mask + 1];
+	for(int i=0; i<=mask; i++) table[i] = NULL;
+	for(int i=0; i<n; i++) {
+		if(old[i] == NULL) continue;
+		int h = strHash(old[i], strlen(old[i])) & mask;
+		while(table[h] != NULL) h = (h + 1) & mask;
+		table[h] = old[i];
+	}
+	delete [] old;
+}
+
+const char *SymbolTable::intern(const char *s, size_t len) {
+	uint32_t hash = strHash(s, len);
+	pthread_mutex_lock(&lock);
+	int h = hash & mask;
+	for(; table[h] != NULL; h = (h + 1) & mask) {
+		if(strncmp(table[h], s, len) == 0 && table[h][len] == '\0') {
+			const char *atom = table[h];
+			pthread_mutex_unlock(&lock);
+			return atom;
+		}
+	}
+	char *atom = new char[len + 1];
+	memcpy(atom, s, len);
+	atom[len] = '\0';
+	table[h] = atom;
+	if(++count * 2 > mask) rehash();
+	pthread_mutex_unlock(&lock);
+	return atom;
+}
+
@@ -1,19 +1,92 @@
 #include "lisp.h"
 
+#ifdef USING_PROFILE
+// count the instruction for the opcode, the function and the task
+# define PROF_OP(op) { ws->opcount[op]++; fs->self++; task->icount++; }
+#else
+# define PROF_OP(op)
+#endif
+
 #ifdef USING_THCODE
 # define SWITCHBEGIN goto *(pc->ptr)
 # define SWITCHEND 
-# define CASE(a)     L_##a:
+# define CASE(a)     L_##a: PROF_OP(INS_##a)
 # define NEXT()      goto *(pc->ptr)
 # define DEFAULT		 L_ERROR:
 #else
 # define SWITCHBEGIN L_HEAD: switch(pc->i) {
 # define SWITCHEND   }
-# define CASE(a)     case INS_##a:
+# define CASE(a)     case INS_##a: PROF_OP(INS_##a)
 # define NEXT()      goto L_HEAD
 # define DEFAULT		 default:
 #endif
 
+// x / pc[2] by multiply high with pc[3], shift and flags pc[4]
+static inline int64_t magicDiv(int64_t x, Code *pc) {
+	int64_t s = pc[4].i;
+	int64_t q = (int64_t)(((__int128)x * pc[3].i) >> 64);
+	if(s & MAGIC_ADD) q += x;
+	if(s & MAGIC_SUB) q -= x;
+	q >>= MAGIC_SHIFT(s);
+	return q + (int64_t)((uint64_t)q >> 63);
+}
+
+// a cancelled task ends after its children, which are cancelled too.
+// the task stops here for a collection of the cons heap
+#define SAFEPOINT() { \
+		if(unlikely(heap->stopping)) heap->park(task); \
+		if(unlikely(task->token != NULL) && isCancelled(task->token)) goto L_CANCEL; \
+	}
+
+// the output of the thread is written before its task can run on another
+#define FLUSH_OUT() { \
+		if(unlikely(wth->out.len != 0)) outWrite(&wth->out, task->outfp); \
+	}
+
+// the task runs again from pc later
+#define REQUEUE() { \
+		task->pc = pc; \
+		task->sp = sp; \
+		FLUSH_OUT(); \
+		sche->enqueue(task); \
+		return; \
+	}
+
+// a line was printed into o
+#define PRINTED(o) { \
+		outPutc(o, '\n'); \
+		if(unlikely((o)->len >= OUT_FLUSH) && (o) == &wth->out) outWrite(o, task->outfp); \
+	}
+
+static inline OutBuf *printOut(WorkerThread *wth, Task *task, bool ordered) {
+	if(likely(!ordered)) return &wth->out;
+	if(task->out == NULL) {
+		task->out = new OutBuf();
+		initOutBuf(task->out);
+	}
+	return task->out;
+}
+
+// before the end is seen by a joiner or waiter
+static void endOut(WorkerThread *wth, Task *task) {
+	if(wth->out.len != 0) outWrite(&wth->out, task->outfp);
+	if(task->pieces != NULL) outEnd(task);
+	if(task->outpos < 0 && task->out != NULL) {
+		outWrite(task->out, task->outfp);
+		freeOutBuf(task->out);
+		task->out = NULL;
+	}
+}
+
+static inline void unlinkChild(Task *task, Task *t) {
+	for(Task **p = &task->child; *p != NULL; p = &(*p)->sibling) {
+		if(*p == t) {
+			*p = t->sibling;
+			return;
+		}
+	}
+}
+
 void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 #ifdef USING_THCODE
 	if(wth == NULL) {
@@ -26,6 +99,12 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 	register Code *pc  = task->pc;
 	register Value *sp = task->sp;
 	Scheduler *sche = wth->sche;
+	Heap *heap = ctx->heap;
+	bool ordered = ctx->flagOrderedOutput;
+#ifdef USING_PROFILE
+	VMStat *ws = wth->stat;
+	FuncStat *fs = ws->get(task->pframes[task->pdepth - 1].func);
+#endif
 
 	SWITCHBEGIN;
 
@@ -68,9 +147,81 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 		pc += 2;
 	} NEXT();
 
+	CASE_IOP(IAND, &=);
+	CASE_IOP(IOR,  |=);
+	CASE_IOP(IXOR, ^=);
+	CASE_IOPC(IANDC, &=);
+	CASE_IOPC(IORC,  |=);
+	CASE_IOPC(IXORC, ^=);
+
+	CASE(ISHL) {
+		sp[pc[1].i].i = (int64_t)((uint64_t)sp[pc[1].i].i << (sp[pc[2].i].i & 63));
+		pc += 3;
+	} NEXT();
+
+	CASE(ISAR) {
+		sp[pc[1].i].i >>= sp[pc[2].i].i & 63;
+		pc += 3;
+	} NEXT();
+
+	CASE(ISHR) {
+		sp[pc[1].i].i = (int64_t)((uint64_t)sp[pc[1].i].i >> (sp[pc[2].i].i & 63));
+		pc += 3;
+	} NEXT();
+
+	CASE(ISHLC) {
+		sp[pc[1].i].i = (int64_t)((uint64_t)sp[pc[1].i].i << (pc[2].i & 63));
+		pc += 3;
+	} NEXT();
+
+	CASE(ISARC) {
+		sp[pc[1].i].i >>= pc[2].i & 63;
+		pc += 3;
+	} NEXT();
+
+	CASE(ISHRC) {
+		sp[pc[1].i].i = (int64_t)((uint64_t)sp[pc[1].i].i >> (pc[2].i & 63));
+		pc += 3;
+	} NEXT();
+
+	// round toward zero: add 2^n-1 to negative dividends
+	CASE(IDIVP2) {
+		int64_t x = sp[pc[1].i].i;
+		int n = pc[2].i;
+		x += (int64_t)((uint64_t)(x >> 63) >> (64 - n));
+		sp[pc[1].i].i = x >> n;
+		pc += 3;
+	} NEXT();
+
+	CASE(IMODP2) {
+		int64_t x = sp[pc[1].i].i;
+		int n = pc[2].i;
+		int64_t b = (int64_t)((uint64_t)(x >> 63) >> (64 - n));
+		sp[pc[1].i].i = ((x + b) & (((int64_t)1 << n) - 1)) - b;
+		pc += 3;
+	} NEXT();
+
+	CASE(IDIVMC) {
+		int64_t x = sp[pc[1].i].i;
+		sp[pc[1].i].i = magicDiv(x, pc);
+		pc += 5;
+	} NEXT();
+
+	CASE(IMODMC) {
+		int64_t x = sp[pc[1].i].i;
+		sp[pc[1].i].i = x - magicDiv(x, pc) * pc[2].i;
+		pc += 5;
+	} NEXT();
+
+#ifdef USING_PROFILE
+# define BRANCH(c) ctx->prof->countBranch(pc, c)
+#else
+# define BRANCH(c) (c)
+#endif
+
 #define CASE_IJMPOP(ins, op) \
 	CASE(ins) { \
-		pc += (sp[pc[2].i].i op sp[pc[3].i].i) ? pc[1].i : 4; \
+		pc += BRANCH(sp[pc[2].i].i op sp[pc[3].i].i) ? pc[1].i : 4; \
 	} NEXT();
 		
 	CASE_IJMPOP(IJMPLT, <);
@@ -82,7 +233,7 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 
 #define CASE_IJMPOPC(ins, op) \
 	CASE(ins) { \
-		pc += (sp[pc[2].i].i op pc[3].i) ? pc[1].i : 4; \
+		pc += BRANCH(sp[pc[2].i].i op pc[3].i) ? pc[1].i : 4; \
 	} NEXT();
 		
 	CASE_IJMPOPC(IJMPLTC, <);
@@ -93,6 +244,7 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 	CASE_IJMPOPC(IJMPNEC, !=);
 
 	CASE(JMP) {
+		if(pc[1].i < 0) SAFEPOINT();
 		pc += pc[1].i;
 	} NEXT();
 
@@ -106,24 +258,69 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 		pc += 3;
 	} NEXT();
 
+#define COUNT_CALL(f) { \
+		if(unlikely((f)->callcount < REOPT_CALLCOUNT)) (f)->callcount++; \
+	}
+
+#ifdef USING_PROFILE
+// only self calls are recursive, a function cannot call a later one
+# define PROF_ENTER(f) { \
+		ProfFrame *pf = &task->pframes[task->pdepth++]; \
+		pf->func = (f); \
+		pf->start = task->icount; \
+		pf->outer = pf[-1].func != (f); \
+		fs = ws->get(f); \
+		fs->calls++; \
+	}
+# define PROF_LEAVE() { \
+		ProfFrame *pf = &task->pframes[--task->pdepth]; \
+		if(pf->outer) fs->total += task->icount - pf->start; \
+		if(task->pdepth > 0) fs = ws->get(pf[-1].func); \
+	}
+# define PROF_SPAWN(t, f) { \
+		Func *cur = task->pframes[task->pdepth - 1].func; \
+		(t)->pframes[0].outer = cur != (f); \
+		ws->get(f)->spawns++; \
+		fs = ws->get(cur); \
+	}
+# define PROF_JOIN(t) { task->icount += (t)->icount; }
+#else
+# define PROF_ENTER(f)
+# define PROF_LEAVE()
+# define PROF_SPAWN(t, f)
+# define PROF_JOIN(t)
+#endif
+
 	CASE(CALL) {
+		SAFEPOINT();
+		COUNT_CALL(pc[1].func);
+		PROF_ENTER(pc[1].func);
 		Value *sp2 = sp;
 		sp += pc[2].i;
 		sp[-2].sp = sp2;
 		sp[-1].pc = pc + 3;
-#ifdef USING_THCODE
-		pc = pc[1].func->thcode;
-#else
-		pc = pc[1].func->code;
-#endif
+		pc = pc[1].func->runcode;
 	} NEXT();
 
 	CASE(SPAWN) {
+		SAFEPOINT();
+		COUNT_CALL(pc[1].func);
 		if(unlikely(!sche->isTaskEmpty())) {
 			Task *t = sche->newTask(pc[1].func, sp + pc[2].i);
 			if(unlikely(t != NULL)) {
 				// spawn
+				t->outfp = task->outfp;
+				if(task->token != NULL) {
+					t->token = task->token;
+					t->sibling = task->child;
+					task->child = t;
+				}
+				if(unlikely(ordered)) {
+					t->outpos = task->out != NULL ? task->out->len : 0;
+					t->outseq = task->nspawn++;
+				}
 				sp[pc[2].i - 3].task = t;
+				PROF_SPAWN(t, pc[1].func);
 				sche->enqueue(t);
 				pc += 3;
 				NEXT();
@@ -131,15 +328,12 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 		}
 		sp[pc[2].i - 3].task = NULL;
 		// CALL
+		PROF_ENTER(pc[1].func);
 		Value *sp2 = sp;
 		sp += pc[2].i;
 		sp[-2].sp = sp2;
 		sp[-1].pc = pc + 3;
-#ifdef USING_THCODE
-		pc = pc[1].func->thcode;
-#else
-		pc = pc[1].func->code;
-#endif
+		pc = pc[1].func->runcode;
 	} NEXT();
 
 	CASE(JOIN) {
@@ -147,12 +341,12 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 		Task *t = sp[res].task;
 		if(t != NULL) {
 			if(t->stat == TASK_RUN) {
-				task->pc = pc;
-				task->sp = sp;
-				sche->enqueue(task);
-				return;
+				REQUEUE();
 			} else {
 				sp[res] = t->stack[0];
+				PROF_JOIN(t);
+				if(task->child != NULL) unlinkChild(task, t);
+				if(unlikely(t->out != NULL)) outJoin(task, t);
 				sche->deleteTask(t);
 			}
 		} else {
@@ -161,7 +355,67 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 		pc += 2;
 	} NEXT();
 
+	CASE(SCOPE) {
+		CancelToken *tok = (CancelToken *)(sp + pc[1].i + 1);
+		tok->cancelled = 0;
+		tok->parent = task->token;
+		task->token = tok;
+		pc += 2;
+	} NEXT();
+
+	CASE(RACE) {
+		Value *g = sp + pc[1].i;
+		CancelToken *tok = (CancelToken *)(g + 1);
+		Value *fut = g + 3;
+		int n = pc[2].i;
+		if(!tok->cancelled) {
+			// the first ended branch that decides, else the default once all end
+			int kind = pc[3].i;
+			int64_t v = kind == RACE_PFIND ? -1 : 0;
+			bool decided = false, pending = false;
+			for(int i=0; i<n; i++) {
+				Task *t = fut[i * 2].task;
+				int64_t r;
+				if(t == NULL) r = fut[i * 2 + 1].i; // called in place
+				else if(t->stat != TASK_RUN) r = t->stack[0].i;
+				else {
+					pending = true;
+					continue;
+				}
+				if(kind == RACE_POR ? r != 0 : kind == RACE_PAND ? r == 0 : r != -1) {
+					v = r;
+					decided = true;
+					break;
+				}
+				if(kind == RACE_PAND && i == n - 1) v = r;
+			}
+			if(!decided && pending) {
+				SAFEPOINT();
+				REQUEUE();
+			}
+			g[0].i = v;
+			tok->cancelled = 1;
+		}
+		// the scope ends after the cancelled branches
+		for(int i=0; i<n; i++) {
+			Task *t = fut[i * 2].task;
+			if(t != NULL && t->stat == TASK_RUN) REQUEUE();
+		}
+		for(int i=0; i<n; i++) {
+			Task *t = fut[i * 2].task;
+			if(t != NULL) {
+				PROF_JOIN(t);
+				unlinkChild(task, t);
+				if(t->out != NULL) outJoin(task, t);
+				sche->deleteTask(t);
+			}
+		}
+		task->token = tok->parent;
+		pc += 4;
+	} NEXT();
+
 	CASE(RET) {
+		PROF_LEAVE();
 		Value *sp2 = sp[-2].sp;
 		sp[-2] = sp[pc[1].i];
 		pc = sp[-1].pc;
@@ -169,34 +423,148 @@ void vmrun(Context *ctx, WorkerThread *wth, Task *task) {
 	} NEXT();
 
 	CASE(RETC) {
+		PROF_LEAVE();
 		Value *sp2 = sp[-2].sp;
 		sp[-2].i = pc[1].i;
 		pc = sp[-1].pc;
 		sp = sp2;
 	} NEXT();
 
+	CASE(FCALL) {
+		Value *a = sp + pc[2].i;
+		a[0].i = callForeign(pc[1].ffi, a);
+		pc += 3;
+	} NEXT();
+
+	CASE(MEMO) {
+		int64_t v;
+		MemoEntry *e = NULL;
+		MemoResult res = memoHit(pc[1].memo, sp, &v) ? MEMO_HIT :
+			memoLookup(pc[1].memo, sp, task, &v, &e);
+		if(res == MEMO_HIT) {
+			// RETC v
+			PROF_LEAVE();
+			Value *sp2 = sp[-2].sp;
+			sp[-2].i = v;
+			pc = sp[-1].pc;
+			sp = sp2;
+			NEXT();
+		}
+		if(res == MEMO_WAIT) {
+			SAFEPOINT();
+			REQUEUE();
+		}
+		sp[pc[2].i].claim = e;
+		pc += 3;
+	} NEXT();
+
+	CASE(MEMOSET) {
+		// a cancelled task may have joined cancelled children, the
+		// value is not stored
+		SAFEPOINT();
+		Value *a = sp + pc[2].i;
+		if(a[0].claim != NULL) memoStore(a[0].claim, a[1].i, task);
+		pc += 3;
+	} NEXT();
+
+	CASE(HASH) {
+		Value *a = sp + pc[1].i;
+		HashTable *t = getHashTable(ctx->hashtabs, a[0].i);
+		a[0].i = likely(t != NULL) && pc[2].i == HK_GET ? hashGet(t, a[1].i, a[2].i) :
+			hashOp(ctx, (int)pc[2].i, a);
+		pc += 3;
+	} NEXT();
+
+	CASE(CONS) {
+		Value *a = sp + pc[1].i;
+		Cell *c = allocCell(&wth->alloc);
+		if(unlikely(c == NULL)) c = heap->allocSlow(wth, task);
+		c->car = a[0];
+		c->cdr = a[1];
+		a[0].cell = c;
+		pc += 2;
+	} NEXT();
+
+	// of NIL or an int is NIL
+	CASE(CAR) {
+		Value *a = sp + pc[1].i;
+		if(heap->isCell(a[0].i)) a[0] = a[0].cell->car;
+		else a[0].i = 0;
+		pc += 2;
+	} NEXT();
+
+	CASE(CDR) {
+		Value *a = sp + pc[1].i;
+		if(heap->isCell(a[0].i)) a[0] = a[0].cell->cdr;
+		else a[0].i = 0;
+		pc += 2;
+	} NEXT();
+
+	// an int that is a cell is printed as a list
 	CASE(IPRINT) {
-		fprintf(stdout, "%ld\n", (long int)sp[pc[1].i].i);
+		OutBuf *o = printOut(wth, task, ordered);
+		heap->print(o, sp[pc[1].i].i);
+		PRINTED(o);
+		pc += 2;
+	} NEXT();
+
+	CASE(LPRINT) {
+		OutBuf *o = printOut(wth, task, ordered);
+		int64_t v = sp[pc[1].i].i;
+		if(v == 0) outPuts(o, "NIL");
+		else heap->print(o, v);
+		PRINTED(o);
 		pc += 2;
 	} NEXT();
 
 	CASE(FPRINT) {
-		fprintf(stdout, "%lf\n", sp[pc[1].i].f);
+		OutBuf *o = printOut(wth, task, ordered);
+		outFloat(o, sp[pc[1].i].f);
+		PRINTED(o);
 		pc += 2;
 	} NEXT();
 	
 	CASE(BPRINT) {
-		fprintf(stdout, "%s\n", sp[pc[1].i].i ? "T" : "NIL");
+		OutBuf *o = printOut(wth, task, ordered);
+		outPuts(o, sp[pc[1].i].i ? "T" : "NIL");
+		PRINTED(o);
 		pc += 2;
 	} NEXT();
 
 	CASE(DEFUN) {
-		defun(ctx, pc[1].cons);
+		try {
+			defun(ctx, pc[1].cons);
+		} catch(const char *) {
+			// the error is printed, the rest of the form runs
+		}
 		pc += 2;
 	} NEXT();
 
 	CASE(END) {
-		task->stat = TASK_END;
+		endOut(wth, task);
+		sche->endRun();
+		if(unlikely(!CAS(task->stat, TASK_RUN, TASK_END))) {
+			sche->endTask(task); // TASK_WAIT
+		}
+		return;
+	}
+
+	L_CANCEL: {
+		while(task->child != NULL) {
+			Task *t = task->child;
+			if(t->stat == TASK_RUN) REQUEUE();
+			task->child = t->sibling;
+			PROF_JOIN(t);
+			if(t->out != NULL) outJoin(task, t);
+			sche->deleteTask(t);
+		}
+		if(task->claims != NULL) memoRelease(task);
+		task->stack[0].i = 0;
+		endOut(wth, task);
+		sche->endRun();
+		if(unlikely(!CAS(task->stat, TASK_RUN, TASK_END))) {
+			sche->endTask(task);
+		}
 		return;
 	}
 
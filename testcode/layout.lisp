@@ -0,0 +1,12 @@
+(defun f0 (a) (if (<= a 0) 0 (- (f0 (- a 1)) 0)))
+(defun f1 (a) (- (f0 a) 12345))
+(defun f2 (a b) (f1 b))
+(f0 10)
+(f2 5 3)
+(f1 1)
+(defun g0 (a) (if (< a 100) (+ a 1) (if (< a 200) (* a 2) (- a 1))))
+(defun g1 (n s) (if (<= n 0) s (g1 (- n 1) (+ s (g0 (mod n 300))))))
+(g1 500 0)
+(g1 500 0)
+(g1 500 0)
+(f2 5 20)
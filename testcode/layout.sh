@@ -0,0 +1,22 @@
+#!/bin/sh
+# block layout test: the output with a profile from -prof-out must be
+# the same as without one
+# usage: testcode/layout.sh [lisp] [lisp-prof] [file]
+LISP=${1:-./lisp}
+LISPPROF=${2:-./lisp-prof}
+SRC=${3:-testcode/layout.lisp}
+PROF=/tmp/lisp_layout.$$.prof
+
+$LISP $SRC > $PROF.want
+$LISPPROF -prof-out $PROF $SRC > /dev/null
+timeout 10 $LISP -prof-use $PROF $SRC > $PROF.got
+if cmp -s $PROF.want $PROF.got; then
+	echo "layout: ok"
+	RES=0
+else
+	echo "layout: FAIL"
+	diff $PROF.want $PROF.got
+	RES=1
+fi
+rm -f $PROF $PROF.want $PROF.got
+exit $RES